@@ -241,6 +241,7 @@ ATOM(bool_t, keyring,                   0, boolean,, "")
 ATOM(bool_t, mdprequests,               0, boolean,, "")
 ATOM(bool_t, mdp_filter,                0, boolean,, "")
 ATOM(bool_t, msp,                       0, boolean,, "")
+ATOM(bool_t, nomspsack,                 0, boolean,, "")
 ATOM(bool_t, monitor,                   0, boolean,, "")
 ATOM(bool_t, radio_link,                0, boolean,, "")
 ATOM(bool_t, overlaybuffer,             0, boolean,, "")
@@ -340,9 +341,26 @@ ATOM(bool_t,                route,           1, boolean,, "If false, do not adve
 ATOM(short,                 encapsulation,   ENCAP_OVERLAY, encapsulation,, "Type of packet encapsulation")
 END_STRUCT
 
+ARRAY(flow_weight_list, NO_DUPLICATES)
+KEY_ATOM(sid_t, sid)
+VALUE_ATOM(uint16_t, uint16_nonzero)
+END_ARRAY(16)
+
+STRUCT(mdp_queue)
+ATOM(int32_t,               quantum,      1200, int32_nonneg,, "Bytes each flow may send per fair queueing round within a traffic class, 0 to send in arrival order")
+ATOM(uint16_t,              local_weight, 1, uint16_nonzero,, "Rounds' worth of bytes given to each flow originating from this node")
+SUB_STRUCT(flow_weight_list, weight,)
+END_STRUCT
+
 STRUCT(mdp)
 ATOM(bool_t,                enable_inet, 0, boolean,, "If true, allow mdp clients to connect over loopback UDP")
 STRING(256,                 filter_rules_path, "", str_nonempty,, "Path of file containing MDP filter rules, either absolute or relative to instance directory")
+ATOM(uint32_t,              subscriber_limit, 10000, uint32_nonzero,, "Number of known SIDs above which the least recently used unreachable ones are forgotten")
+ATOM(uint32_t,              link_state_refresh_ms, 20000, uint32_nonzero,, "Interval between repeats of unchanged link state advertisements")
+ATOM(uint32_t,              crypto_cache_size, 512, uint32_nonzero,, "Number of crypto_box shared secrets to remember")
+ATOM(bool_t,                crypto_precompute, 0, boolean,, "If true, calculate the shared secret with each peer as soon as it becomes reachable")
+ATOM(int32_t,               crypto_threads, 0, int32_nonneg,, "Number of threads used to encrypt and decrypt MDP payloads, zero to use the main thread")
+SUB_STRUCT(mdp_queue,       queue,)
 END_STRUCT
 
 STRUCT(vomp)
@@ -462,6 +480,7 @@ ATOM(short,                 radiotype,       RADIO_TYPE_RFD900, radio_type,, "Ty
 SUB_STRUCT(mdp_iftype,      broadcast,)
 SUB_STRUCT(mdp_iftype,      unicast,)
 ATOM(int32_t,               idle_tick_ms,    5000, int32_nonneg,, "Tick interval when no peers are present")
+ATOM(uint16_t,              rx_batch,        8, uint16_nonzero,, "Maximum number of datagrams to read from a dgram interface per poll wakeup")
 ATOM(bool_t,                default_route,   0, boolean,, "If true, use this interface as a default route")
 ATOM(bool_t,                prefer_unicast,  1, boolean,, "If true, send data as unicast IP packets if available")
 ATOM(bool_t,                debug,           0, boolean,, "If true, log details of every outgoing packet")
@@ -487,6 +506,7 @@ END_ARRAY(10)
 STRUCT(api_restful)
 SUB_STRUCT(userlist,        users,)
 ATOM(uint32_t,              newsince_timeout,       60, uint32_time_interval,, "Time to block while reporting new bundles")
+ATOM(uint32_t,              stream_keepalive,       30, uint32_time_interval,, "Time between keep-alive comments on an idle bundle event stream")
 END_STRUCT
 
 STRUCT(api)
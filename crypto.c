@@ -18,10 +18,35 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include "serval.h"
+#include "conf.h"
 #include "overlay_address.h"
 #include "crypto.h"
 #include "keyring.h"
 
+/* Signed broadcasts are often heard several times, over more than one interface.  Remember
+ * recently verified signatures, so that another copy only costs the hash of the message.
+ * Entries are keyed by the signing key, the SHA-512 of the message and the signature itself, so
+ * a hit can only occur for exactly the bytes that were already verified.
+ */
+#define VERIFIED_CACHE_SIZE 64
+
+struct verified_signature {
+  unsigned char sas_public[SAS_SIZE];
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  unsigned char signature[SIGNATURE_BYTES];
+  uint8_t valid;
+};
+
+static struct verified_signature verified_cache[VERIFIED_CACHE_SIZE];
+static unsigned verified_hits=0;
+static unsigned verified_misses=0;
+
+static void verified_count(unsigned *counter)
+{
+  (*counter)++;
+  if (((verified_hits + verified_misses) & 0xFF) == 0)
+    DEBUGF(keyring, "Verified %u signatures, %u were repeats", verified_hits + verified_misses, verified_hits);
+}
 
 // verify the signature at the end of a message, on return message_len will be reduced by the length of the signature.
 int crypto_verify_message(struct subscriber *subscriber, unsigned char *message, size_t *message_len)
@@ -38,10 +63,26 @@ int crypto_verify_message(struct subscriber *subscriber, unsigned char *message,
   
   unsigned char hash[crypto_hash_sha512_BYTES];
   crypto_hash_sha512(hash,message,*message_len);
+  const unsigned char *signature = &message[*message_len];
   
-  if (crypto_sign_verify_detached(&message[*message_len], hash, crypto_hash_sha512_BYTES, subscriber->sas_public))
+  struct verified_signature *v = &verified_cache[(hash[0] | hash[1]<<8) % VERIFIED_CACHE_SIZE];
+  if (v->valid
+    && memcmp(v->hash, hash, sizeof hash)==0
+    && memcmp(v->signature, signature, SIGNATURE_BYTES)==0
+    && memcmp(v->sas_public, subscriber->sas_public, SAS_SIZE)==0){
+    verified_count(&verified_hits);
+    return 0;
+  }
+  
+  if (crypto_sign_verify_detached(signature, hash, crypto_hash_sha512_BYTES, subscriber->sas_public))
     return WHY("Signature verification failed");
-
+  
+  verified_count(&verified_misses);
+  
+  memcpy(v->sas_public, subscriber->sas_public, SAS_SIZE);
+  memcpy(v->hash, hash, sizeof hash);
+  memcpy(v->signature, signature, SIGNATURE_BYTES);
+  v->valid = 1;
   return 0;
 }
 
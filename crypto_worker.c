@@ -0,0 +1,205 @@
+/*
+Serval DNA crypto worker threads
+Copyright 2016 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Bulk encrypted traffic can keep the main thread busy with crypto_box operations, delaying
+  routing and other timers.  When mdp.crypto_threads is set, those operations are handed to a
+  small pool of threads instead.
+
+  The threads only ever touch the job they are given; no logging, no config, no subscribers.
+  Each pair of subscribers is always handled by the same thread, so packets in one flow are
+  completed in the order they were submitted.  Finished jobs are handed back through a pipe that
+  the main loop is watching.
+*/
+
+#include <pthread.h>
+#include "serval.h"
+#include "conf.h"
+#include "net.h"
+#include "fdqueue.h"
+#include "server.h"
+#include "overlay_address.h"
+#include "crypto_worker.h"
+
+#define CRYPTO_MAX_WORKERS 8
+
+struct crypto_worker{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // jobs waiting for this thread, and jobs it has finished, both oldest first
+  struct crypto_job *pending;
+  struct crypto_job **pending_tail;
+  struct crypto_job *completed;
+  struct crypto_job **completed_tail;
+};
+
+static struct crypto_worker workers[CRYPTO_MAX_WORKERS];
+static unsigned worker_count=0;
+static int completion_pipe[2]={-1,-1};
+static char workers_failed=0;
+
+// jobs that have been submitted but not completed, only touched by the main thread
+static struct crypto_job *outstanding=NULL;
+
+static void crypto_jobs_completed(struct sched_ent *alarm);
+static struct profile_total crypto_jobs_stats = { .name="crypto_jobs_completed" };
+static struct sched_ent crypto_jobs_alarm = {
+  .function = crypto_jobs_completed,
+  .stats = &crypto_jobs_stats,
+  .poll={.fd = -1},
+};
+
+static void *crypto_worker_run(void *context)
+{
+  struct crypto_worker *worker = context;
+  pthread_mutex_lock(&worker->mutex);
+  while(1){
+    while(!worker->pending)
+      pthread_cond_wait(&worker->cond, &worker->mutex);
+    struct crypto_job *job = worker->pending;
+    worker->pending = job->_next;
+    if (!worker->pending)
+      worker->pending_tail = &worker->pending;
+    pthread_mutex_unlock(&worker->mutex);
+
+    if (job->open)
+      job->result = crypto_box_open_easy_afternm(job->out, job->in, job->in_len, job->nonce, job->key);
+    else
+      job->result = crypto_box_easy_afternm(job->out, job->in, job->in_len, job->nonce, job->key);
+
+    pthread_mutex_lock(&worker->mutex);
+    job->_next = NULL;
+    *worker->completed_tail = job;
+    worker->completed_tail = &job->_next;
+    // if the pipe is full, the main thread already has a wake up waiting
+    char wake = 0;
+    ssize_t r = write(completion_pipe[1], &wake, 1);
+    (void)r;
+  }
+  return NULL;
+}
+
+static int crypto_workers_start()
+{
+  unsigned count = config.mdp.crypto_threads;
+  if (count > CRYPTO_MAX_WORKERS)
+    count = CRYPTO_MAX_WORKERS;
+
+  if (pipe(completion_pipe)==-1)
+    return WHY_perror("pipe");
+  set_nonblock(completion_pipe[0]);
+  set_nonblock(completion_pipe[1]);
+  crypto_jobs_alarm.poll.fd = completion_pipe[0];
+  crypto_jobs_alarm.poll.events = POLLIN;
+  watch(&crypto_jobs_alarm);
+
+  unsigned i;
+  for (i=0;i<count;i++){
+    struct crypto_worker *worker = &workers[i];
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    worker->pending_tail = &worker->pending;
+    worker->completed_tail = &worker->completed;
+    int err = pthread_create(&worker->thread, NULL, crypto_worker_run, worker);
+    if (err){
+      WHYF("pthread_create() failed: %s", strerror(err));
+      break;
+    }
+    worker_count++;
+  }
+  INFOF("Started %u crypto worker threads", worker_count);
+  return worker_count ? 0 : -1;
+}
+
+// Should crypto_box operations be submitted as jobs?
+// The pool is sized when it is first used, and kept until the daemon exits.
+int crypto_workers_enabled()
+{
+  if (worker_count)
+    return 1;
+  if (!serverMode || workers_failed || config.mdp.crypto_threads <= 0)
+    return 0;
+  if (crypto_workers_start()==-1){
+    workers_failed = 1;
+    return 0;
+  }
+  return 1;
+}
+
+void crypto_job_submit(struct crypto_job *job)
+{
+  assert(worker_count);
+
+  job->_next_outstanding = outstanding;
+  job->_prev_outstanding = &outstanding;
+  if (outstanding)
+    outstanding->_prev_outstanding = &job->_next_outstanding;
+  outstanding = job;
+
+  uintptr_t flow = (uintptr_t)job->source ^ (uintptr_t)job->destination;
+  flow ^= flow >> 12;
+  struct crypto_worker *worker = &workers[(flow >> 4) % worker_count];
+
+  pthread_mutex_lock(&worker->mutex);
+  job->_next = NULL;
+  *worker->pending_tail = job;
+  worker->pending_tail = &job->_next;
+  pthread_cond_signal(&worker->cond);
+  pthread_mutex_unlock(&worker->mutex);
+}
+
+static void crypto_jobs_completed(struct sched_ent *alarm)
+{
+  if (alarm->poll.revents & POLLIN){
+    char buff[64];
+    while(read(alarm->poll.fd, buff, sizeof buff) > 0)
+      ;
+  }
+
+  unsigned i;
+  for (i=0;i<worker_count;i++){
+    struct crypto_worker *worker = &workers[i];
+    pthread_mutex_lock(&worker->mutex);
+    struct crypto_job *job = worker->completed;
+    worker->completed = NULL;
+    worker->completed_tail = &worker->completed;
+    pthread_mutex_unlock(&worker->mutex);
+
+    while(job){
+      struct crypto_job *next = job->_next;
+      *job->_prev_outstanding = job->_next_outstanding;
+      if (job->_next_outstanding)
+	job->_next_outstanding->_prev_outstanding = job->_prev_outstanding;
+      job->done(job);
+      job = next;
+    }
+  }
+}
+
+static void crypto_jobs_mark_subscribers()
+{
+  struct crypto_job *job;
+  for (job = outstanding; job; job = job->_next_outstanding){
+    mark_subscriber_in_use(job->source);
+    mark_subscriber_in_use(job->destination);
+  }
+}
+
+DEFINE_TRIGGER(subscriber_mark, crypto_jobs_mark_subscribers);
@@ -0,0 +1,62 @@
+/*
+Serval DNA crypto worker threads
+Copyright 2016 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVAL_DNA__CRYPTO_WORKER_H
+#define __SERVAL_DNA__CRYPTO_WORKER_H
+
+#include "sodium.h"
+
+struct subscriber;
+struct crypto_job;
+
+typedef void (*crypto_job_done)(struct crypto_job *job);
+
+/* A crypto_box operation to be performed away from the main thread.  Embed this as the first
+ * member of a larger struct to carry any other state through to the done function.
+ *
+ * Everything the job points to belongs to the worker until the done function is called.  Done
+ * functions are called from the main thread, in the order that jobs were submitted for the same
+ * pair of subscribers.
+ */
+struct crypto_job{
+  struct crypto_job *_next;
+  struct crypto_job *_next_outstanding;
+  struct crypto_job **_prev_outstanding;
+
+  // which flow does this job belong to?
+  struct subscriber *source;
+  struct subscriber *destination;
+
+  // crypto_box_open_easy_afternm() if set, otherwise crypto_box_easy_afternm()
+  uint8_t open;
+  unsigned char key[crypto_box_BEFORENMBYTES];
+  unsigned char nonce[crypto_box_NONCEBYTES];
+  const unsigned char *in;
+  size_t in_len;
+  unsigned char *out;
+
+  // 0 if the operation succeeded
+  int result;
+  crypto_job_done done;
+};
+
+int crypto_workers_enabled();
+void crypto_job_submit(struct crypto_job *job);
+
+#endif
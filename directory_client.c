@@ -150,3 +150,9 @@ static void directory_link_changed(struct subscriber *subscriber, int UNUSED(pri
 }
 
 DEFINE_TRIGGER(link_change, directory_link_changed);
+
+static void directory_mark_subscribers(){
+  mark_subscriber_in_use(directory_service);
+}
+
+DEFINE_TRIGGER(subscriber_mark, directory_mark_subscribers);
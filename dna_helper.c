@@ -142,6 +142,14 @@ static int discarding_until_nl = 0;
 static char reply_buffer[2048];
 static char *reply_bufend = NULL;
 
+static void
+dna_helper_mark_subscribers()
+{
+  mark_subscriber_in_use(request_source);
+}
+
+DEFINE_TRIGGER(subscriber_mark, dna_helper_mark_subscribers);
+
 static void
 dna_helper_close_pipes()
 {
@@ -31,6 +31,7 @@ HDRS=	fifo.h \
 	conf.h \
 	conf_schema.h \
 	crypto.h \
+	crypto_worker.h \
 	dataformats.h \
 	log.h \
 	debug.h \
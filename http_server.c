@@ -70,6 +70,7 @@ const char CONTENT_TYPE_TEXT[] = "text/plain";
 const char CONTENT_TYPE_HTML[] = "text/html";
 const char CONTENT_TYPE_JSON[] = "application/json";
 const char CONTENT_TYPE_BLOB[] = "application/octet-stream";
+const char CONTENT_TYPE_EVENT_STREAM[] = "text/event-stream";
 
 static struct profile_total http_server_stats = {
   .name = "http_server_poll",
@@ -63,6 +63,7 @@ extern const char CONTENT_TYPE_TEXT[];
 extern const char CONTENT_TYPE_HTML[];
 extern const char CONTENT_TYPE_JSON[];
 extern const char CONTENT_TYPE_BLOB[];
+extern const char CONTENT_TYPE_EVENT_STREAM[];
 
 struct mime_content_type {
   char type[64];
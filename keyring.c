@@ -20,6 +20,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <stdio.h>
 #include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include "serval.h"
 #include "rhizome.h"
 #include "conf.h"
@@ -36,9 +40,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "rotbuf.h"
 #include "server.h"
 #include "route_link.h"
+#include "commandline.h"
 
 static keyring_file *keyring_open_or_create(const char *path, int writeable);
 static int keyring_initialise(keyring_file *k);
+static int keyring_journal_replay(keyring_file *k);
 static int keyring_load(keyring_file *k, const char *pin);
 static keyring_file *keyring_open_create_instance(const char *pin, int force_create);
 static void keyring_free_keypair(keypair *kp);
@@ -102,6 +108,19 @@ static keyring_file *keyring_open_or_create(const char *path, int writeable)
     return NULL;
   }
   k->file_size = ftello(k->file);
+  /* Finish any commit that was interrupted after its journal was written. */
+  if ((fcntl(fileno(k->file), F_GETFL) & O_ACCMODE) != O_RDONLY) {
+    if ((k->journal_path = emalloc(strlen(path) + sizeof ".journal")) == NULL) {
+      keyring_free(k);
+      return NULL;
+    }
+    strcpy(k->journal_path, path);
+    strcat(k->journal_path, ".journal");
+    if (keyring_journal_replay(k) == -1) {
+      keyring_free(k);
+      return NULL;
+    }
+  }
   return k;
 }
 
@@ -217,20 +236,163 @@ keypair *keyring_identity_keytype(const keyring_identity *id, unsigned keytype)
   return kp;
 }
 
-keypair *keyring_find_did(keyring_iterator *it, const char *did)
+/* Unlocked keypairs are hashed into one of three indexes on the keyring file, so that SID, DID
+ * and public tag lookups don't have to walk every keypair of every identity.
+ * Identities are only ever appended to k->identities, so their sequence numbers give the same
+ * order as keyring_next_key(), and an index lookup can resume from any iterator position.
+ */
+static uint32_t index_hash(const unsigned char *bytes, size_t len, int fold_case)
 {
-  keypair *kp;
-  while((kp=keyring_next_keytype(it, KEYTYPE_DID))){
-    if ((!did[0])
-	||(did[0]=='*'&&did[1]==0)
-	||(!strcasecmp(did,(char *)kp->private_key))
-    ) {
-      return kp;
-    }
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    hash ^= fold_case ? (unsigned char)tolower(bytes[i]) : bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static const sid_t *keypair_box_pk(const keypair *kp)
+{
+  if (kp->type == KEYTYPE_CRYPTOBOX)
+    return (const sid_t *)kp->public_key;
+  if (kp->type == KEYTYPE_CRYPTOCOMBINED)
+    return &((const struct combined_pk *)kp->public_key)->box_key;
+  return NULL;
+}
+
+static uint32_t did_hash(const char *did)
+{
+  return index_hash((const unsigned char *)did, strnlen(did, 32), 1);
+}
+
+static keypair **keyring_index_bucket(keyring_file *k, const keypair *kp, uint32_t *hash)
+{
+  const sid_t *box_pk;
+  switch (kp->type) {
+    case KEYTYPE_CRYPTOBOX:
+    case KEYTYPE_CRYPTOCOMBINED:
+      if (!kp->public_key)
+	return NULL;
+      box_pk = keypair_box_pk(kp);
+      *hash = index_hash(box_pk->binary, SID_SIZE, 0);
+      return &k->sid_index[*hash % KEYRING_INDEX_BUCKETS];
+    case KEYTYPE_DID:
+      if (!kp->private_key)
+	return NULL;
+      *hash = did_hash((const char *)kp->private_key);
+      return &k->did_index[*hash % KEYRING_INDEX_BUCKETS];
+    case KEYTYPE_PUBLIC_TAG:
+      if (!kp->public_key)
+	return NULL;
+      *hash = index_hash(kp->public_key, kp->public_key_len, 0);
+      return &k->tag_index[*hash % KEYRING_INDEX_BUCKETS];
   }
   return NULL;
 }
 
+static void keyring_index_keypair(keyring_identity *id, keypair *kp)
+{
+  assert(!kp->_prev_indexed);
+  if (!id->file)
+    return;
+  keypair **bucket = keyring_index_bucket(id->file, kp, &kp->_index_hash);
+  if (!bucket)
+    return;
+  kp->_identity = id;
+  kp->_next_indexed = *bucket;
+  kp->_prev_indexed = bucket;
+  if (*bucket)
+    (*bucket)->_prev_indexed = &kp->_next_indexed;
+  *bucket = kp;
+}
+
+static void keyring_unindex_keypair(keypair *kp)
+{
+  if (!kp->_prev_indexed)
+    return;
+  *kp->_prev_indexed = kp->_next_indexed;
+  if (kp->_next_indexed)
+    kp->_next_indexed->_prev_indexed = kp->_prev_indexed;
+  kp->_next_indexed = NULL;
+  kp->_prev_indexed = NULL;
+  kp->_identity = NULL;
+}
+
+/* Append a newly unlocked or created identity to the keyring and index its keypairs */
+static void keyring_append_identity(keyring_file *k, keyring_identity *id)
+{
+  keyring_identity **i=&k->identities;
+  while(*i)
+    i=&(*i)->next;
+  *i=id;
+  id->file = k;
+  id->sequence = k->next_sequence++;
+  keypair *kp;
+  for (kp = id->keypairs; kp; kp = kp->next)
+    keyring_index_keypair(id, kp);
+}
+
+// Does keypair b follow keypair a within the same identity?
+static int keypair_follows(const keypair *a, const keypair *b)
+{
+  for (a = a->next; a; a = a->next)
+    if (a == b)
+      return 1;
+  return 0;
+}
+
+// Would keyring_next_key() reach this keypair before reaching the end of the keyring?
+static int iterator_before(const keyring_iterator *it, const keypair *kp)
+{
+  if (!it->identity)
+    return 1;
+  if (kp->_identity != it->identity)
+    return kp->_identity->sequence > it->identity->sequence;
+  return it->keypair && keypair_follows(it->keypair, kp);
+}
+
+/* Return the first keypair in the bucket that satisfies match() and is after the iterator's
+ * position, leaving the iterator on it as keyring_next_key() would have.
+ */
+static keypair *keyring_index_find(keyring_iterator *it, keypair *bucket, uint32_t hash,
+  int (*match)(const keypair *, const void *), const void *context)
+{
+  keypair *found = NULL;
+  keypair *kp;
+  for (kp = bucket; kp; kp = kp->_next_indexed) {
+    if (kp->_index_hash != hash || !match(kp, context) || !iterator_before(it, kp))
+      continue;
+    if (!found
+      || kp->_identity->sequence < found->_identity->sequence
+      || (kp->_identity == found->_identity && keypair_follows(kp, found)))
+      found = kp;
+  }
+  if (found) {
+    it->identity = found->_identity;
+    it->keypair = found;
+  } else {
+    it->identity = NULL;
+    it->keypair = NULL;
+  }
+  return found;
+}
+
+static int match_did(const keypair *kp, const void *did)
+{
+  return kp->type == KEYTYPE_DID && strcasecmp((const char *)did, (const char *)kp->private_key) == 0;
+}
+
+keypair *keyring_find_did(keyring_iterator *it, const char *did)
+{
+  if (did[0] && !(did[0]=='*' && did[1]==0)) {
+    uint32_t hash = did_hash(did);
+    return keyring_index_find(it, it->file->did_index[hash % KEYRING_INDEX_BUCKETS], hash, match_did, did);
+  }
+  // wildcard, every DID matches
+  return keyring_next_keytype(it, KEYTYPE_DID);
+}
+
 const uint8_t * keyring_get_box(const keyring_identity *id)
 {
   keypair *kp = id->keypairs;
@@ -246,44 +408,34 @@ const uint8_t * keyring_get_box(const keyring_identity *id)
   return NULL;
 }
 
+static int match_sid(const keypair *kp, const void *sidp)
+{
+  const sid_t *box_pk = keypair_box_pk(kp);
+  return box_pk && memcmp(((const sid_t *)sidp)->binary, box_pk->binary, SID_SIZE) == 0;
+}
+
 int keyring_find_box(keyring_iterator *it, const sid_t *sidp, const uint8_t **sk)
 {
-  keypair *kp;
-  while((kp=keyring_next_key(it))){
-    if (kp->type == KEYTYPE_CRYPTOBOX){
-      if (memcmp(sidp->binary, kp->public_key, SID_SIZE) == 0){
-	if (sk)
-	  *sk = kp->private_key;
-	return 1;
-      }
-    }else if(kp->type == KEYTYPE_CRYPTOCOMBINED){
-      struct combined_pk *pk = (struct combined_pk *)kp->public_key;
-      if (memcmp(sidp->binary, pk->box_key.binary, SID_SIZE) == 0){
-	if (sk){
-	  struct combined_sk *secret = (struct combined_sk *)kp->private_key;
-	  *sk = secret->box_key;
-	}
-	return 1;
-      }
+  uint32_t hash = index_hash(sidp->binary, SID_SIZE, 0);
+  keypair *kp = keyring_index_find(it, it->file->sid_index[hash % KEYRING_INDEX_BUCKETS], hash, match_sid, sidp);
+  if (!kp)
+    return 0;
+  if (sk){
+    if (kp->type == KEYTYPE_CRYPTOBOX)
+      *sk = kp->private_key;
+    else{
+      struct combined_sk *secret = (struct combined_sk *)kp->private_key;
+      *sk = secret->box_key;
     }
   }
-  return 0;
+  return 1;
 }
 
 keyring_identity *keyring_find_identity(keyring_file *k, const sid_t *sidp){
-  keypair *kp;
   keyring_iterator it;
   keyring_iterator_start(k, &it);
-  while((kp=keyring_next_key(&it))){
-    if (kp->type == KEYTYPE_CRYPTOBOX){
-      if (memcmp(sidp->binary, kp->public_key, SID_SIZE) == 0)
-	return it.identity;
-    }else if(kp->type == KEYTYPE_CRYPTOCOMBINED){
-      struct combined_pk *pk = (struct combined_pk *)kp->public_key;
-      if (memcmp(sidp->binary, pk->box_key.binary, SID_SIZE) == 0)
-	return it.identity;
-    }
-  }
+  if (keyring_find_sid(&it, sidp))
+    return it.identity;
   return NULL;
 }
 
@@ -313,6 +465,10 @@ void keyring_free(keyring_file *k)
   /* Close keyring file handle */
   if (k->file) fclose(k->file);
   k->file=NULL;
+  if (k->journal_path) {
+    free(k->journal_path);
+    k->journal_path = NULL;
+  }
 
   /* Free BAMs (no substructure, so easy) */
   keyring_bam *b=k->bam;
@@ -414,23 +570,64 @@ void keyring_free_identity(keyring_identity *id)
   level function, and all we need to know here is that we shouldn't decrypt the
   first 96 bytes of the block.
 */
+static void keyring_munge_nonce(unsigned char *hashNonce,
+  const unsigned char *KeyRingSalt, int KeyRingSaltLen,
+  const char *KeyRingPin, const char *PKRPin)
+{
+  /* Form the nonce as hash of various other concatenated inputs.
+     This doesn't depend on the block, so callers trying many blocks with the same
+     pins only need to compute it once. */
+  crypto_hash_sha512_state context;
+  crypto_hash_sha512_init(&context);
+  crypto_hash_sha512_update(&context, (const unsigned char *)KeyRingPin, strlen(KeyRingPin));
+  crypto_hash_sha512_update(&context, KeyRingSalt, KeyRingSaltLen);
+  crypto_hash_sha512_update(&context, (const unsigned char *)KeyRingPin, strlen(KeyRingPin));
+  crypto_hash_sha512_update(&context, (const unsigned char *)PKRPin, strlen(PKRPin));
+  crypto_hash_sha512_final(&context, hashNonce);
+  bzero(&context, sizeof context);
+}
+
+/* En/decrypt a block given a nonce from keyring_munge_nonce().  This neither logs nor allocates, so
+ * it may be called from any thread.
+ */
+static void keyring_munge_block_nonce(unsigned char *block, int len, const unsigned char *hashNonce,
+  const char *KeyRingPin, const char *PKRPin)
+{
+  unsigned char hashKey[crypto_hash_sha512_BYTES];
+  const unsigned char *PKRSalt=&block[0];
+  int PKRSaltLen=32;
+
+  /* Form key as hash of various concatenated inputs.
+     The ordering and repetition of the inputs is designed to make rainbow tables
+     infeasible */
+  crypto_hash_sha512_state context;
+  crypto_hash_sha512_init(&context);
+  crypto_hash_sha512_update(&context, PKRSalt, PKRSaltLen);
+  crypto_hash_sha512_update(&context, (const unsigned char *)PKRPin, strlen(PKRPin));
+  crypto_hash_sha512_update(&context, PKRSalt, PKRSaltLen);
+  crypto_hash_sha512_update(&context, (const unsigned char *)KeyRingPin, strlen(KeyRingPin));
+  crypto_hash_sha512_final(&context, hashKey);
+
+  /* Now en/de-crypt the remainder of the block.
+     We do this in-place for convenience, so you should not pass in a mmap()'d
+     lump. */
+  crypto_stream_xsalsa20_xor(&block[96],&block[96],len-96, hashNonce,hashKey);
+
+  /* Wipe out all sensitive structures before returning */
+  bzero(&context, sizeof context);
+  bzero(&hashKey[0],crypto_hash_sha512_BYTES);
+}
+
 static int keyring_munge_block(
   unsigned char *block, int len /* includes the first 96 bytes */,
   unsigned char *KeyRingSalt, int KeyRingSaltLen,
   const char *KeyRingPin, const char *PKRPin)
 {
   DEBUGF(keyring, "KeyRingPin=%s PKRPin=%s", alloca_str_toprint(KeyRingPin), alloca_str_toprint(PKRPin));
-  int exit_code=1;
-  unsigned char hashKey[crypto_hash_sha512_BYTES];
   unsigned char hashNonce[crypto_hash_sha512_BYTES];
 
-  unsigned char work[65536];
-
   if (len<96) return WHY("block too short");
 
-  unsigned char *PKRSalt=&block[0];
-  int PKRSaltLen=32;
-
 #if crypto_box_SECRETKEYBYTES>crypto_hash_sha512_BYTES
 #error crypto primitive key size too long -- hash needs to be expanded
 #endif
@@ -438,50 +635,10 @@ static int keyring_munge_block(
 #error crypto primitive nonce size too long -- hash needs to be expanded
 #endif
 
-  /* Generate key and nonce hashes from the various inputs */
-  unsigned ofs;
-#define APPEND(buf, len) { \
-    assert(ofs <= sizeof work); \
-    unsigned __len = (len); \
-    if (__len > sizeof work - ofs) { \
-      WHY("Input too long"); \
-      goto kmb_safeexit; \
-    } \
-    bcopy((buf), &work[ofs], __len); \
-    ofs += __len; \
-  }
-  /* Form key as hash of various concatenated inputs.
-     The ordering and repetition of the inputs is designed to make rainbow tables
-     infeasible */
-  ofs=0;
-  APPEND(PKRSalt,PKRSaltLen);
-  APPEND(PKRPin,strlen(PKRPin));
-  APPEND(PKRSalt,PKRSaltLen);
-  APPEND(KeyRingPin,strlen(KeyRingPin));
-  crypto_hash_sha512(hashKey,work,ofs);
-
-  /* Form the nonce as hash of various other concatenated inputs */
-  ofs=0;
-  APPEND(KeyRingPin,strlen(KeyRingPin));
-  APPEND(KeyRingSalt,KeyRingSaltLen);
-  APPEND(KeyRingPin,strlen(KeyRingPin));
-  APPEND(PKRPin,strlen(PKRPin));
-  crypto_hash_sha512(hashNonce,work,ofs);
-
-  /* Now en/de-crypt the remainder of the block.
-     We do this in-place for convenience, so you should not pass in a mmap()'d
-     lump. */
-  crypto_stream_xsalsa20_xor(&block[96],&block[96],len-96, hashNonce,hashKey);
-  exit_code=0;
-
- kmb_safeexit:
-  /* Wipe out all sensitive structures before returning */
-  ofs=0;
-  bzero(&work[0],65536);
-  bzero(&hashKey[0],crypto_hash_sha512_BYTES);
+  keyring_munge_nonce(hashNonce, KeyRingSalt, KeyRingSaltLen, KeyRingPin, PKRPin);
+  keyring_munge_block_nonce(block, len, hashNonce, KeyRingPin, PKRPin);
   bzero(&hashNonce[0],crypto_hash_sha512_BYTES);
-  return exit_code;
-#undef APPEND
+  return 0;
 }
 
 static const char *keytype_str(unsigned ktype, const char *unknown)
@@ -882,6 +1039,7 @@ const struct keytype keytypes[] = {
 
 static void keyring_free_keypair(keypair *kp)
 {
+  keyring_unindex_keypair(kp);
   if (kp->private_key) {
     bzero(kp->private_key, kp->private_key_len);
     free(kp->private_key);
@@ -1221,6 +1379,7 @@ static int keyring_finalise_identity(keyring_file *k, keyring_identity *id)
 	     so replace it */
 	  WARN("SAS key is invalid -- regenerating.");
 	  crypto_sign_keypair(kp->public_key, kp->private_key);
+	  id->dirty = 1;
 	  k->dirty = 1;
 	}
 	id->sign_pk = kp->public_key;
@@ -1288,10 +1447,7 @@ static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot_number
   add_subscriber(id);
 
   /* All fine, so add the id into the context and return. */
-  keyring_identity **i=&k->identities;
-  while(*i)
-    i=&(*i)->next;
-  *i=id;
+  keyring_append_identity(k, id);
   return 0;
 
  kdp_safeexit:
@@ -1303,59 +1459,222 @@ static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot_number
   return 1;
 }
 
-/* Try all valid slots with the PIN and see if we find any identities with that PIN.
-   We might find more than one. */
-int keyring_enter_pin(keyring_file *k, const char *pin)
+static int slot_occupied(const keyring_file *k, unsigned slot)
 {
-  IN();
-  DEBUGF(keyring, "k=%p, pin=%s", k, alloca_str_toprint(pin));
-  if (!pin) pin="";
+  /* slot zero is the BAM and salt, so skip it */
+  if (!(slot&(KEYRING_BAM_BITS-1)))
+    return 0;
+  size_t file_offset = slot * KEYRING_PAGE_SIZE;
+
+  /* See if this part of the keyring file is organised */
+  keyring_bam *b=k->bam;
+  while (b && (file_offset >= b->file_offset + KEYRING_SLAB_SIZE))
+    b=b->next;
+  if (!b)
+    return 0;
+
+  int position=slot&(KEYRING_BAM_BITS-1);
+  int byte=position>>3;
+  int bit=position&7;
+  return (b->bitmap[byte]&(1<<bit)) ? 1 : 0;
+}
+
+/* Would keyring_unpack_identity() accept this decrypted slot?  Only walks the keypair framing, so
+ * it accepts a superset of valid slots, but it rejects almost every slot decrypted with the wrong
+ * PIN without allocating or logging.
+ */
+static int slot_plausible(unsigned char *slot)
+{
+  uint16_t rotation = (slot[PKR_SALT_BYTES + PKR_MAC_BYTES] << 8) | slot[PKR_SALT_BYTES + PKR_MAC_BYTES + 1];
+  struct rotbuf rbuf;
+  rotbuf_init(&rbuf,
+	    slot + PKR_SALT_BYTES + PKR_MAC_BYTES + 2,
+	    KEYRING_PAGE_SIZE - (PKR_SALT_BYTES + PKR_MAC_BYTES + 2),
+	    rotation);
+  while (!rbuf.wrap) {
+    unsigned char ktype = rotbuf_getc(&rbuf);
+    if (rbuf.wrap || ktype == 0x00)
+      break;
+    size_t keypair_len;
+    switch (ktype) {
+    case KEYTYPE_CRYPTOBOX:
+    case KEYTYPE_CRYPTOSIGN:
+    case KEYTYPE_RHIZOME:
+    case KEYTYPE_DID:
+      keypair_len = keytypes[ktype].packed_size;
+      break;
+    default:
+      keypair_len = rotbuf_getc(&rbuf) << 8;
+      keypair_len |= rotbuf_getc(&rbuf);
+      break;
+    }
+    if (keypair_len > rotbuf_remain(&rbuf))
+      return 0;
+    rotbuf_advance(&rbuf, keypair_len);
+  }
+  return rbuf.wrap <= 1;
+}
+
+#define KEYRING_UNLOCK_THREADS 8
 
-  // Check if PIN is already entered.
+/* Trial decryption of every occupied slot with every PIN being entered.  Each (pin, slot) pair is
+ * an independent job, claimed by whichever thread gets to it first.
+ */
+struct pin_trial {
+  const unsigned char *map;
+  const char *KeyRingPin;
+  const char **pins;
+  unsigned char (*nonces)[crypto_hash_sha512_BYTES];
+  const unsigned *slots;
+  unsigned slot_count;
+  unsigned job_count;
+  unsigned next_job;
+  uint8_t *plausible;
+};
+
+static void *pin_trial_worker(void *context)
+{
+  struct pin_trial *t = context;
+  unsigned char slot[KEYRING_PAGE_SIZE];
+  unsigned job;
+  while ((job = __sync_fetch_and_add(&t->next_job, 1)) < t->job_count) {
+    unsigned p = job / t->slot_count;
+    bcopy(t->map + (size_t)t->slots[job % t->slot_count] * KEYRING_PAGE_SIZE, slot, KEYRING_PAGE_SIZE);
+    keyring_munge_block_nonce(slot, KEYRING_PAGE_SIZE, t->nonces[p], t->KeyRingPin, t->pins[p]);
+    t->plausible[job] = slot_plausible(slot);
+  }
+  bzero(slot, KEYRING_PAGE_SIZE);
+  return NULL;
+}
+
+static void pin_trial_run(struct pin_trial *t)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned threads = cpus > 0 ? (unsigned)cpus : 1;
+  if (threads > KEYRING_UNLOCK_THREADS)
+    threads = KEYRING_UNLOCK_THREADS;
+  // not worth starting a thread for less than a handful of slots
+  if (threads > t->job_count / 16 + 1)
+    threads = t->job_count / 16 + 1;
+  pthread_t tids[KEYRING_UNLOCK_THREADS];
+  unsigned started = 0;
+  while (started + 1 < threads && pthread_create(&tids[started], NULL, pin_trial_worker, t) == 0)
+    started++;
+  pin_trial_worker(t);
+  while (started)
+    pthread_join(tids[--started], NULL);
+}
+
+/* Try all valid slots with each of the PINs and see if we find any identities with them.
+   We might find more than one per PIN.  Slots are read from a mapping of the keyring file and
+   trial decrypted across several threads; only the slots that might be valid are then unpacked
+   and verified on this thread. */
+int keyring_enter_pins(keyring_file *k, unsigned pinc, const char **pinv)
+{
+  IN();
+  DEBUGF(keyring, "k=%p, pinc=%u", k, pinc);
   int identitiesFound=0;
-  keyring_identity *id = k->identities;
-  while(id){
-    if (strcmp(id->PKRPin, pin) == 0)
-      identitiesFound++;
-    id=id->next;
-  }
-  if (identitiesFound)
-    RETURN(identitiesFound);
-    
-  unsigned slot;
-  for(slot=0;slot<k->file_size/KEYRING_PAGE_SIZE;slot++) {
-    /* slot zero is the BAM and salt, so skip it */
-    if (slot&(KEYRING_BAM_BITS-1)) {
-      /* Not a BAM slot, so examine */
-      size_t file_offset = slot * KEYRING_PAGE_SIZE;
-
-      /* See if this part of the keyring file is organised */
-      keyring_bam *b=k->bam;
-      while (b && (file_offset >= b->file_offset + KEYRING_SLAB_SIZE))
-	b=b->next;
-      if (!b) continue;
-
-      /* Now see if slot is marked in-use.  No point checking unallocated slots,
-	  especially since the cost can be upto a second of CPU time on a phone. */
-      int position=slot&(KEYRING_BAM_BITS-1);
-      int byte=position>>3;
-      int bit=position&7;
-      if (b->bitmap[byte]&(1<<bit)) {
-	/* Slot is occupied, so check it.
-	    We have to check it for each keyring context (ie keyring pin) */
-	if (keyring_decrypt_pkr(k, pin, slot) == 0)
-	  ++identitiesFound;
-      }
+  time_ms_t start = gettime_ms();
+
+  // Skip any PIN that has already been entered.
+  const char *pins[pinc + 1];
+  unsigned char nonces[pinc + 1][crypto_hash_sha512_BYTES];
+  unsigned pin_count=0;
+  unsigned i;
+  for (i = 0; i < pinc; ++i) {
+    const char *pin = pinv[i] ? pinv[i] : "";
+    int entered=0;
+    keyring_identity *id = k->identities;
+    while(id){
+      if (strcmp(id->PKRPin, pin) == 0)
+	entered++;
+      id=id->next;
+    }
+    unsigned j;
+    for (j = 0; j < pin_count && strcmp(pins[j], pin) != 0; ++j)
+      ;
+    if (entered)
+      identitiesFound+=entered;
+    else if (j == pin_count)
+      pins[pin_count++] = pin;
+  }
+
+  // Only occupied slots that aren't already unlocked are worth trying.
+  unsigned total_slots = k->file_size / KEYRING_PAGE_SIZE;
+  uint8_t *loaded = NULL;
+  unsigned *slots = NULL;
+  unsigned slot_count = 0;
+  if (pin_count && total_slots) {
+    if ((loaded = emalloc_zero(total_slots)) == NULL || (slots = emalloc(total_slots * sizeof *slots)) == NULL)
+      goto end;
+    keyring_identity *id;
+    for (id = k->identities; id; id = id->next)
+      if (id->slot < total_slots)
+	loaded[id->slot] = 1;
+    unsigned slot;
+    for (slot = 0; slot < total_slots; ++slot)
+      if (!loaded[slot] && slot_occupied(k, slot))
+	slots[slot_count++] = slot;
+  }
+  if (!slot_count)
+    goto end;
+
+  struct pin_trial trial;
+  bzero(&trial, sizeof trial);
+  trial.slots = slots;
+  trial.slot_count = slot_count;
+  trial.job_count = pin_count * slot_count;
+  trial.pins = pins;
+  trial.KeyRingPin = k->KeyRingPin;
+  trial.nonces = nonces;
+  if ((trial.plausible = emalloc(trial.job_count)) == NULL)
+    goto end;
+  void *map = MAP_FAILED;
+  if (fflush(k->file) == 0)
+    map = mmap(NULL, k->file_size, PROT_READ, MAP_SHARED, fileno(k->file), 0);
+  if (map == MAP_FAILED) {
+    // Fall back to reading and verifying every slot in turn.
+    DEBUGF(keyring, "mmap failed (%s), trying every slot", strerror(errno));
+    memset(trial.plausible, 1, trial.job_count);
+  } else {
+    trial.map = map;
+    for (i = 0; i < pin_count; ++i)
+      keyring_munge_nonce(nonces[i], k->KeyRingSalt, k->KeyRingSaltLen, k->KeyRingPin, pins[i]);
+    pin_trial_run(&trial);
+    munmap(map, k->file_size);
+    bzero(nonces, sizeof nonces);
+  }
+
+  unsigned job, tried=0;
+  for (job = 0; job < trial.job_count; ++job) {
+    unsigned slot = slots[job % slot_count];
+    if (!trial.plausible[job] || loaded[slot])
+      continue;
+    tried++;
+    if (keyring_decrypt_pkr(k, pins[job / slot_count], slot) == 0) {
+      loaded[slot] = 1;
+      ++identitiesFound;
     }
   }
+  free(trial.plausible);
+  DEBUGF(keyring, "tried %u pins against %u slots in %"PRId64"ms, %u plausible, %d unlocked",
+    pin_count, slot_count, gettime_ms() - start, tried, identitiesFound);
 
+end:
+  // commit any earlier changes, even when there was nothing new to unlock
   if (k->dirty)
     keyring_commit(k);
-  
+  free(slots);
+  free(loaded);
   RETURN(identitiesFound);
   OUT();
 }
 
+int keyring_enter_pin(keyring_file *k, const char *pin)
+{
+  return keyring_enter_pins(k, 1, &pin);
+}
+
 static unsigned test_slot(const keyring_file *k, unsigned slot)
 {
   assert(slot < KEYRING_BAM_BITS);
@@ -1375,6 +1694,7 @@ static void set_slot(keyring_file *k, unsigned slot, int bitvalue)
     k->bam->bitmap[byte] |= (1 << bit);
   else
     k->bam->bitmap[byte] &= ~(1 << bit);
+  k->bam->dirty = 1;
 }
 
 /* Find free slot in keyring.  Slot 0 in any slab is the BAM and possible keyring salt, so only
@@ -1399,12 +1719,9 @@ static int keyring_commit_identity(keyring_file *k, keyring_identity *id)
   if (keyring_find_sid(&it, id->box_pk))
     return 0;
   set_slot(k, id->slot, 1);
+  id->dirty = 1;
 
-  keyring_identity **i=&k->identities;
-  while(*i)
-    i=&(*i)->next;
-
-  *i=id;
+  keyring_append_identity(k, id);
   add_subscriber(id);
   return 1;
 }
@@ -1464,65 +1781,255 @@ keyring_identity *keyring_create_identity(keyring_file *k, const char *pin)
   return NULL;
 }
 
+/* A commit first writes every page it is about to change into a journal file next to the keyring:
+ *   for each page, an 8 byte big-endian file offset followed by the page,
+ *   then an 8 byte big-endian page count and the SHA-512 of everything before it.
+ * Once the journal and its directory entry are synced, the pages are written in place and the
+ * journal is removed.  If we crash part way through, the next writeable open finds a complete
+ * journal and writes the pages again.  An incomplete journal means the keyring itself was never
+ * touched.  Every commit is journalled, even a single page, because a page write is not atomic and
+ * a torn identity page can't be decrypted at all.
+ */
+struct keyring_page {
+  off_t offset;
+  unsigned char data[KEYRING_PAGE_SIZE];
+};
+
+#define JOURNAL_RECORD_SIZE (8 + KEYRING_PAGE_SIZE)
+#define JOURNAL_TRAILER_SIZE (8 + crypto_hash_sha512_BYTES)
+
+static void write_uint64_be(unsigned char *buf, uint64_t v)
+{
+  int i;
+  for (i = 7; i >= 0; --i, v >>= 8)
+    buf[i] = v & 0xFF;
+}
+
+static uint64_t read_uint64_be(const unsigned char *buf)
+{
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < 8; ++i)
+    v = (v << 8) | buf[i];
+  return v;
+}
+
+// make the creation of the journal durable, not just its content
+static int keyring_sync_directory(const char *path)
+{
+  char dir[strlen(path) + 2];
+  strcpy(dir, path);
+  char *slash = strrchr(dir, '/');
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else if (slash == dir)
+    dir[1] = '\0';
+  else
+    *slash = '\0';
+  int fd = open(dir, O_RDONLY);
+  if (fd == -1)
+    return WHYF_perror("open(%s, O_RDONLY)", alloca_str_toprint(dir));
+  int ret = 0;
+  if (fsync(fd) == -1)
+    ret = WHYF_perror("fsync(%s)", alloca_str_toprint(dir));
+  close(fd);
+  return ret;
+}
+
+static int keyring_journal_write(const keyring_file *k, const struct keyring_page *pages, unsigned count)
+{
+  int fd = open(k->journal_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1)
+    return WHYF_perror("open(%s, O_WRONLY|O_CREAT|O_TRUNC)", alloca_str_toprint(k->journal_path));
+  crypto_hash_sha512_state context;
+  crypto_hash_sha512_init(&context);
+  unsigned char header[8];
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    write_uint64_be(header, pages[i].offset);
+    crypto_hash_sha512_update(&context, header, sizeof header);
+    crypto_hash_sha512_update(&context, pages[i].data, KEYRING_PAGE_SIZE);
+    if (write_all(fd, header, sizeof header) == -1 || write_all(fd, pages[i].data, KEYRING_PAGE_SIZE) == -1)
+      goto error;
+  }
+  unsigned char trailer[JOURNAL_TRAILER_SIZE];
+  write_uint64_be(trailer, count);
+  crypto_hash_sha512_update(&context, trailer, 8);
+  crypto_hash_sha512_final(&context, &trailer[8]);
+  if (write_all(fd, trailer, sizeof trailer) == -1)
+    goto error;
+  if (fsync(fd) == -1) {
+    WHYF_perror("fsync(%s)", alloca_str_toprint(k->journal_path));
+    goto error;
+  }
+  if (keyring_sync_directory(k->journal_path) == -1)
+    goto error;
+  close(fd);
+  return 0;
+error:
+  close(fd);
+  unlink(k->journal_path);
+  return -1;
+}
+
+static int keyring_write_pages(keyring_file *k, const struct keyring_page *pages, unsigned count)
+{
+  int fd = fileno(k->file);
+  unsigned errorCount = 0;
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    if (pwrite(fd, pages[i].data, KEYRING_PAGE_SIZE, pages[i].offset) != (ssize_t)KEYRING_PAGE_SIZE) {
+      WHYF_perror("pwrite(%d, %p, %zu, %ld)", fd, pages[i].data, KEYRING_PAGE_SIZE, (long)pages[i].offset);
+      errorCount++;
+    } else if ((size_t)pages[i].offset + KEYRING_PAGE_SIZE > k->file_size)
+      k->file_size = pages[i].offset + KEYRING_PAGE_SIZE;
+  }
+  if (fsync(fd) == -1) {
+    WHYF_perror("fsync(%d)", fd);
+    errorCount++;
+  }
+  return errorCount ? -1 : 0;
+}
+
+static int keyring_journal_replay(keyring_file *k)
+{
+  int fd = open(k->journal_path, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT)
+      return 0;
+    return WHYF_perror("open(%s, O_RDONLY)", alloca_str_toprint(k->journal_path));
+  }
+  int ret = 0;
+  unsigned char *buf = NULL;
+  struct keyring_page *pages = NULL;
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    ret = WHYF_perror("fstat(%s)", alloca_str_toprint(k->journal_path));
+    goto end;
+  }
+  size_t size = st.st_size;
+  if (size < JOURNAL_TRAILER_SIZE || (size - JOURNAL_TRAILER_SIZE) % JOURNAL_RECORD_SIZE)
+    goto discard;
+  unsigned count = (size - JOURNAL_TRAILER_SIZE) / JOURNAL_RECORD_SIZE;
+  if ((buf = emalloc(size)) == NULL || (count && (pages = emalloc(count * sizeof *pages)) == NULL)) {
+    ret = -1;
+    goto end;
+  }
+  if (read(fd, buf, size) != (ssize_t)size) {
+    ret = WHYF_perror("read(%s)", alloca_str_toprint(k->journal_path));
+    goto end;
+  }
+  const unsigned char *trailer = &buf[size - JOURNAL_TRAILER_SIZE];
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  crypto_hash_sha512(hash, buf, size - crypto_hash_sha512_BYTES);
+  if (read_uint64_be(trailer) != count || memcmp(hash, &trailer[8], sizeof hash) != 0)
+    goto discard;
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    pages[i].offset = read_uint64_be(&buf[i * JOURNAL_RECORD_SIZE]);
+    bcopy(&buf[i * JOURNAL_RECORD_SIZE + 8], pages[i].data, KEYRING_PAGE_SIZE);
+  }
+  INFOF("Completing interrupted keyring commit of %u pages", count);
+  if (keyring_write_pages(k, pages, count) == -1) {
+    ret = WHY("Could not replay keyring journal");
+    goto end;
+  }
+discard:
+  if (unlink(k->journal_path) == -1)
+    ret = WHYF_perror("unlink(%s)", alloca_str_toprint(k->journal_path));
+end:
+  close(fd);
+  if (buf)
+    free(buf);
+  if (pages)
+    free(pages);
+  return ret;
+}
+
+/* Write every BAM and identity that has changed since it was last committed.  Each changed identity
+   is re-salted as it is re-written, and the pin for each identity and context is used, so changing
+   a keypair or pin is as simple as updating the keyring_identity or related structure, marking it
+   dirty, and then calling this function. */
 int keyring_commit(keyring_file *k)
 {
   DEBUGF(keyring, "k=%p", k);
   unsigned errorCount = 0;
-  /* Write all BAMs */
+  unsigned count = 0;
   keyring_bam *b;
+  for (b = k->bam; b; b = b->next)
+    if (b->dirty)
+      count++;
+  keyring_iterator it;
+  keyring_iterator_start(k, &it);
+  while(keyring_next_identity(&it))
+    if (it.identity->dirty)
+      count++;
+  if (count == 0)
+    goto done;
+
+  struct keyring_page *pages = emalloc(count * sizeof *pages);
+  if (!pages)
+    return -1;
+  unsigned n = 0;
   for (b = k->bam; b; b = b->next) {
-    if (fseeko(k->file, b->file_offset, SEEK_SET) == -1) {
-      WHYF_perror("fseeko(%d, %ld, SEEK_SET)", fileno(k->file), (long)b->file_offset);
-      errorCount++;
-    } else if (fwrite(b->bitmap, KEYRING_BAM_BYTES, 1, k->file) != 1) {
-      WHYF_perror("fwrite(%p, %ld, 1, %d)", b->bitmap, (long)KEYRING_BAM_BYTES, fileno(k->file));
-      errorCount++;
-    } else if (fwrite(k->KeyRingSalt, k->KeyRingSaltLen, 1, k->file)!=1) {
-      WHYF_perror("fwrite(%p, %ld, 1, %d)", k->KeyRingSalt, (long)k->KeyRingSaltLen, fileno(k->file));
-      errorCount++;
-    }
+    if (!b->dirty)
+      continue;
+    pages[n].offset = b->file_offset;
+    bcopy(b->bitmap, pages[n].data, KEYRING_BAM_BYTES);
+    bcopy(k->KeyRingSalt, &pages[n].data[KEYRING_BAM_BYTES], k->KeyRingSaltLen);
+    n++;
   }
-  /* For each identity in each context, write the record to disk.
-     This re-salts every identity as it is re-written, and the pin
-     for each identity and context is used, so changing a keypair or pin
-     is as simple as updating the keyring_identity or related structure,
-     and then calling this function. */
-  keyring_iterator it;
   keyring_iterator_start(k, &it);
   while(keyring_next_identity(&it)){
-    unsigned char pkr[KEYRING_PAGE_SIZE];
-    if (keyring_pack_identity(it.identity, pkr))
+    if (!it.identity->dirty)
+      continue;
+    if (it.identity->slot == 0) {
+      DEBUGF(keyring, "ID id=%p has slot=0", it.identity);
+      continue;
+    }
+    if (keyring_pack_identity(it.identity, pages[n].data))
       errorCount++;
-    else {
-      /* Now crypt and store block */
-      /* Crypt */
-      if (keyring_munge_block(pkr, KEYRING_PAGE_SIZE, 
-	it.file->KeyRingSalt, it.file->KeyRingSaltLen, 
+    /* Now crypt and store block */
+    else if (keyring_munge_block(pages[n].data, KEYRING_PAGE_SIZE,
+	it.file->KeyRingSalt, it.file->KeyRingSaltLen,
 	it.file->KeyRingPin, it.identity->PKRPin)) {
-	WHY("keyring_munge_block() failed");
-	errorCount++;
-      } else {
-	/* Store */
-	off_t file_offset = KEYRING_PAGE_SIZE * it.identity->slot;
-	if (file_offset == 0) {
-	  DEBUGF(keyring, "ID id=%p has slot=0", it.identity);
-	} else if (fseeko(k->file, file_offset, SEEK_SET) == -1) {
-	  WHYF_perror("fseeko(%d, %ld, SEEK_SET)", fileno(k->file), (long)file_offset);
-	  errorCount++;
-	} else if (fwrite(pkr, KEYRING_PAGE_SIZE, 1, k->file) != 1) {
-	  WHYF_perror("fwrite(%p, %ld, 1, %d)", pkr, (long)KEYRING_PAGE_SIZE, fileno(k->file));
-	  errorCount++;
-	}
-      }
+      WHY("keyring_munge_block() failed");
+      errorCount++;
+    } else {
+      pages[n].offset = KEYRING_PAGE_SIZE * it.identity->slot;
+      n++;
     }
   }
+
+  /* Nothing buffered may be written over the pages later */
   if (fflush(k->file) == -1) {
     WHYF_perror("fflush(%d)", fileno(k->file));
     errorCount++;
+  } else if (n) {
+    int journalled = k->journal_path != NULL;
+    if (journalled && keyring_journal_write(k, pages, n) == -1)
+      errorCount++;
+    else if (keyring_write_pages(k, pages, n) == -1)
+      errorCount++;
+    else if (journalled && unlink(k->journal_path) == -1) {
+      WHYF_perror("unlink(%s)", alloca_str_toprint(k->journal_path));
+      errorCount++;
+    }
+    DEBUGF(keyring, "wrote %u pages%s", n, journalled ? " via journal" : "");
   }
-  if (!errorCount)
-    k->dirty=0;
-  return errorCount ? WHYF("%u errors commiting keyring to disk", errorCount) : 0;
+  bzero(pages, count * sizeof *pages);
+  free(pages);
+  if (errorCount)
+    return WHYF("%u errors commiting keyring to disk", errorCount);
+
+  for (b = k->bam; b; b = b->next)
+    b->dirty = 0;
+  keyring_iterator_start(k, &it);
+  while(keyring_next_identity(&it))
+    it.identity->dirty = 0;
+done:
+  k->dirty=0;
+  return 0;
 }
 
 int keyring_set_did(keyring_identity *id, const char *did, const char *name)
@@ -1544,6 +2051,7 @@ int keyring_set_did(keyring_identity *id, const char *did, const char *name)
     keyring_identity_add_keypair(id, kp);
     DEBUG(keyring, "Created DID record for identity");
   }
+  keyring_unindex_keypair(kp);
 
   /* Store DID unpacked for ease of searching */
   size_t len=strlen(did);
@@ -1561,6 +2069,8 @@ int keyring_set_did(keyring_identity *id, const char *did, const char *name)
     dump("{keyring} storing did",&kp->private_key[0],32);
     dump("{keyring} storing name",&kp->public_key[0],64);
   }
+  keyring_index_keypair(id, kp);
+  id->dirty = 1;
   return 0;
 }
 
@@ -1617,6 +2127,7 @@ int keyring_set_public_tag(keyring_identity *id, const char *name, const unsigne
       return -1;
     keyring_identity_add_keypair(id, kp);
   }
+  keyring_unindex_keypair(kp);
   
   if (kp->public_key)
     free(kp->public_key);
@@ -1631,6 +2142,8 @@ int keyring_set_public_tag(keyring_identity *id, const char *name, const unsigne
   
   if (IF_DEBUG(keyring))
     dump("{keyring} New tag", kp->public_key, kp->public_key_len);
+  keyring_index_keypair(id, kp);
+  id->dirty = 1;
   return 0;
 }
 
@@ -1649,16 +2162,31 @@ keypair * keyring_find_public_tag(keyring_iterator *it, const char *name, const
   return NULL;
 }
 
+struct packed_tag {
+  const unsigned char *bytes;
+  size_t len;
+};
+
+static int match_tag(const keypair *kp, const void *context)
+{
+  const struct packed_tag *tag = context;
+  return kp->type == KEYTYPE_PUBLIC_TAG
+    && kp->public_key_len == tag->len
+    && memcmp(kp->public_key, tag->bytes, tag->len) == 0;
+}
+
 keypair * keyring_find_public_tag_value(keyring_iterator *it, const char *name, const unsigned char *value, size_t length)
 {
-  const unsigned char *stored_value;
-  size_t stored_length;
-  keypair *keypair;
-  while((keypair=keyring_find_public_tag(it, name, &stored_value, &stored_length))){
-    if (stored_length == length && memcmp(value, stored_value, length)==0)
-      return keypair;
-  }
-  return NULL;
+  // tags are indexed by their packed "name\0value" form
+  struct packed_tag tag;
+  if (keyring_pack_tag(NULL, &tag.len, name, value, length))
+    return NULL;
+  unsigned char packed[tag.len];
+  if (keyring_pack_tag(packed, &tag.len, name, value, length))
+    return NULL;
+  tag.bytes = packed;
+  uint32_t hash = index_hash(packed, tag.len, 0);
+  return keyring_index_find(it, it->file->tag_index[hash % KEYRING_INDEX_BUCKETS], hash, match_tag, &tag);
 }
 
 // sign the hash of a message, adding the signature to the end of the message buffer.
@@ -2000,13 +2528,15 @@ keyring_file *keyring_open_instance_cli(const struct cli_parsed *parsed)
   keyring_file *k = keyring_open_instance(kpin);
   if (k == NULL)
     RETURN(NULL);
-  // Always open all PIN-less entries.
-  keyring_enter_pin(k, "");
-  // Open all entries for which an entry PIN has been given.
+  // Always open all PIN-less entries, and all entries for which an entry PIN has been given.
+  const char *pins[parsed->labelc + 1];
+  unsigned pinc = 0;
+  pins[pinc++] = "";
   unsigned i;
   for (i = 0; i < parsed->labelc; ++i)
     if (strn_str_cmp(parsed->labelv[i].label, parsed->labelv[i].len, "--entry-pin") == 0)
-      keyring_enter_pin(k, parsed->labelv[i].text);
+      pins[pinc++] = parsed->labelv[i].text;
+  keyring_enter_pins(k, pinc, pins);
   RETURN(k);
   OUT();
 }
@@ -2036,53 +2566,149 @@ int keyring_seed(keyring_file *k)
   can indeed be reused.
 */
 
-/* XXX We need a more efficient implementation than a linear list, but it will
-   do for now. */
+/* Cached shared secrets are found through a hash of both keys, and evicted with the CLOCK
+   algorithm, so recently used secrets survive when we talk to more peers than the cache holds.
+ */
 struct nm_record {
-  /* 96 bytes per record */
   sid_t known_key;
   sid_t unknown_key;
   unsigned char nm_bytes[crypto_box_BEFORENMBYTES];
+  // next record in the same hash bucket, or -1
+  int32_t next;
+  // used since the clock hand last passed?
+  uint8_t referenced;
 };
 
-unsigned nm_slots_used=0;
-/* 512 x 96 bytes = 48KB, not too big */
-#define NM_CACHE_SLOTS 512
-struct nm_record nm_cache[NM_CACHE_SLOTS];
+static struct nm_record *nm_cache=NULL;
+static int32_t *nm_buckets=NULL;
+static unsigned nm_slots=0;
+static unsigned nm_bucket_count=0;
+static unsigned nm_slots_used=0;
+static unsigned nm_clock_hand=0;
+static unsigned nm_hits=0;
+static unsigned nm_misses=0;
+
+static unsigned nm_bucket(const sid_t *known_key, const sid_t *unknown_key)
+{
+  // public keys are uniformly distributed, any few bytes will do
+  uint32_t h;
+  memcpy(&h, &unknown_key->binary[8], sizeof h);
+  uint32_t k;
+  memcpy(&k, &known_key->binary[8], sizeof k);
+  h ^= k * 0x9E3779B1;
+  return h & (nm_bucket_count -1);
+}
+
+static int nm_cache_init()
+{
+  unsigned slots = config.mdp.crypto_cache_size;
+  if (nm_cache && nm_slots == slots)
+    return 0;
+  // (re)configured, start again
+  free(nm_cache);
+  free(nm_buckets);
+  nm_cache = NULL;
+  nm_buckets = NULL;
+  nm_slots = nm_slots_used = nm_clock_hand = 0;
+  unsigned buckets = 16;
+  while (buckets < slots)
+    buckets <<= 1;
+  if ((nm_cache = emalloc(slots * sizeof(struct nm_record))) == NULL)
+    return -1;
+  if ((nm_buckets = emalloc(buckets * sizeof(int32_t))) == NULL){
+    free(nm_cache);
+    nm_cache = NULL;
+    return -1;
+  }
+  memset(nm_buckets, 0xFF, buckets * sizeof(int32_t));
+  nm_slots = slots;
+  nm_bucket_count = buckets;
+  return 0;
+}
+
+// pick a record to reuse, removing it from its hash bucket
+static unsigned nm_evict()
+{
+  while (nm_cache[nm_clock_hand].referenced){
+    nm_cache[nm_clock_hand].referenced = 0;
+    nm_clock_hand = (nm_clock_hand + 1) % nm_slots;
+  }
+  unsigned i = nm_clock_hand;
+  nm_clock_hand = (nm_clock_hand + 1) % nm_slots;
+  int32_t *p = &nm_buckets[nm_bucket(&nm_cache[i].known_key, &nm_cache[i].unknown_key)];
+  while (*p != -1 && *p != (int32_t)i)
+    p = &nm_cache[*p].next;
+  if (*p != -1)
+    *p = nm_cache[i].next;
+  return i;
+}
 
 unsigned char *keyring_get_nm_bytes(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp)
 {
   IN();
   assert(keyring != NULL);
+  if (nm_cache_init() == -1)
+    RETURN(NULL);
 
   /* See if we have it cached already */
-  unsigned i;
-  for(i=0;i<nm_slots_used;i++){
-    if (cmp_sid_t(&nm_cache[i].known_key, box_pk) != 0) continue;
+  unsigned bucket = nm_bucket(box_pk, unknown_sidp);
+  int32_t i;
+  for (i = nm_buckets[bucket]; i != -1; i = nm_cache[i].next){
     if (cmp_sid_t(&nm_cache[i].unknown_key, unknown_sidp) != 0) continue;
+    if (cmp_sid_t(&nm_cache[i].known_key, box_pk) != 0) continue;
+    nm_cache[i].referenced = 1;
+    nm_hits++;
     RETURN(nm_cache[i].nm_bytes);
   }
 
   /* Not in the cache, so prepare to cache it (or return failure if known is not
      in fact a known key */
+  nm_misses++;
+  DEBUGF(keyring, "Shared secret cache miss for %s (%u hits, %u misses, %u of %u used)",
+	 alloca_tohex_sid_t(*unknown_sidp), nm_hits, nm_misses, nm_slots_used, nm_slots);
   /* work out where to store it */
-  if (nm_slots_used<NM_CACHE_SLOTS) {
+  char fresh = 0;
+  if (nm_slots_used<nm_slots) {
     i=nm_slots_used; nm_slots_used++; 
+    fresh = 1;
   } else {
-    i=randombytes_uniform(NM_CACHE_SLOTS);
+    i=nm_evict();
   }
 
   /* calculate and store */
   nm_cache[i].known_key = *box_pk;
   nm_cache[i].unknown_key = *unknown_sidp;
+  nm_cache[i].referenced = 0;
   if (crypto_box_beforenm(nm_cache[i].nm_bytes, unknown_sidp->binary, box_sk)){
+    // leave the slot out of every bucket, so it will be reused next
+    nm_cache[i].next = -1;
+    if (fresh)
+      nm_slots_used--;
+    else
+      nm_clock_hand = i;
     WHY("crypto_box_beforenm failed");
     RETURN(NULL);
   }
+  nm_cache[i].next = nm_buckets[bucket];
+  nm_buckets[bucket] = i;
   RETURN(nm_cache[i].nm_bytes);
   OUT();
 }
 
+// Optionally pay for the scalar mult with a new peer before their first packet arrives.
+static void nm_precompute(struct subscriber *subscriber, int prior_reachable)
+{
+  if (!config.mdp.crypto_precompute
+    || !keyring
+    || !my_subscriber
+    || !my_subscriber->identity
+    || (prior_reachable & REACHABLE)
+    || !(subscriber->reachable & REACHABLE))
+    return;
+  keyring_get_nm_bytes(my_subscriber->identity->box_sk, my_subscriber->identity->box_pk, &subscriber->sid);
+}
+DEFINE_TRIGGER(link_change, nm_precompute);
+
 static int cmp_identity_ptrs(const keyring_identity *const *a, const keyring_identity *const *b)
 {
   if (a==b)
@@ -2223,3 +2849,86 @@ int keyring_load_from_dump(keyring_file *k, unsigned entry_pinc, const char **en
     return WHYF_perror("fscanf");
   return 0;
 }
+
+static keyring_file *keyring_test_open(const char *path)
+{
+  keyring_file *k = keyring_open_or_create(path, 1);
+  if (k == NULL)
+    return NULL;
+  if ((k->file_size < KEYRING_PAGE_SIZE && keyring_initialise(k) == -1) || keyring_load(k, "") == -1) {
+    keyring_free(k);
+    return NULL;
+  }
+  return k;
+}
+
+DEFINE_CMD(app_keyring_test, 0,
+  "Run keyring unlock speed test",
+  "test","keyring","[--slots=<count>]","[--pins=<count>]");
+static int app_keyring_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *opt_slots, *opt_pins;
+  if (cli_arg(parsed, "--slots", &opt_slots, cli_uint, "100") == -1
+    || cli_arg(parsed, "--pins", &opt_pins, cli_uint, "4") == -1)
+    return -1;
+  unsigned slot_count = atoi(opt_slots);
+  unsigned pin_count = atoi(opt_pins);
+  if (pin_count == 0)
+    pin_count = 1;
+  if (slot_count < pin_count)
+    slot_count = pin_count;
+
+  if (create_serval_instance_dir() == -1)
+    return -1;
+  char path[1024];
+  if (!FORMF_SERVAL_ETC_PATH(path, "unlock_test.keyring"))
+    return -1;
+  unlink(path);
+
+  char pin_names[pin_count][16];
+  const char *pins[pin_count];
+  unsigned i;
+  for (i = 0; i < pin_count; ++i) {
+    snprintf(pin_names[i], sizeof pin_names[i], "pin%u", i);
+    pins[i] = pin_names[i];
+  }
+
+  // spread the identities evenly between the PINs
+  keyring_file *k = keyring_test_open(path);
+  if (k == NULL)
+    return -1;
+  for (i = 0; i < slot_count; ++i) {
+    if (keyring_create_identity(k, pins[i % pin_count]) == NULL) {
+      keyring_free(k);
+      return WHY("Could not create identity");
+    }
+  }
+  if (k->dirty)
+    keyring_commit(k);
+  keyring_free(k);
+
+  // enter every PIN in one call, then one PIN at a time as before
+  time_us_t elapsed[2];
+  int found[2] = {0, 0};
+  int pass;
+  for (pass = 0; pass < 2; ++pass) {
+    if ((k = keyring_test_open(path)) == NULL)
+      return -1;
+    time_us_t start = gettime_us();
+    if (pass == 0)
+      found[pass] = keyring_enter_pins(k, pin_count, pins);
+    else {
+      for (i = 0; i < pin_count; ++i)
+	found[pass] += keyring_enter_pin(k, pins[i]);
+    }
+    elapsed[pass] = gettime_us() - start;
+    keyring_free(k);
+  }
+  unlink(path);
+
+  cli_printf(context, "%u identities unlocked by %u PINs\n", slot_count, pin_count);
+  cli_printf(context, "all PINs at once = %.2fms, %d found\n", elapsed[0] / 1000.0, found[0]);
+  cli_printf(context, "one PIN at a time = %.2fms, %d found\n", elapsed[1] / 1000.0, found[1]);
+  return 0;
+}
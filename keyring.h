@@ -31,6 +31,11 @@ typedef struct keypair {
   unsigned char *public_key;
   size_t public_key_len;
   struct keypair *next;
+  // hash index chain, see keyring_index_keypair()
+  struct keypair *_next_indexed;
+  struct keypair **_prev_indexed;
+  struct keyring_identity *_identity;
+  uint32_t _index_hash;
 } keypair;
 
 /* Contains just the list of private:public key pairs and types,
@@ -50,6 +55,11 @@ typedef struct keyring_identity {
   const uint8_t *sign_pk;
   struct keyring_identity *next;
   keypair *keypairs;
+  // set while this identity is linked into file->identities
+  struct keyring_file *file;
+  unsigned sequence;
+  // needs to be written by the next keyring_commit()
+  uint8_t dirty;
 } keyring_identity;
 
 #define KEYRING_PAGE_SIZE ((size_t)4096)
@@ -59,17 +69,26 @@ typedef struct keyring_identity {
 typedef struct keyring_bam {
   size_t file_offset;
   unsigned char bitmap[KEYRING_BAM_BYTES];
+  uint8_t dirty;
   struct keyring_bam *next;
 } keyring_bam;
 
+#define KEYRING_INDEX_BUCKETS 256
+
 typedef struct keyring_file {
   keyring_bam *bam;
   char *KeyRingPin;
   unsigned char *KeyRingSalt;
   int KeyRingSaltLen;
   keyring_identity *identities;
+  unsigned next_sequence;
+  // unlocked keypairs hashed by SID, DID and public tag
+  keypair *sid_index[KEYRING_INDEX_BUCKETS];
+  keypair *did_index[KEYRING_INDEX_BUCKETS];
+  keypair *tag_index[KEYRING_INDEX_BUCKETS];
   FILE *file;
   size_t file_size;
+  char *journal_path;
   uint8_t dirty;
 } keyring_file;
 
@@ -113,6 +132,7 @@ keyring_file *keyring_create_instance();
 keyring_file *keyring_open_instance(const char *pin);
 keyring_file *keyring_open_instance_cli(const struct cli_parsed *parsed);
 int keyring_enter_pin(keyring_file *k, const char *pin);
+int keyring_enter_pins(keyring_file *k, unsigned pinc, const char **pinv);
 int keyring_set_did(keyring_identity *id, const char *did, const char *name);
 int keyring_sign_message(struct keyring_identity *identity, unsigned char *content, size_t buffer_len, size_t *content_len);
 int keyring_send_sas_request(struct subscriber *subscriber);
@@ -22,17 +22,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define MIN_BURST_LENGTH 5000
 
-static void update_limit_state(struct limit_state *state, time_ms_t now){
-  if (state->next_interval > now || state->burst_size==0){
-    return;
-  }
-  
-  if (state->next_interval + state->burst_length>now)
-    state->next_interval+=state->burst_length;
-  else
-    state->next_interval=now + state->burst_length;
-  
-  state->sent = 0;
+/* When will the bucket next hold a whole token? */
+static time_us_t next_token(struct limit_state *state){
+  return state->full_at - (time_us_t)(state->burst_size - 1) * state->rate_micro_seconds;
 }
 
 /* When should we next allow this thing to occur? */
@@ -40,36 +32,34 @@ time_ms_t limit_next_allowed(struct limit_state *state){
   time_ms_t now = gettime_ms();
   if (!state->burst_size)
     return now;
-  update_limit_state(state, now);
-  
-  if (state->sent < state->burst_size)
+  time_us_t next = next_token(state);
+  if (next <= now * 1000)
     return now;
-  return state->next_interval;
+  // round up, so the caller won't wake before the token is available
+  return (next + 999) / 1000;
 }
 
 /* Can we do this now? if so, track it */
 int limit_is_allowed(struct limit_state *state){
-  time_ms_t now = gettime_ms();
   if (!state->burst_size)
     return 0;
-  update_limit_state(state, now);
-  if (state->sent >= state->burst_size){
+  time_us_t now = gettime_us();
+  if (next_token(state) > now)
     return -1;
-  }
-  state->sent ++;
+  // take a token, which will be replaced rate_micro_seconds after the bucket would otherwise be full
+  if (state->full_at < now)
+    state->full_at = now;
+  state->full_at += state->rate_micro_seconds;
   return 0;
 }
 
-/* Initialise burst size and length based on the number we can do in one MIN_BURST */
+/* Initialise the bucket to hold as many as we can do in one MIN_BURST_LENGTH, and start it full */
 int limit_init(struct limit_state *state, uint32_t rate_micro_seconds){
   state->rate_micro_seconds = rate_micro_seconds;
-  if (rate_micro_seconds==0){
+  state->full_at = 0;
+  if (rate_micro_seconds==0)
     state->burst_size=0;
-    state->burst_length=0;
-  }else{
+  else
     state->burst_size = (MIN_BURST_LENGTH / rate_micro_seconds)+1;
-    state->burst_length = (state->burst_size * rate_micro_seconds) / 1000.0;
-  }
   return 0;
 }
-
@@ -19,16 +19,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef __SERVAL_DNA__LIMIT_H
 #define __SERVAL_DNA__LIMIT_H
 
+/* A token bucket, refilled with one token every rate_micro_seconds and holding up to burst_size.
+ * Rather than counting tokens, we track the time at which the bucket will be full again.
+ */
 struct limit_state{
   uint32_t rate_micro_seconds;
-  // length of time for a burst
-  time_ms_t burst_length;
-  // how many in a burst
+  // how many can be sent back to back, after an idle period
   int burst_size;
-  // how many have we sent in this burst so far
-  int sent;
-  // when can we allow another burst
-  time_ms_t next_interval;
+  // when will the bucket be full again
+  time_us_t full_at;
 };
 
 time_ms_t limit_next_allowed(struct limit_state *state);
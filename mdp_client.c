@@ -88,6 +88,24 @@ int _mdp_send(struct __sourceloc __whence, int socket, const struct mdp_header *
   return 0;
 }
 
+// double check that the incoming address matches the servald daemon
+static int check_daemon_address(struct __sourceloc __whence, struct socket_address *addr, const struct socket_address *mdp_addr)
+{
+  if (cmp_sockaddr(addr, mdp_addr) != 0
+      && (   addr->local.sun_family != AF_UNIX
+	  || real_sockaddr(addr, addr) <= 0
+	  || cmp_sockaddr(addr, mdp_addr) != 0
+	 )
+  ) {
+    errno = EBADMSG;
+    WARNF_perror("dropped message from %s (expecting %s), setting errno=EBADMSG",
+      alloca_socket_address(addr),
+      alloca_socket_address(mdp_addr));
+    return -1;
+  }
+  return 0;
+}
+
 /* This function is designed to be used a bit like a system or library call, because it always sets
  * errno before returning -1.  Some errno values arise from system calls, and some are synthetic,
  * eg, to report buffer overflow or an MDP protocol error.
@@ -140,23 +158,13 @@ ssize_t _mdp_recv(struct __sourceloc __whence, int socket, struct mdp_header *he
     return -1;
   }
   addr.addrlen=hdr.msg_namelen;
-  // double check that the incoming address matches the servald daemon
-  if (cmp_sockaddr(&addr, &mdp_addr) != 0
-      && (   addr.local.sun_family != AF_UNIX
-	  || real_sockaddr(&addr, &addr) <= 0
-	  || cmp_sockaddr(&addr, &mdp_addr) != 0
-	 )
-  ) {
-    errno = EBADMSG;
-    WARNF_perror("dropped message from %s (expecting %s), setting errno=EBADMSG",
-      alloca_socket_address(&addr),
-      alloca_socket_address(&mdp_addr));
+  if (check_daemon_address(__whence, &addr, &mdp_addr) == -1)
     return -1;
-  }
   return len - sizeof(struct mdp_header);
 }
 
-int _mdp_bind(struct __sourceloc __whence, int socket, struct mdp_sockaddr *local_addr)
+// send a bind request and wait for the reply, returns the flags of the reply
+static int bind_flags(struct __sourceloc __whence, int socket, struct mdp_sockaddr *local_addr, uint8_t flags)
 {
   struct mdp_header mdp_header;
   bzero(&mdp_header, sizeof(mdp_header));
@@ -164,7 +172,7 @@ int _mdp_bind(struct __sourceloc __whence, int socket, struct mdp_sockaddr *loca
   mdp_header.local = *local_addr;
   mdp_header.remote.port = MDP_LISTEN;
   mdp_header.remote.sid = SID_ANY;
-  mdp_header.flags = MDP_FLAG_BIND;
+  mdp_header.flags = flags;
   
   if (_mdp_send(__whence, socket, &mdp_header, NULL, 0)==-1)
     return -1;
@@ -175,9 +183,181 @@ int _mdp_bind(struct __sourceloc __whence, int socket, struct mdp_sockaddr *loca
     return -1;
   }
   *local_addr = mdp_header.local;
+  return mdp_header.flags;
+}
+
+int _mdp_bind(struct __sourceloc __whence, int socket, struct mdp_sockaddr *local_addr)
+{
+  return bind_flags(__whence, socket, local_addr, MDP_FLAG_BIND) == -1 ? -1 : 0;
+}
+
+/* Bind as mdp_bind() does, and ask the daemon to batch packets for this socket.  Returns 1 if the
+ * daemon agreed, 0 if it did not (eg, an older daemon), so the socket must be used unbatched.
+ */
+int _mdp_bind_batch(struct __sourceloc __whence, int socket, struct mdp_sockaddr *local_addr)
+{
+  int flags = bind_flags(__whence, socket, local_addr, MDP_FLAG_BIND | MDP_FLAG_BATCH);
+  if (flags == -1)
+    return -1;
+  return (flags & MDP_FLAG_BATCH) ? 1 : 0;
+}
+
+/* Append one frame to a batched datagram.  Returns -1 if it won't fit.
+ */
+int mdp_batch_append(uint8_t *buffer, size_t size, size_t *len, const struct mdp_header *header, const uint8_t *payload, size_t payload_len)
+{
+  if (payload_len > 0xFFFF || *len + sizeof *header + 2 + payload_len > size)
+    return -1;
+  struct mdp_header *h = (struct mdp_header *)&buffer[*len];
+  bcopy(header, h, sizeof *header);
+  h->flags |= MDP_FLAG_BATCH;
+  *len += sizeof *header;
+  buffer[(*len)++] = payload_len >> 8;
+  buffer[(*len)++] = payload_len & 0xFF;
+  if (payload_len)
+    bcopy(payload, &buffer[*len], payload_len);
+  *len += payload_len;
   return 0;
 }
 
+/* Return the frame of a batched datagram at *offset, and advance *offset past it.  Returns 1 if a
+ * frame was found, 0 at the end of the datagram, or -1 if the datagram is malformed.
+ */
+int mdp_batch_next(const uint8_t *buffer, size_t len, size_t *offset, struct mdp_header *header, const uint8_t **payload, size_t *payload_len)
+{
+  if (*offset >= len)
+    return 0;
+  if (len - *offset < sizeof *header + 2)
+    return -1;
+  bcopy(&buffer[*offset], header, sizeof *header);
+  size_t ofs = *offset + sizeof *header;
+  size_t plen = (buffer[ofs] << 8) | buffer[ofs + 1];
+  ofs += 2;
+  if (!(header->flags & MDP_FLAG_BATCH) || plen > len - ofs)
+    return -1;
+  *payload = &buffer[ofs];
+  *payload_len = plen;
+  *offset = ofs + plen;
+  return 1;
+}
+
+int _mdp_batch_flush(struct __sourceloc __whence, int socket, struct mdp_batch *batch)
+{
+  if (batch->len == 0)
+    return 0;
+  struct socket_address addr;
+  if (make_local_sockaddr(&addr, "mdp.2.socket") == -1)
+    return -1;
+  struct fragmented_data data={
+    .fragment_count = 1,
+    .iov={
+      {
+	.iov_base = (void*)batch->buffer,
+	.iov_len = batch->len
+      }
+    }
+  };
+  ssize_t sent = send_message(socket, &addr, &data);
+  size_t len = batch->len;
+  batch->len = 0;
+  if (sent == -1)
+    return -1;
+  if ((size_t)sent != len) {
+    errno = EMSGSIZE;
+    return WHYF("send_message(%d,%s) returned %zd, expecting %zu -- setting errno = EMSGSIZE",
+	socket, alloca_socket_address(&addr), sent, len);
+  }
+  return 0;
+}
+
+/* Queue a frame to be sent with others in one datagram, sending the batch first if the frame won't
+ * fit.  Only for sockets whose binding was accepted with MDP_FLAG_BATCH.
+ */
+int _mdp_batch_send(struct __sourceloc __whence, int socket, struct mdp_batch *batch, const struct mdp_header *header, const uint8_t *payload, size_t len)
+{
+  if (mdp_batch_append(batch->buffer, sizeof batch->buffer, &batch->len, header, payload, len) == 0)
+    return 0;
+  if (batch->len && _mdp_batch_flush(__whence, socket, batch) == -1)
+    return -1;
+  if (mdp_batch_append(batch->buffer, sizeof batch->buffer, &batch->len, header, payload, len) == 0)
+    return 0;
+  errno = EMSGSIZE;
+  return WHYF("MDP payload of %zu bytes is too large to batch -- setting errno = EMSGSIZE", len);
+}
+
+/* Like mdp_recv(), but unpacks batched datagrams one frame per call.  Only reads from the socket
+ * once every frame of the previous datagram has been returned.
+ */
+ssize_t _mdp_batch_recv(struct __sourceloc __whence, int socket, struct mdp_batch *batch, struct mdp_header *header, uint8_t *payload, size_t max_len)
+{
+  const uint8_t *frame;
+  size_t frame_len;
+  switch (mdp_batch_next(batch->buffer, batch->len, &batch->offset, header, &frame, &frame_len)) {
+    case 1:
+      if (frame_len > max_len)
+	frame_len = max_len;
+      bcopy(frame, payload, frame_len);
+      return frame_len;
+    case -1:
+      batch->len = batch->offset = 0;
+      errno = EBADMSG;
+      WHY("malformed batch of MDP frames, setting errno=EBADMSG");
+      return -1;
+  }
+  batch->len = batch->offset = 0;
+
+  struct socket_address mdp_addr;
+  if (make_local_sockaddr(&mdp_addr, "mdp.2.socket") == -1) {
+    errno = EOVERFLOW;
+    WHY_perror("Failed to build socket address, setting errno=EOVERFLOW");
+    return -1;
+  }
+  struct socket_address addr;
+  bzero(&addr, sizeof addr);
+  struct iovec iov={
+    .iov_base = (void *)batch->buffer,
+    .iov_len = sizeof batch->buffer
+  };
+  struct msghdr hdr={
+    .msg_name=&addr.addr,
+    .msg_namelen=sizeof(addr.store),
+    .msg_iov=&iov,
+    .msg_iovlen=1,
+  };
+  ssize_t len = recvmsg(socket, &hdr, 0);
+  if (len == -1) {
+    // Do not log errors that are part of normal operation.
+    if (   errno != EAGAIN
+#ifdef EWOULDBLOCK
+	&& errno != EWOULDBLOCK
+#endif
+	&& errno != EINTR
+    )
+      WHYF_perror("recvmsg(%d,%p,0)", socket, &hdr);
+    return -1;
+  }
+  if ((size_t)len < sizeof(struct mdp_header)) {
+    errno = EBADMSG;
+    WHYF_perror("received message too short (%zu), setting errno=EBADMSG", (size_t)len);
+    return -1;
+  }
+  addr.addrlen=hdr.msg_namelen;
+  if (check_daemon_address(__whence, &addr, &mdp_addr) == -1)
+    return -1;
+
+  bcopy(batch->buffer, header, sizeof *header);
+  if ((header->flags & MDP_FLAG_BATCH) && (size_t)len > sizeof *header) {
+    batch->len = len;
+    return _mdp_batch_recv(__whence, socket, batch, header, payload, max_len);
+  }
+  // a single unbatched frame
+  frame_len = len - sizeof *header;
+  if (frame_len > max_len)
+    frame_len = max_len;
+  bcopy(&batch->buffer[sizeof *header], payload, frame_len);
+  return frame_len;
+}
+
 int _mdp_poll(struct __sourceloc UNUSED(__whence), int socket, time_ms_t timeout_ms)
 {
   // TODO make overlay_mdp_client_poll() take __whence arg
@@ -40,6 +40,8 @@ struct mdp_sockaddr {
 
 #define MDP_FLAG_CLOSE (1<<3)
 #define MDP_FLAG_ERROR (1<<4)
+// set on a bind request to ask for batched datagrams, and on the reply if the daemon agreed
+#define MDP_FLAG_BATCH (1<<6)
 
 struct mdp_header {
   struct mdp_sockaddr local;
@@ -162,6 +164,37 @@ int _mdp_bind(struct __sourceloc __whence, int socket, struct mdp_sockaddr *loca
 #define mdp_poll(s,t)     _mdp_poll(__WHENCE__, (s), (t))
 #define mdp_bind(s,a)     _mdp_bind(__WHENCE__, (s), (a))
 
+/* Batched V2 mdp interface.
+ * When a bind request has MDP_FLAG_BATCH set and so does the daemon's reply, the daemon may pack
+ * several packets for that socket into one datagram, and the client may do the same with its own
+ * packets.  Each frame in a batched datagram is an mdp_header with MDP_FLAG_BATCH set, then a two
+ * byte big-endian payload length, then the payload.  Any datagram whose first header does not have
+ * MDP_FLAG_BATCH set carries a single frame, as usual, and so does a datagram that is only an
+ * mdp_header, such as the bind request made by mdp_bind_batch() and its reply.
+ *
+ * A struct mdp_batch holds frames waiting to be sent by mdp_batch_flush(), or a received datagram
+ * whose frames are returned one at a time by mdp_batch_recv().  Use separate batches for each.
+ */
+#define MDP_BATCH_MTU 8192
+
+struct mdp_batch {
+  size_t len;
+  size_t offset;
+  uint8_t buffer[MDP_BATCH_MTU];
+};
+
+int _mdp_bind_batch(struct __sourceloc __whence, int socket, struct mdp_sockaddr *local_addr);
+int mdp_batch_append(uint8_t *buffer, size_t size, size_t *len, const struct mdp_header *header, const uint8_t *payload, size_t payload_len);
+int mdp_batch_next(const uint8_t *buffer, size_t len, size_t *offset, struct mdp_header *header, const uint8_t **payload, size_t *payload_len);
+int _mdp_batch_send(struct __sourceloc, int socket, struct mdp_batch *batch, const struct mdp_header *header, const uint8_t *payload, size_t len);
+int _mdp_batch_flush(struct __sourceloc, int socket, struct mdp_batch *batch);
+ssize_t _mdp_batch_recv(struct __sourceloc, int socket, struct mdp_batch *batch, struct mdp_header *header, uint8_t *payload, size_t max_len);
+
+#define mdp_bind_batch(s,a)       _mdp_bind_batch(__WHENCE__, (s), (a))
+#define mdp_batch_send(s,b,h,p,l) _mdp_batch_send(__WHENCE__, (s), (b), (h), (p), (l))
+#define mdp_batch_flush(s,b)      _mdp_batch_flush(__WHENCE__, (s), (b))
+#define mdp_batch_recv(s,b,h,p,l) _mdp_batch_recv(__WHENCE__, (s), (b), (h), (p), (l))
+
 /* Client-side MDP function */
 int overlay_mdp_client_socket(void);
 int overlay_mdp_client_close(int mdp_sockfd);
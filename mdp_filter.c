@@ -45,6 +45,42 @@ struct packet_rule {
   struct mdp_portrange local_ports;
   struct mdp_portrange remote_ports;
   uint8_t flags;
+  // position in the rules file, so first-match order survives compilation
+  unsigned index;
+  // number of packets that this rule has decided
+  unsigned hits;
+};
+
+/* The rules that can apply to packets in one direction, compiled from the rule list.  Rules that
+ * name a remote SID are bucketed by that subscriber, the rest are kept in one wildcard list.  Each
+ * list is in rule file order, so merging the remote's bucket with the wildcard list by index
+ * yields exactly the rules that the linear scan would have considered, in the same order.
+ */
+struct rule_list {
+  struct subscriber *remote_subscriber;
+  unsigned count;
+  unsigned size;
+  struct packet_rule **rules;
+};
+
+struct compiled_rules {
+  struct rule_list wildcard;
+  unsigned bucket_count;
+  struct rule_list *buckets;
+};
+
+// Recent decisions, so that a busy flow doesn't need to re-evaluate the rules for every packet.
+#define VERDICT_CACHE_SIZE 256
+
+struct verdict {
+  struct subscriber *local_subscriber;
+  struct subscriber *remote_subscriber;
+  mdp_port_t local_port;
+  mdp_port_t remote_port;
+  // RULE_INBOUND or RULE_OUTBOUND, zero for an empty cache slot
+  uint8_t direction;
+  // NULL if no rule matched
+  struct packet_rule *rule;
 };
 
 #define RULE_DROP	  (1<<0)
@@ -91,53 +127,186 @@ static strbuf strbuf_append_packet_rule(strbuf sb, const struct packet_rule *rul
 
 static struct packet_rule *packet_rules = NULL;
 static struct file_meta packet_rules_meta = FILE_META_UNKNOWN;
+static struct compiled_rules inbound_rules;
+static struct compiled_rules outbound_rules;
+static struct verdict verdict_cache[VERDICT_CACHE_SIZE];
 
-int allow_inbound_packet(const struct internal_mdp_header *header)
+static int rule_matches(const struct packet_rule *rule,
+			const struct subscriber *local, mdp_port_t local_port,
+			const struct subscriber *remote, mdp_port_t remote_port)
 {
-  const struct packet_rule *rule;
-  for (rule = packet_rules; rule; rule = rule->next)
-    if (   (   (rule->flags & RULE_INBOUND)
-	    && (rule->remote_subscriber == NULL || header->source == rule->remote_subscriber)
-	    && (!(rule->flags & RULE_REMOTE_PORT) || (header->source_port >= rule->remote_ports.port_first && header->source_port <= rule->remote_ports.port_last))
-	    && (rule->local_subscriber == NULL || header->destination == rule->local_subscriber)
-	    && (!(rule->flags & RULE_LOCAL_PORT) || (header->destination_port >= rule->local_ports.port_first && header->destination_port <= rule->local_ports.port_last))
-	   )
-	|| (rule->flags & (RULE_INBOUND | RULE_OUTBOUND)) == 0
-    ) {
-      if (rule->flags & RULE_DROP)
-	DEBUGF(mdp_filter, "DROP inbound packet source=%s:%"PRImdp_port_t" destination=%s:%"PRImdp_port_t,
-	       header->source ? alloca_tohex_sid_t(header->source->sid) : "null",
-	       header->source_port,
-	       header->destination ? alloca_tohex_sid_t(header->destination->sid) : "null",
-	       header->destination_port
-	      );
-      return rule->flags & RULE_DROP ? 0 : 1;
+  if ((rule->flags & (RULE_INBOUND | RULE_OUTBOUND)) == 0)
+    return 1;
+  return (rule->remote_subscriber == NULL || remote == rule->remote_subscriber)
+      && (!(rule->flags & RULE_REMOTE_PORT) || (remote_port >= rule->remote_ports.port_first && remote_port <= rule->remote_ports.port_last))
+      && (rule->local_subscriber == NULL || local == rule->local_subscriber)
+      && (!(rule->flags & RULE_LOCAL_PORT) || (local_port >= rule->local_ports.port_first && local_port <= rule->local_ports.port_last));
+}
+
+static unsigned subscriber_bucket(const struct compiled_rules *compiled, const struct subscriber *subscriber)
+{
+  uintptr_t h = (uintptr_t)subscriber;
+  h ^= h >> 7;
+  h ^= h >> 17;
+  return h & (compiled->bucket_count - 1);
+}
+
+static struct rule_list *find_rule_list(const struct compiled_rules *compiled, const struct subscriber *remote)
+{
+  if (!remote || !compiled->bucket_count)
+    return NULL;
+  unsigned i = subscriber_bucket(compiled, remote);
+  while (compiled->buckets[i].remote_subscriber){
+    if (compiled->buckets[i].remote_subscriber == remote)
+      return &compiled->buckets[i];
+    i = (i + 1) & (compiled->bucket_count - 1);
+  }
+  return NULL;
+}
+
+static struct packet_rule *first_matching_rule(const struct compiled_rules *compiled,
+					       const struct subscriber *local, mdp_port_t local_port,
+					       const struct subscriber *remote, mdp_port_t remote_port)
+{
+  const struct rule_list *peer = find_rule_list(compiled, remote);
+  const struct rule_list *any = &compiled->wildcard;
+  unsigned i = 0, j = 0;
+  while (1) {
+    struct packet_rule *a = (peer && i < peer->count) ? peer->rules[i] : NULL;
+    struct packet_rule *b = j < any->count ? any->rules[j] : NULL;
+    struct packet_rule *rule;
+    if (!a && !b)
+      return NULL;
+    if (a && (!b || a->index < b->index)) {
+      rule = a;
+      i++;
+    } else {
+      rule = b;
+      j++;
     }
-  return 1; // allow by default
+    if (rule_matches(rule, local, local_port, remote, remote_port))
+      return rule;
+  }
+}
+
+static struct packet_rule *lookup_rule(const struct compiled_rules *compiled, uint8_t direction,
+				       struct subscriber *local, mdp_port_t local_port,
+				       struct subscriber *remote, mdp_port_t remote_port)
+{
+  uintptr_t h = (uintptr_t)local ^ ((uintptr_t)remote >> 3) ^ direction;
+  h = h * 31 + local_port;
+  h = h * 31 + remote_port;
+  h ^= h >> 16;
+  struct verdict *v = &verdict_cache[(h ^ (h >> 8)) & (VERDICT_CACHE_SIZE - 1)];
+  if (!(   v->direction == direction
+	&& v->local_subscriber == local
+	&& v->remote_subscriber == remote
+	&& v->local_port == local_port
+	&& v->remote_port == remote_port)) {
+    v->direction = direction;
+    v->local_subscriber = local;
+    v->remote_subscriber = remote;
+    v->local_port = local_port;
+    v->remote_port = remote_port;
+    v->rule = first_matching_rule(compiled, local, local_port, remote, remote_port);
+  }
+  if (v->rule)
+    v->rule->hits++;
+  return v->rule;
+}
+
+int allow_inbound_packet(const struct internal_mdp_header *header)
+{
+  if (!packet_rules)
+    return 1;
+  const struct packet_rule *rule = lookup_rule(&inbound_rules, RULE_INBOUND,
+					       header->destination, header->destination_port,
+					       header->source, header->source_port);
+  if (!rule)
+    return 1; // allow by default
+  if (rule->flags & RULE_DROP)
+    DEBUGF(mdp_filter, "DROP inbound packet source=%s:%"PRImdp_port_t" destination=%s:%"PRImdp_port_t,
+	   header->source ? alloca_tohex_sid_t(header->source->sid) : "null",
+	   header->source_port,
+	   header->destination ? alloca_tohex_sid_t(header->destination->sid) : "null",
+	   header->destination_port
+	  );
+  return rule->flags & RULE_DROP ? 0 : 1;
 }
 
 int allow_outbound_packet(const struct internal_mdp_header *header)
 {
-  const struct packet_rule *rule;
-  for (rule = packet_rules; rule; rule = rule->next)
-    if (   (   (rule->flags & RULE_OUTBOUND)
-	    && (rule->remote_subscriber == NULL || header->destination == rule->remote_subscriber)
-	    && (!(rule->flags & RULE_REMOTE_PORT) || (header->destination_port >= rule->remote_ports.port_first && header->destination_port <= rule->remote_ports.port_last))
-	    && (rule->local_subscriber == NULL || header->source == rule->local_subscriber)
-	    && (!(rule->flags & RULE_LOCAL_PORT) || (header->source_port >= rule->local_ports.port_first && header->source_port <= rule->local_ports.port_last))
-	   )
-	|| (rule->flags & (RULE_INBOUND | RULE_OUTBOUND)) == 0
-    ) {
-      if (rule->flags & RULE_DROP)
-	DEBUGF(mdp_filter, "DROP outbound packet source=%s:%"PRImdp_port_t" destination=%s:%"PRImdp_port_t,
-	       header->source ? alloca_tohex_sid_t(header->source->sid) : "null",
-	       header->source_port,
-	       header->destination ? alloca_tohex_sid_t(header->destination->sid) : "null",
-	       header->destination_port
-	      );
-      return rule->flags & RULE_DROP ? 0 : 1;
+  if (!packet_rules)
+    return 1;
+  const struct packet_rule *rule = lookup_rule(&outbound_rules, RULE_OUTBOUND,
+					       header->source, header->source_port,
+					       header->destination, header->destination_port);
+  if (!rule)
+    return 1; // allow by default
+  if (rule->flags & RULE_DROP)
+    DEBUGF(mdp_filter, "DROP outbound packet source=%s:%"PRImdp_port_t" destination=%s:%"PRImdp_port_t,
+	   header->source ? alloca_tohex_sid_t(header->source->sid) : "null",
+	   header->source_port,
+	   header->destination ? alloca_tohex_sid_t(header->destination->sid) : "null",
+	   header->destination_port
+	  );
+  return rule->flags & RULE_DROP ? 0 : 1;
+}
+
+static int append_rule(struct rule_list *list, struct packet_rule *rule)
+{
+  if (list->count == list->size) {
+    unsigned size = list->size ? list->size * 2 : 4;
+    struct packet_rule **rules = erealloc(list->rules, size * sizeof(struct packet_rule *));
+    if (!rules)
+      return -1;
+    list->rules = rules;
+    list->size = size;
+  }
+  list->rules[list->count++] = rule;
+  return 0;
+}
+
+static void free_compiled_rules(struct compiled_rules *compiled)
+{
+  unsigned i;
+  for (i = 0; i < compiled->bucket_count; ++i)
+    free(compiled->buckets[i].rules);
+  free(compiled->buckets);
+  free(compiled->wildcard.rules);
+  bzero(compiled, sizeof *compiled);
+}
+
+static int compile_rules(struct compiled_rules *compiled, struct packet_rule *rules, uint8_t direction)
+{
+  unsigned count = 0;
+  struct packet_rule *rule;
+  for (rule = rules; rule; rule = rule->next)
+    if (rule->remote_subscriber)
+      count++;
+  if (count) {
+    // every remote subscriber could be different, keep the table at most half full
+    compiled->bucket_count = 4;
+    while (compiled->bucket_count < count * 2)
+      compiled->bucket_count <<= 1;
+    if ((compiled->buckets = emalloc_zero(compiled->bucket_count * sizeof(struct rule_list))) == NULL)
+      return -1;
+  }
+  for (rule = rules; rule; rule = rule->next) {
+    if ((rule->flags & (RULE_INBOUND | RULE_OUTBOUND)) && !(rule->flags & direction))
+      continue;
+    struct rule_list *list = &compiled->wildcard;
+    if (rule->remote_subscriber) {
+      unsigned i = subscriber_bucket(compiled, rule->remote_subscriber);
+      while (compiled->buckets[i].remote_subscriber && compiled->buckets[i].remote_subscriber != rule->remote_subscriber)
+	i = (i + 1) & (compiled->bucket_count - 1);
+      list = &compiled->buckets[i];
+      list->remote_subscriber = rule->remote_subscriber;
     }
-  return 1; // allow by default
+    if (append_rule(list, rule) == -1)
+      return -1;
+  }
+  return 0;
 }
 
 static void free_rule_list(struct packet_rule *rule)
@@ -577,6 +746,15 @@ static int parse_mdp_packet_rules(FILE *fp, struct packet_rule **rulep)
  */
 static void clear_mdp_packet_rules()
 {
+  if (IF_DEBUG(mdp_filter) && packet_rules) {
+    DEBUG(mdp_filter, "packet filter rule hits:");
+    const struct packet_rule *rule;
+    for (rule = packet_rules; rule; rule = rule->next)
+      DEBUGF(mdp_filter, "   %u %s", rule->hits, alloca_packet_rule(rule));
+  }
+  free_compiled_rules(&inbound_rules);
+  free_compiled_rules(&outbound_rules);
+  bzero(verdict_cache, sizeof verdict_cache);
   free_rule_list(packet_rules);
   packet_rules = NULL;
   DEBUG(mdp_filter, "cleared packet filter rules");
@@ -589,6 +767,19 @@ static void clear_mdp_packet_rules()
 static void set_mdp_packet_rules(struct packet_rule *rules)
 {
   clear_mdp_packet_rules();
+  unsigned index = 0;
+  struct packet_rule *rule;
+  for (rule = rules; rule; rule = rule->next)
+    rule->index = index++;
+  if (   compile_rules(&inbound_rules, rules, RULE_INBOUND) == -1
+      || compile_rules(&outbound_rules, rules, RULE_OUTBOUND) == -1) {
+    // without an index, no rules would be applied at all, so refuse to half-load them
+    WHY("cannot compile packet filter rules -- allowing all packets");
+    free_compiled_rules(&inbound_rules);
+    free_compiled_rules(&outbound_rules);
+    free_rule_list(rules);
+    return;
+  }
   packet_rules = rules;
   if (IF_DEBUG(mdp_filter) && packet_rules) {
     DEBUG(mdp_filter, "set new packet filter rules:");
@@ -598,6 +789,19 @@ static void set_mdp_packet_rules(struct packet_rule *rules)
   }
 }
 
+static void mdp_filter_mark_subscribers()
+{
+  const struct packet_rule *rule;
+  for (rule = packet_rules; rule; rule = rule->next) {
+    mark_subscriber_in_use(rule->local_subscriber);
+    mark_subscriber_in_use(rule->remote_subscriber);
+  }
+  // cached verdicts are keyed by subscriber pointers, which may be about to be free'd and reused
+  bzero(verdict_cache, sizeof verdict_cache);
+}
+
+DEFINE_TRIGGER(subscriber_mark, mdp_filter_mark_subscribers);
+
 /* Load the packet filter rules from the configured file if the file has changed since last load.
  *
  * @author Andrew Bettison <andrew@servalproject.com>
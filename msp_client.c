@@ -321,9 +321,9 @@ static int msp_send_packet(struct msp_sock *sock, struct msp_packet *packet)
       return -1;
   }
   
-  uint8_t msp_header[MSP_PAYLOAD_PREAMBLE_SIZE];
+  uint8_t msp_header[MSP_MAX_PREAMBLE_SIZE];
 
-  msp_write_preamble(msp_header, &sock->stream, packet);
+  size_t header_len = msp_write_preamble(msp_header, &sock->stream, packet);
   
   struct fragmented_data data={
     .fragment_count=3,
@@ -334,7 +334,7 @@ static int msp_send_packet(struct msp_sock *sock, struct msp_packet *packet)
       },
       {
 	.iov_base = &msp_header,
-	.iov_len = sizeof(msp_header)
+	.iov_len = header_len
       },
       {
 	.iov_base = (void*)packet->payload,
@@ -365,8 +365,8 @@ static int send_ack(struct msp_sock *sock)
       return -1;
   }
   
-  uint8_t msp_header[3];
-  msp_write_ack_header(msp_header, &sock->stream);
+  uint8_t msp_header[MSP_MAX_ACK_SIZE];
+  size_t header_len = msp_write_ack(msp_header, &sock->stream);
   
   struct fragmented_data data={
     .fragment_count=2,
@@ -377,7 +377,7 @@ static int send_ack(struct msp_sock *sock)
       },
       {
 	.iov_base = &msp_header,
-	.iov_len = sizeof(msp_header)
+	.iov_len = header_len
       }
     }
   };
@@ -457,31 +457,36 @@ static int process_sock(struct msp_sock *sock)
   }
   assert(count == sock->stream.tx.packet_count);
   
-  if (count >= MAX_WINDOW_SIZE || (sock->stream.state & (MSP_STATE_CLOSED|MSP_STATE_SHUTDOWN_LOCAL)))
+  if (count >= sock->stream.cwnd || (sock->stream.state & (MSP_STATE_CLOSED|MSP_STATE_SHUTDOWN_LOCAL)))
     assert(!(sock->stream.state & MSP_STATE_DATAOUT));
   else
     assert(sock->stream.state & MSP_STATE_DATAOUT);
   
   
-  // transmit packets that can now be sent
+  // transmit packets that can now be sent, within the congestion window and the other party's receive window
   time_ms_t now = gettime_ms();
+  unsigned window = 0;
   p = sock->stream.tx._head;
-  while(p){
-    if (p->sent + RETRANSMIT_TIME < now){
-      if (!sock->header.local.port){
-	// if there's already a binding being processed, wait for it to complete
-	if (pending_bind(sock->mdp_sock))
+  while(p && window < sock->stream.cwnd && msp_window_allows(&sock->stream, p)){
+    // skip packets the other party has told us it already has
+    if (!p->sacked){
+      window++;
+      if (msp_packet_due(&sock->stream, p, now)){
+	if (!sock->header.local.port){
+	  // if there's already a binding being processed, wait for it to complete
+	  if (pending_bind(sock->mdp_sock))
+	    break;
+	  sock->header.flags |= MDP_FLAG_BIND;
+	}
+	int r = msp_send_packet(sock, p);
+	if (r==-1)
+	  return -1;
+	if (r)
 	  break;
-	sock->header.flags |= MDP_FLAG_BIND;
       }
-      int r = msp_send_packet(sock, p);
-      if (r==-1)
-	return -1;
-      if (r)
-	break;
+      if (sock->stream.next_action > p->sent + sock->stream.rto)
+	sock->stream.next_action = p->sent + sock->stream.rto;
     }
-    if (sock->stream.next_action > p->sent + RETRANSMIT_TIME)
-      sock->stream.next_action = p->sent + RETRANSMIT_TIME;
     p=p->_next;
   }
   
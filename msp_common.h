@@ -6,9 +6,33 @@
 #define FLAG_ACK (1<<1)
 #define FLAG_FIRST (1<<2)
 #define FLAG_STOP (1<<3)
+// set on every packet by peers that understand FLAG_SACK
+#define FLAG_SACK_OK (1<<4)
+// an ack without data, followed by a bitmap of packets received after the acked seq
+#define FLAG_SACK (1<<5)
+// the rest of the header is followed by the number of packets after the acked seq we have room for
+#define FLAG_WINDOW (1<<6)
 #define RETRANSMIT_TIME 1500
 #define HANDLER_KEEPALIVE 1000
 
+// header, ack seq, optional SACK bitmap and optional receive window
+#define MSP_MAX_ACK_SIZE 6
+#define MSP_MAX_PREAMBLE_SIZE (MSP_PAYLOAD_PREAMBLE_SIZE+1)
+#define MSP_SACK_BITS 16
+
+// packets we will hold beyond the last one the application has consumed
+#define MSP_RX_WINDOW 32
+
+// retransmission timeout bounds, the first packets use RETRANSMIT_TIME
+#define MSP_MIN_RTO 200
+#define MSP_MAX_RTO 5000
+
+// congestion window, in packets
+#define MSP_INITIAL_WINDOW 4
+#define MSP_MIN_WINDOW 2
+#define MSP_MAX_WINDOW 32
+#define MSP_DUP_ACK_THRESHOLD 3
+
 typedef uint16_t msp_state_t;
 
 struct msp_packet{
@@ -19,10 +43,12 @@ struct msp_packet{
   time_ms_t sent;
   size_t len;
   size_t offset;
+  uint8_t transmissions;
+  uint8_t sacked;
+  uint8_t fast_retransmitted;
   uint8_t payload[];
 };
 
-#define MAX_WINDOW_SIZE 4
 struct msp_window{
   unsigned packet_count;
   uint32_t base_rtt;
@@ -41,6 +67,24 @@ struct msp_stream{
   time_ms_t next_ack;
   time_ms_t timeout;
   time_ms_t next_action;
+  
+  // congestion control for tx, see msp_ack_received()
+  unsigned cwnd;
+  unsigned cwnd_acked;
+  unsigned ssthresh;
+  unsigned dup_acks;
+  uint16_t recover;
+  uint8_t in_recovery;
+  // the remote party has told us it understands SACK
+  uint8_t peer_sack;
+  // the remote party has told us how far ahead we may send, see msp_window_allows()
+  uint8_t peer_window;
+  uint16_t send_limit;
+  // the limit we last told the remote party about
+  uint16_t advertised_limit;
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t rto;
 };
 
 static void msp_stream_init(struct msp_stream *stream)
@@ -55,6 +99,9 @@ static void msp_stream_init(struct msp_stream *stream)
   stream->next_action = TIME_MS_NEVER_WILL;
   stream->timeout = gettime_ms() + 10000;
   stream->previous_ack = 0x7FFF;
+  stream->cwnd = MSP_INITIAL_WINDOW;
+  stream->ssthresh = MSP_MAX_WINDOW;
+  stream->rto = RETRANSMIT_TIME;
 }
 
 static void free_all_packets(struct msp_window *window)
@@ -69,16 +116,19 @@ static void free_all_packets(struct msp_window *window)
   window->packet_count=0;
 }
 
-static void free_acked_packets(struct msp_window *window, uint16_t seq)
+// returns the number of packets released, and the smallest RTT of any that were only sent once
+static unsigned free_acked_packets(struct msp_window *window, uint16_t seq, uint32_t *rtt_sample)
 {
   if (!window->_head)
-    return;
+    return 0;
   struct msp_packet *p = window->_head;
   uint32_t rtt=0xFFFFFFFF, rtt_max=0;
   time_ms_t now = gettime_ms();
+  unsigned count=0;
 
   while(p && compare_wrapped_uint16(p->seq, seq)<=0){
-    if (p->sent!=TIME_MS_NEVER_HAS){
+    // a retransmitted packet can't tell us which copy was acked
+    if (p->sent!=TIME_MS_NEVER_HAS && p->transmissions==1){
       uint32_t this_rtt=now - p->sent;
       if (rtt > this_rtt)
 	rtt = this_rtt;
@@ -89,6 +139,7 @@ static void free_acked_packets(struct msp_window *window, uint16_t seq)
     p=p->_next;
     free(free_me);
     window->packet_count--;
+    count++;
   }
   window->_head = p;
   if (rtt!=0xFFFFFFFF){
@@ -97,10 +148,13 @@ static void free_acked_packets(struct msp_window *window, uint16_t seq)
     window->rtt = rtt;
     if (window->base_rtt > rtt)
       window->base_rtt = rtt;
+    if (rtt_sample)
+      *rtt_sample = rtt;
     DEBUGF(msp, "ACK %x, RTT %u-%u, base %u", seq, rtt, rtt_max, window->base_rtt);
   }
   if (!p)
     window->_tail = NULL;
+  return count;
 }
 
 static int add_packet(struct msp_window *window, uint16_t seq, uint8_t flags, const uint8_t *payload, size_t len)
@@ -155,9 +209,26 @@ static int add_packet(struct msp_window *window, uint16_t seq, uint8_t flags, co
   return 1;
 }
 
+/* The seq of the last packet we hold with no gaps before it, whether or not it has been consumed.
+ * Older peers don't send a receive window, so they are only acked as far as we have consumed,
+ * which stops them from sending more than we can hold.
+ */
+static uint16_t msp_rx_ack_seq(struct msp_stream *stream)
+{
+  uint16_t seq = stream->rx.next_seq;
+  if (stream->peer_sack){
+    struct msp_packet *p = stream->rx._head;
+    while(p && p->seq == seq){
+      seq++;
+      p=p->_next;
+    }
+  }
+  return seq -1;
+}
+
 static size_t msp_write_ack_header(uint8_t *header, struct msp_stream *stream)
 {
-  header[0]=0;
+  header[0]=config.debug.nomspsack ? 0 : FLAG_SACK_OK;
   // if we haven't heard a sequence number, we can't ack data
   // (but we can indicate the existence of the connection)
   if (stream->state & MSP_STATE_RECEIVED_DATA)
@@ -167,17 +238,62 @@ static size_t msp_write_ack_header(uint8_t *header, struct msp_stream *stream)
   if (!(stream->state & MSP_STATE_RECEIVED_PACKET))
     header[0]|=FLAG_FIRST;
     
-  write_uint16(&header[1], stream->rx.next_seq -1);
+  uint16_t ack_seq = msp_rx_ack_seq(stream);
+  write_uint16(&header[1], ack_seq);
   
-  stream->previous_ack = stream->rx.next_seq -1;
+  stream->previous_ack = ack_seq;
   stream->tx.last_activity = gettime_ms();
   stream->next_ack = stream->tx.last_activity + RETRANSMIT_TIME;
   
   DEBUGF(msp, "Sending packet flags %02x (acked %02x)", 
-    header[0], stream->rx.next_seq -1);
+    header[0], ack_seq);
   return 3;
 }
 
+// tell the other party how many packets after the acked seq we have room for.
+static size_t msp_write_window(uint8_t *header, size_t len, struct msp_stream *stream)
+{
+  if (!stream->peer_sack || !(header[0] & FLAG_ACK))
+    return len;
+  uint16_t ack_seq = read_uint16(&header[1]);
+  uint16_t limit = stream->rx.next_seq + MSP_RX_WINDOW;
+  uint16_t window = limit - (uint16_t)(ack_seq +1);
+  if (window > MSP_RX_WINDOW)
+    window = 0;
+  header[0]|=FLAG_WINDOW;
+  header[len]=window;
+  stream->advertised_limit = limit;
+  return len+1;
+}
+
+// write an ack without data, including which later packets we hold if the other party can use that.
+// header must have space for MSP_MAX_ACK_SIZE bytes
+static size_t msp_write_ack(uint8_t *header, struct msp_stream *stream)
+{
+  size_t len = msp_write_ack_header(header, stream);
+  if (!stream->peer_sack || !(header[0] & FLAG_ACK))
+    return len;
+  
+  // bit i means we have packet ack+2+i, the packet after ack is always missing
+  uint16_t first = read_uint16(&header[1]) +2;
+  uint16_t bitmap = 0;
+  struct msp_packet *p = stream->rx._head;
+  while(p){
+    uint16_t offset = p->seq - first;
+    if (offset < MSP_SACK_BITS)
+      bitmap |= 1<<offset;
+    p=p->_next;
+  }
+  if (bitmap){
+    header[0]|=FLAG_SACK;
+    write_uint16(&header[len], bitmap);
+    len+=2;
+    DEBUGF(msp, "With SACK %04x", bitmap);
+  }
+  return msp_write_window(header, len, stream);
+}
+
+// header must have space for MSP_MAX_PREAMBLE_SIZE bytes
 static size_t msp_write_preamble(uint8_t *header, struct msp_stream *stream, struct msp_packet *packet)
 {
   msp_write_ack_header(header, stream);
@@ -188,7 +304,190 @@ static size_t msp_write_preamble(uint8_t *header, struct msp_stream *stream, str
   DEBUGF(msp, "With packet flags %02x seq %02x len %zd", 
     header[0], packet->seq, packet->len);
   packet->sent = stream->tx.last_packet = stream->tx.last_activity;
-  return MSP_PAYLOAD_PREAMBLE_SIZE;
+  if (packet->transmissions < 0xFF)
+    packet->transmissions++;
+  return msp_write_window(header, MSP_PAYLOAD_PREAMBLE_SIZE, stream);
+}
+
+// has the other party got room for this packet?
+static int msp_window_allows(struct msp_stream *stream, struct msp_packet *packet)
+{
+  return !stream->peer_window || compare_wrapped_uint16(packet->seq, stream->send_limit)<0;
+}
+
+static void msp_window_received(struct msp_stream *stream, uint16_t ack_seq, uint8_t window)
+{
+  uint16_t limit = ack_seq +1 +window;
+  // acks can arrive out of order, and the limit never moves backwards
+  if (stream->peer_window && compare_wrapped_uint16(limit, stream->send_limit)<=0)
+    return;
+  stream->peer_window = 1;
+  stream->send_limit = limit;
+  DEBUGF(msp, "Send limit %02x", limit);
+}
+
+static void msp_update_dataout(struct msp_stream *stream)
+{
+  if (stream->tx.packet_count < stream->cwnd
+    && !(stream->state & MSP_STATE_SHUTDOWN_LOCAL)
+    && !(stream->state & MSP_STATE_CLOSED))
+    stream->state|=MSP_STATE_DATAOUT;
+  else
+    stream->state&=~MSP_STATE_DATAOUT;
+}
+
+// send this packet again as soon as the congestion window allows
+static void msp_retransmit_now(struct msp_packet *packet)
+{
+  if (packet->transmissions && !packet->sacked && !packet->fast_retransmitted){
+    DEBUGF(msp, "Fast retransmit %02x", packet->seq);
+    packet->fast_retransmitted = 1;
+    packet->sent = TIME_MS_NEVER_HAS;
+  }
+}
+
+// shrink the window and retransmit the first missing packet
+static void msp_enter_recovery(struct msp_stream *stream)
+{
+  unsigned flight=0;
+  struct msp_packet *p = stream->tx._head;
+  if (!p)
+    return;
+  stream->recover = p->seq;
+  while(p){
+    if (p->transmissions){
+      stream->recover = p->seq;
+      if (!p->sacked)
+	flight++;
+    }
+    p=p->_next;
+  }
+  stream->ssthresh = flight/2 > MSP_MIN_WINDOW ? flight/2 : MSP_MIN_WINDOW;
+  stream->cwnd = stream->ssthresh;
+  stream->cwnd_acked = 0;
+  stream->in_recovery = 1;
+  DEBUGF(msp, "Packet loss, window %u, recover at %02x", stream->cwnd, stream->recover);
+  msp_retransmit_now(stream->tx._head);
+}
+
+// the first packet we are waiting for has not been acked within the retransmission timeout
+static void msp_retransmit_timeout(struct msp_stream *stream)
+{
+  unsigned flight=0;
+  struct msp_packet *p = stream->tx._head;
+  while(p){
+    if (p->transmissions && !p->sacked)
+      flight++;
+    p=p->_next;
+  }
+  stream->ssthresh = flight/2 > MSP_MIN_WINDOW ? flight/2 : MSP_MIN_WINDOW;
+  stream->cwnd = 1;
+  stream->cwnd_acked = 0;
+  stream->in_recovery = 0;
+  stream->dup_acks = 0;
+  stream->rto = stream->rto*2 < MSP_MAX_RTO ? stream->rto*2 : MSP_MAX_RTO;
+  DEBUGF(msp, "Retransmit timeout, rto %u", stream->rto);
+  msp_update_dataout(stream);
+}
+
+// should this packet be (re)transmitted now?
+static int msp_packet_due(struct msp_stream *stream, struct msp_packet *packet, time_ms_t now)
+{
+  if (packet->sent == TIME_MS_NEVER_HAS)
+    return 1;
+  if (packet->sent + stream->rto > now)
+    return 0;
+  if (packet == stream->tx._head){
+    msp_retransmit_timeout(stream);
+    // don't back off again if we fail to send it right away
+    packet->sent = TIME_MS_NEVER_HAS;
+  }
+  return 1;
+}
+
+static void msp_update_rto(struct msp_stream *stream, uint32_t rtt)
+{
+  if (!stream->srtt){
+    stream->srtt = rtt;
+    stream->rttvar = rtt/2;
+  }else{
+    uint32_t delta = stream->srtt > rtt ? stream->srtt - rtt : rtt - stream->srtt;
+    stream->rttvar = (3*stream->rttvar + delta)/4;
+    stream->srtt = (7*stream->srtt + rtt)/8;
+  }
+  uint32_t rto = stream->srtt + 4*stream->rttvar;
+  if (rto < MSP_MIN_RTO)
+    rto = MSP_MIN_RTO;
+  if (rto > MSP_MAX_RTO)
+    rto = MSP_MAX_RTO;
+  stream->rto = rto;
+}
+
+/* Release acknowledged packets and adjust the congestion window.
+ * The window grows by one packet per ack until the first loss, then by one packet per round trip.
+ * Repeated acks for the same seq that report later packets out of order mean the packet after it was
+ * lost, retransmit it without waiting for the timeout. Other repeated acks only update the window.
+ */
+static void msp_ack_received(struct msp_stream *stream, uint16_t ack_seq, uint8_t out_of_order)
+{
+  uint32_t rtt=0;
+  unsigned acked = free_acked_packets(&stream->tx, ack_seq, &rtt);
+  if (rtt)
+    msp_update_rto(stream, rtt);
+  
+  if (acked){
+    stream->dup_acks = 0;
+    if (stream->in_recovery){
+      if (compare_wrapped_uint16(ack_seq, stream->recover)>=0){
+	stream->in_recovery = 0;
+	stream->cwnd = stream->ssthresh;
+      }else if(stream->tx._head){
+	// only part of the window was acked, the next packet was lost too
+	msp_retransmit_now(stream->tx._head);
+      }
+    }else if (stream->cwnd < stream->ssthresh){
+      stream->cwnd += acked;
+    }else{
+      stream->cwnd_acked += acked;
+      if (stream->cwnd_acked >= stream->cwnd){
+	stream->cwnd_acked -= stream->cwnd;
+	stream->cwnd++;
+      }
+    }
+    if (stream->cwnd > MSP_MAX_WINDOW)
+      stream->cwnd = MSP_MAX_WINDOW;
+  }else if(out_of_order && stream->tx._head && stream->tx._head->transmissions){
+    if (++stream->dup_acks == MSP_DUP_ACK_THRESHOLD && !stream->in_recovery)
+      msp_enter_recovery(stream);
+  }
+}
+
+// mark the packets the other party already has, and retransmit any that several later packets overtook.
+static void msp_sack_received(struct msp_stream *stream, uint16_t ack_seq, uint16_t bitmap)
+{
+  uint16_t first = ack_seq +2;
+  unsigned sacked=0;
+  struct msp_packet *p = stream->tx._head;
+  while(p){
+    uint16_t offset = p->seq - first;
+    if (offset < MSP_SACK_BITS && (bitmap & (1<<offset)))
+      p->sacked = 1;
+    if (p->sacked)
+      sacked++;
+    p=p->_next;
+  }
+  
+  p = stream->tx._head;
+  while(p && sacked >= MSP_DUP_ACK_THRESHOLD){
+    if (p->sacked){
+      sacked--;
+    }else if(p->transmissions){
+      if (!stream->in_recovery)
+	msp_enter_recovery(stream);
+      msp_retransmit_now(p);
+    }
+    p=p->_next;
+  }
 }
 
 static ssize_t msp_stream_send(struct msp_stream *stream, const uint8_t *payload, size_t len)
@@ -196,16 +495,15 @@ static ssize_t msp_stream_send(struct msp_stream *stream, const uint8_t *payload
   assert(!(stream->state & MSP_STATE_LISTENING));
   assert((stream->state & MSP_STATE_SHUTDOWN_LOCAL)==0);
   
-  if ((stream->state & MSP_STATE_CLOSED) || stream->tx.packet_count > MAX_WINDOW_SIZE)
+  if ((stream->state & MSP_STATE_CLOSED) || stream->tx.packet_count > stream->cwnd)
     return -1;
   if (add_packet(&stream->tx, stream->tx.next_seq, 0, payload, len)==-1)
     return -1;
   
   stream->tx.next_seq++;
-  if (stream->tx.packet_count>=MAX_WINDOW_SIZE)
+  if (stream->tx.packet_count>=stream->cwnd)
     stream->state&=~MSP_STATE_DATAOUT;
   // make sure we attempt to process packets from this sock soon
-  // TODO calculate based on congestion window
   stream->next_action = gettime_ms();
   
   return len;
@@ -275,9 +573,16 @@ static void msp_consume_packet(struct msp_stream *stream, struct msp_packet *pac
   if (packet->offset < packet->len)
     return;
   
-  free_acked_packets(&stream->rx, stream->rx.next_seq);
+  free_acked_packets(&stream->rx, stream->rx.next_seq, NULL);
   stream->rx.next_seq++;
   
+  // let the other party know as soon as there is room for a good number of packets
+  if (stream->peer_sack){
+    uint16_t opened = stream->rx.next_seq + MSP_RX_WINDOW - stream->advertised_limit;
+    if (opened >= MSP_RX_WINDOW/2 && opened <= MSP_RX_WINDOW)
+      stream->next_ack = gettime_ms();
+  }
+  
   // when we've delivered all local packets
   // and all our data packets have been acked, close.
   if (   (stream->state & MSP_STATE_SHUTDOWN_LOCAL)
@@ -312,33 +617,45 @@ static int msp_process_packet(struct msp_stream *stream, const uint8_t *payload,
   if (len<3)
     return 0;
   
+  if ((flags & FLAG_SACK_OK) && !config.debug.nomspsack)
+    stream->peer_sack = 1;
+  
+  uint8_t pure_ack = (flags & FLAG_SACK) || len<MSP_PAYLOAD_PREAMBLE_SIZE;
+  size_t header_len = pure_ack ? 3 : MSP_PAYLOAD_PREAMBLE_SIZE;
+  uint8_t has_sack = (flags & FLAG_SACK) && len>=header_len+2;
+  if (has_sack)
+    header_len+=2;
+  uint8_t has_window = (flags & FLAG_WINDOW) && len>header_len;
+  
   if (flags & FLAG_ACK){
     uint16_t ack_seq = read_uint16(&payload[1]);
     // release acknowledged packets
-    free_acked_packets(&stream->tx, ack_seq);
-    
-    // TODO if their ack seq has not advanced, we may need to hurry up and retransmit a packet
+    msp_ack_received(stream, ack_seq, has_sack);
+    if (has_sack)
+      msp_sack_received(stream, ack_seq, read_uint16(&payload[3]));
+    if (has_window)
+      msp_window_received(stream, ack_seq, payload[header_len]);
   }
+  if (has_window)
+    header_len++;
   
   // Do we have space for more data now?
-  if (stream->tx.packet_count < MAX_WINDOW_SIZE 
-    && !(stream->state & MSP_STATE_SHUTDOWN_LOCAL)
-    && !(stream->state & MSP_STATE_CLOSED)){
-    stream->state|=MSP_STATE_DATAOUT;
-  }
+  msp_update_dataout(stream);
   
   // make sure we attempt to process packets from this sock soon
-  // TODO calculate based on congestion window
   stream->next_action = now;
   
-  if (len<MSP_PAYLOAD_PREAMBLE_SIZE)
+  if (pure_ack)
     return 0;
   
   stream->state |= MSP_STATE_RECEIVED_DATA;
   uint16_t seq = read_uint16(&payload[3]);
   stream->rx.last_packet = stream->rx.last_activity;
-  if (compare_wrapped_uint16(seq, stream->rx.next_seq)>=0){
-    if (add_packet(&stream->rx, seq, flags, &payload[MSP_PAYLOAD_PREAMBLE_SIZE], len - MSP_PAYLOAD_PREAMBLE_SIZE)==1)
+  if (stream->peer_sack && compare_wrapped_uint16(seq, stream->rx.next_seq + MSP_RX_WINDOW)>=0){
+    DEBUGF(msp, "Drop packet %02x beyond receive window", seq);
+    stream->next_ack = now;
+  }else if (compare_wrapped_uint16(seq, stream->rx.next_seq)>=0){
+    if (add_packet(&stream->rx, seq, flags, &payload[header_len], len - header_len)==1)
       stream->next_ack = now;
   }
   
@@ -127,9 +127,9 @@ static void send_frame(struct msp_server_state *state, struct overlay_buffer *pa
 static void send_packet(struct msp_server_state *state, struct msp_packet *packet)
 {
   struct overlay_buffer *payload = ob_new();
-  uint8_t *msp_header = ob_append_space(payload, MSP_PAYLOAD_PREAMBLE_SIZE);
+  uint8_t msp_header[MSP_MAX_PREAMBLE_SIZE];
   size_t len = msp_write_preamble(msp_header, &state->stream, packet);
-  assert(len == MSP_PAYLOAD_PREAMBLE_SIZE);
+  ob_append_bytes(payload, msp_header, len);
   if (packet->len)
     ob_append_bytes(payload, packet->payload, packet->len);
   ob_flip(payload);
@@ -139,8 +139,9 @@ static void send_packet(struct msp_server_state *state, struct msp_packet *packe
 static void send_ack(struct msp_server_state *state)
 {
   struct overlay_buffer *payload = ob_new();
-  uint8_t *msp_header = ob_append_space(payload, 3);
-  msp_write_ack_header(msp_header, &state->stream);
+  uint8_t msp_header[MSP_MAX_ACK_SIZE];
+  size_t len = msp_write_ack(msp_header, &state->stream);
+  ob_append_bytes(payload, msp_header, len);
   ob_flip(payload);
   send_frame(state, payload);
 }
@@ -154,16 +155,20 @@ struct msp_server_state * msp_process_next(struct msp_iterator *iterator)
     if (ptr){
       struct msp_packet *packet = ptr->stream.tx._head;
       time_ms_t next_packet = TIME_MS_NEVER_WILL;
+      unsigned window = 0;
       
       ptr->stream.next_action = ptr->stream.timeout;
-      while(packet){
-	if (packet->sent + RETRANSMIT_TIME <= now)
-	  // (re)transmit this packet
-	  send_packet(ptr, packet);
-	
-	if (next_packet > packet->sent + RETRANSMIT_TIME)
-	  next_packet = packet->sent + RETRANSMIT_TIME;
+      while(packet && window < ptr->stream.cwnd && msp_window_allows(&ptr->stream, packet)){
+	// skip packets the other party has told us it already has
+	if (!packet->sacked){
+	  window++;
+	  if (msp_packet_due(&ptr->stream, packet, now))
+	    // (re)transmit this packet
+	    send_packet(ptr, packet);
 	  
+	  if (next_packet > packet->sent + ptr->stream.rto)
+	    next_packet = packet->sent + ptr->stream.rto;
+	}
 	packet=packet->_next;
       }
       
@@ -299,6 +304,14 @@ struct subscriber * msp_remote_peer(struct msp_server_state *state)
   return state->remote_sid;
 }
 
+void msp_mark_subscribers(struct msp_server_state *root)
+{
+  for (; root; root = root->_next){
+    mark_subscriber_in_use(root->local_sid);
+    mark_subscriber_in_use(root->remote_sid);
+  }
+}
+
 msp_state_t msp_get_connection_state(struct msp_server_state *state)
 {
   return state->stream.state;
@@ -30,6 +30,7 @@ void msp_consumed(struct msp_server_state *state, struct msp_packet *packet, str
 time_ms_t msp_next_action(struct msp_server_state *state);
 time_ms_t msp_last_packet(struct msp_server_state *state);
 struct subscriber * msp_remote_peer(struct msp_server_state *state);
+void msp_mark_subscribers(struct msp_server_state *root);
 int msp_can_send(struct msp_server_state *state);
 msp_state_t msp_get_connection_state(struct msp_server_state *state);
 unsigned msp_queued_packet_count(struct msp_server_state *state);
@@ -34,16 +34,17 @@
 
 DEFINE_CMD(app_mdp_ping, 0,
   "Attempts to ping specified node via Mesh Datagram Protocol (MDP).",
-  "mdp","ping","[--interval=<ms>]","[--timeout=<seconds>]","[--wait-for-duplicates]",
+  "mdp","ping","[--interval=<ms>]","[--timeout=<seconds>]","[--wait-for-duplicates]","[--batch=<count>]",
   "<SID>|broadcast","[<count>]");
 static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *context)
 {
   int mdp_sockfd;
   DEBUG_cli_parsed(verbose, parsed);
-  const char *sidhex, *count, *opt_timeout, *opt_interval;
+  const char *sidhex, *count, *opt_timeout, *opt_interval, *opt_batch;
   int opt_wait_for_duplicates = 0 == cli_arg(parsed, "--wait-for-duplicates", NULL, NULL, NULL);
   if (   cli_arg(parsed, "--timeout", &opt_timeout, cli_interval_ms, "1") == -1
       || cli_arg(parsed, "--interval", &opt_interval, cli_interval_ms, "1") == -1
+      || cli_arg(parsed, "--batch", &opt_batch, cli_uint, "1") == -1
       || cli_arg(parsed, "SID", &sidhex, str_is_subscriber_id, "broadcast") == -1
       || cli_arg(parsed, "count", &count, cli_uint, "0") == -1)
     return -1;
@@ -66,6 +67,10 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
   str_to_uint64_interval_ms(opt_interval, &interval_ms, NULL);
   if (interval_ms == 0)
     interval_ms = 1000;
+  // how many pings to send together in one datagram each interval
+  unsigned batch = atoi(opt_batch);
+  if (batch == 0)
+    batch = 1;
     
   /* First sequence number in the echo frames */
   {
@@ -95,6 +100,26 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
   if (broadcast)
     mdp_header.flags |= MDP_FLAG_NO_CRYPT;
   
+  // batched pings need the binding to be agreed before the first one is sent
+  struct mdp_batch tx_batch, rx_batch;
+  tx_batch.len = tx_batch.offset = 0;
+  rx_batch.len = rx_batch.offset = 0;
+  int batching = 0;
+  if (batch > 1) {
+    switch (mdp_bind_batch(mdp_sockfd, &mdp_header.local)) {
+      case -1:
+	mdp_close(mdp_sockfd);
+	return WHY("Could not bind MDP socket");
+      case 0:
+	WARN("daemon does not support batching, sending pings one at a time");
+	break;
+      default:
+	batching = 1;
+	break;
+    }
+    mdp_header.flags &= ~MDP_FLAG_BIND;
+  }
+  
   /* TODO Eventually we should try to resolve SID to phone number and vice versa */
   cli_printf(context, "MDP PING %s: 12 data bytes", alloca_tohex_sid_t(ping_sid));
   cli_delim(context, "\n");
@@ -125,12 +150,17 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
   while (!sigIntFlag && (icount == 0 || tx_count < icount)) {
     time_ms_t now = gettime_ms();
     
-    // send a ping packet
-    if (tx_count == 0 || !(mdp_header.flags & MDP_FLAG_BIND)) {
+    // send the next ping packets
+    unsigned b;
+    for (b = 0; b < batch && (icount == 0 || tx_count < icount); ++b) {
+      if (tx_count != 0 && (mdp_header.flags & MDP_FLAG_BIND))
+	break;
       uint8_t payload[12];
       write_uint32(&payload[0], sequence_number);
       write_uint64(&payload[4], now);
-      int r = mdp_send(mdp_sockfd, &mdp_header, payload, sizeof(payload));
+      int r = batching
+	? mdp_batch_send(mdp_sockfd, &tx_batch, &mdp_header, payload, sizeof(payload))
+	: mdp_send(mdp_sockfd, &mdp_header, payload, sizeof(payload));
       if (r != -1) {
 	DEBUGF(mdprequests, "ping seq=%lu", (unsigned long)(sequence_number - firstSeq) + 1);
 	unsigned i = (unsigned long)(sequence_number - firstSeq) % NELS(stats);
@@ -148,6 +178,8 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
 	++tx_count;
       }
     }
+    if (batching)
+      mdp_batch_flush(mdp_sockfd, &tx_batch);
 
     // Now look for replies ("pongs") until one second has passed, and print any replies with
     // appropriate information as required
@@ -155,14 +187,18 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
     time_ms_t finish = now + (all_sent ? timeout_ms : interval_ms);
     while (!sigIntFlag && now < finish && (!all_sent || opt_wait_for_duplicates || missing_pong_count)) {
       time_ms_t poll_timeout_ms = finish - now;
-      if (mdp_poll(mdp_sockfd, poll_timeout_ms) <= 0) {
+      // frames left over from a batched datagram don't make the socket readable
+      int pending = rx_batch.offset < rx_batch.len;
+      if (!pending && mdp_poll(mdp_sockfd, poll_timeout_ms) <= 0) {
 	now = gettime_ms();
 	continue;
       }
 
       struct mdp_header mdp_recv_header;
       uint8_t recv_payload[12];
-      ssize_t len = mdp_recv(mdp_sockfd, &mdp_recv_header, recv_payload, sizeof(recv_payload));
+      ssize_t len = batching
+	? mdp_batch_recv(mdp_sockfd, &rx_batch, &mdp_recv_header, recv_payload, sizeof(recv_payload))
+	: mdp_recv(mdp_sockfd, &mdp_recv_header, recv_payload, sizeof(recv_payload));
       if (len == -1)
 	break;
       if (mdp_recv_header.flags & MDP_FLAG_ERROR) {
@@ -255,6 +291,100 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
   return ret;
 }
 
+// send count echo requests, a batch at a time, waiting for every reply before sending the next batch
+static int echo_test_run(int mdp_sockfd, int batching, const struct mdp_header *header, unsigned count, unsigned batch)
+{
+  struct mdp_batch tx_batch, rx_batch;
+  tx_batch.len = tx_batch.offset = 0;
+  rx_batch.len = rx_batch.offset = 0;
+  unsigned sent = 0, received = 0;
+  while (sent < count) {
+    unsigned n = count - sent < batch ? count - sent : batch;
+    unsigned i;
+    for (i = 0; i < n; ++i) {
+      uint8_t payload[12];
+      write_uint32(&payload[0], sent + i);
+      write_uint64(&payload[4], 0);
+      int r = batching
+	? mdp_batch_send(mdp_sockfd, &tx_batch, header, payload, sizeof(payload))
+	: mdp_send(mdp_sockfd, header, payload, sizeof(payload));
+      if (r == -1)
+	return -1;
+    }
+    if (batching && mdp_batch_flush(mdp_sockfd, &tx_batch) == -1)
+      return -1;
+    sent += n;
+    while (received < sent) {
+      int pending = rx_batch.offset < rx_batch.len;
+      if (!pending && mdp_poll(mdp_sockfd, 1000) <= 0)
+	return WHYF("Timed out waiting for echo replies, %u of %u received", received, sent);
+      struct mdp_header recv_header;
+      uint8_t recv_payload[12];
+      ssize_t len = batching
+	? mdp_batch_recv(mdp_sockfd, &rx_batch, &recv_header, recv_payload, sizeof(recv_payload))
+	: mdp_recv(mdp_sockfd, &recv_header, recv_payload, sizeof(recv_payload));
+      if (len == -1)
+	return -1;
+      if (recv_header.flags & MDP_FLAG_ERROR)
+	return WHY("error from daemon, please check the log for more information");
+      ++received;
+    }
+  }
+  return 0;
+}
+
+DEFINE_CMD(app_mdp_echo_test, 0,
+  "Measure MDP echo throughput to a local identity, one frame per datagram and in batches.",
+  "mdp","echo","test","[--count=<count>]","[--batch=<count>]","<SID>");
+static int app_mdp_echo_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *sidhex, *opt_count, *opt_batch;
+  if (   cli_arg(parsed, "--count", &opt_count, cli_uint, "2000") == -1
+      || cli_arg(parsed, "--batch", &opt_batch, cli_uint, "32") == -1
+      || cli_arg(parsed, "SID", &sidhex, str_is_subscriber_id, NULL) == -1)
+    return -1;
+  unsigned count = atoi(opt_count);
+  unsigned batch = atoi(opt_batch);
+  if (count == 0)
+    count = 1;
+  if (batch == 0)
+    batch = 1;
+  struct mdp_header header;
+  bzero(&header, sizeof(header));
+  if (str_to_sid_t(&header.remote.sid, sidhex) == -1)
+    return WHY("str_to_sid_t() failed");
+  header.remote.port = MDP_PORT_ECHO;
+  header.qos = OQ_MESH_MANAGEMENT;
+  header.ttl = PAYLOAD_TTL_DEFAULT;
+
+  time_us_t elapsed[2];
+  int batching;
+  for (batching = 0; batching < 2; ++batching) {
+    int mdp_sockfd;
+    if ((mdp_sockfd = mdp_socket()) < 0)
+      return WHY("Cannot create MDP socket");
+    header.local.sid = BIND_PRIMARY;
+    header.local.port = 0;
+    int r = batching ? mdp_bind_batch(mdp_sockfd, &header.local) : mdp_bind(mdp_sockfd, &header.local);
+    if (r == -1 || (batching && r == 0)) {
+      mdp_close(mdp_sockfd);
+      return WHY(r == -1 ? "Could not bind MDP socket" : "daemon does not support batching");
+    }
+    time_us_t start = gettime_us();
+    r = echo_test_run(mdp_sockfd, batching, &header, count, batching ? batch : 1);
+    elapsed[batching] = gettime_us() - start;
+    mdp_close(mdp_sockfd);
+    if (r == -1)
+      return -1;
+  }
+  cli_printf(context, "%u echoes one per datagram = %.2fms, %.2fus each\n",
+	     count, elapsed[0] / 1000.0, elapsed[0] * 1.0 / count);
+  cli_printf(context, "%u echoes in batches of %u = %.2fms, %.2fus each\n",
+	     count, batch, elapsed[1] / 1000.0, elapsed[1] * 1.0 / count);
+  return 0;
+}
+
 DEFINE_CMD(app_trace, 0,
    "Trace through the network to the specified node via MDP.",
    "mdp","trace","[--timeout=<seconds>]","<SID>");
@@ -64,7 +64,12 @@ typedef uint32_t time_s_t;
 #define TIME_MS_NEVER_WILL INT64_MAX
 #define TIME_MS_NEVER_HAS INT64_MIN
 
+/* Finer grained times, for rate limiting, are in microseconds since the Unix epoch.
+ */
+typedef int64_t time_us_t;
+
 time_ms_t gettime_ms();
+time_us_t gettime_us();
 time_s_t gettime();
 time_ms_t sleep_ms(time_ms_t milliseconds);
 struct timeval time_ms_to_timeval(time_ms_t);
@@ -37,6 +37,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_packet.h"
 #include "server.h"
 #include "route_link.h"
+#include "crypto.h"
 
 #define MAX_BPIS 1024
 #define BPI_MASK 0x3ff
@@ -61,6 +62,29 @@ struct tree_node{
 
 static __thread struct tree_node root;
 
+/* The tree is only needed to resolve abbreviated addresses. Whole SIDs are looked up in an open
+ addressing hash table, and every subscriber is also kept in a compact array, sorted by SID, for
+ enumeration.
+ */
+static __thread struct subscriber **subscriber_hash = NULL;
+static __thread unsigned subscriber_hash_size = 0; // always a power of two
+static __thread struct subscriber **subscriber_list = NULL;
+static __thread unsigned subscriber_count = 0;
+static __thread unsigned subscriber_list_size = 0;
+static __thread unsigned tree_node_count = 0;
+// SIDs arrive from other nodes, so the table is keyed with a secret to stop anyone choosing SIDs
+// that all land in the same slot
+static __thread unsigned char subscriber_hash_key[crypto_shorthash_KEYBYTES];
+
+/* Subscribers record the garbage collection pass in which they were last looked up. Each pass may
+ forget the least recently used unreachable subscribers, that haven't been looked up since the
+ previous pass and aren't referenced from anywhere else, until no more than
+ mdp.subscriber_limit remain.
+ */
+#define SUBSCRIBER_GC_INTERVAL 60000
+static __thread uint32_t subscriber_epoch = 0;
+DEFINE_ALARM(subscriber_gc);
+
 __thread struct subscriber *my_subscriber=NULL;
 
 static unsigned char get_nibble(const unsigned char *sidp, int pos)
@@ -71,6 +95,126 @@ static unsigned char get_nibble(const unsigned char *sidp, int pos)
   return byte&0xF;
 }
 
+static unsigned sid_hash(const unsigned char *sidp)
+{
+  unsigned char h[crypto_shorthash_BYTES];
+  crypto_shorthash(h, sidp, SID_SIZE, subscriber_hash_key);
+  unsigned ret;
+  memcpy(&ret, h, sizeof ret);
+  return ret;
+}
+
+static struct subscriber **subscriber_hash_slot(const unsigned char *sidp)
+{
+  unsigned mask = subscriber_hash_size - 1;
+  unsigned i = sid_hash(sidp) & mask;
+  while (subscriber_hash[i] && memcmp(subscriber_hash[i]->sid.binary, sidp, SID_SIZE) != 0)
+    i = (i + 1) & mask;
+  return &subscriber_hash[i];
+}
+
+static struct subscriber *hash_find_subscriber(const unsigned char *sidp)
+{
+  if (!subscriber_hash_size)
+    return NULL;
+  return *subscriber_hash_slot(sidp);
+}
+
+// position of the first subscriber in the enumeration list whose SID is not before this one
+static unsigned subscriber_list_position(const unsigned char *sidp)
+{
+  unsigned lo = 0, hi = subscriber_count;
+  while (lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    if (memcmp(subscriber_list[mid]->sid.binary, sidp, SID_SIZE) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// add a newly created subscriber to the hash table and enumeration list
+static int index_subscriber(struct subscriber *subscriber)
+{
+  // keep the hash table at most half full
+  if ((subscriber_count + 1) * 2 > subscriber_hash_size) {
+    unsigned new_size = subscriber_hash_size ? subscriber_hash_size * 2 : 64;
+    struct subscriber **new_hash = emalloc_zero(new_size * sizeof(struct subscriber *));
+    if (!new_hash)
+      return -1;
+    if (!subscriber_hash_size)
+      randombytes_buf(subscriber_hash_key, sizeof subscriber_hash_key);
+    struct subscriber **old_hash = subscriber_hash;
+    unsigned old_size = subscriber_hash_size;
+    subscriber_hash = new_hash;
+    subscriber_hash_size = new_size;
+    unsigned i;
+    for (i = 0; i < old_size; i++)
+      if (old_hash[i])
+	*subscriber_hash_slot(old_hash[i]->sid.binary) = old_hash[i];
+    free(old_hash);
+  }
+  if (subscriber_count >= subscriber_list_size) {
+    unsigned new_size = subscriber_list_size ? subscriber_list_size * 2 : 64;
+    struct subscriber **new_list = erealloc(subscriber_list, new_size * sizeof(struct subscriber *));
+    if (!new_list)
+      return -1;
+    subscriber_list = new_list;
+    subscriber_list_size = new_size;
+  }
+  *subscriber_hash_slot(subscriber->sid.binary) = subscriber;
+  unsigned pos = subscriber_list_position(subscriber->sid.binary);
+  memmove(&subscriber_list[pos + 1], &subscriber_list[pos], (subscriber_count - pos) * sizeof(struct subscriber *));
+  subscriber_list[pos] = subscriber;
+  subscriber_count++;
+  if (serverMode && subscriber_count > config.mdp.subscriber_limit && !is_scheduled(&ALARM_STRUCT(subscriber_gc))){
+    time_ms_t now = gettime_ms();
+    RESCHEDULE(&ALARM_STRUCT(subscriber_gc), now + SUBSCRIBER_GC_INTERVAL, TIME_MS_NEVER_WILL, TIME_MS_NEVER_WILL);
+  }
+  return 0;
+}
+
+// remove a subscriber from the hash table, shifting back any entries that probed past it
+static void unhash_subscriber(struct subscriber *subscriber)
+{
+  unsigned mask = subscriber_hash_size - 1;
+  struct subscriber **slot = subscriber_hash_slot(subscriber->sid.binary);
+  assert(*slot == subscriber);
+  unsigned i = slot - subscriber_hash;
+  unsigned j = i;
+  subscriber_hash[i] = NULL;
+  while (1) {
+    j = (j + 1) & mask;
+    if (!subscriber_hash[j])
+      break;
+    unsigned k = sid_hash(subscriber_hash[j]->sid.binary) & mask;
+    // can the entry at j move back to the empty slot at i?
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      subscriber_hash[i] = subscriber_hash[j];
+      subscriber_hash[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+// remove a subscriber from the tree, leaving any tree nodes in place
+static void untree_subscriber(struct subscriber *subscriber)
+{
+  struct tree_node *ptr = &root;
+  int pos = 0;
+  while (pos < SID_SIZE*2) {
+    unsigned char nibble = get_nibble(subscriber->sid.binary, pos++);
+    if (ptr->is_tree & (1<<nibble)) {
+      ptr = ptr->tree_nodes[nibble];
+    } else {
+      assert(ptr->subscribers[nibble] == subscriber);
+      ptr->subscribers[nibble] = NULL;
+      return;
+    }
+  }
+}
+
 static void free_subscriber(struct subscriber *subscriber)
 {
   if (subscriber->link_state || subscriber->destination)
@@ -89,6 +233,7 @@ static void free_children(struct tree_node *parent)
     if (parent->is_tree & (1<<i)){
       free_children(parent->tree_nodes[i]);
       free(parent->tree_nodes[i]);
+      tree_node_count--;
       parent->tree_nodes[i]=NULL;
     }else if(parent->subscribers[i]){
       free_subscriber(parent->subscribers[i]);
@@ -105,6 +250,13 @@ void free_subscribers()
   if (serverMode)
     FATAL("Freeing subscribers from a running daemon is not supported");
   free_children(&root);
+  free(subscriber_hash);
+  subscriber_hash = NULL;
+  subscriber_hash_size = 0;
+  free(subscriber_list);
+  subscriber_list = NULL;
+  subscriber_list_size = 0;
+  subscriber_count = 0;
 }
 
 // find a subscriber struct from a whole or abbreviated subscriber id
@@ -116,6 +268,12 @@ struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned
   if (len!=SID_SIZE)
     create =0;
   struct subscriber *ret = NULL;
+  // only walk the tree for abbreviations, or to add a new subscriber
+  if (len==SID_SIZE && ((ret = hash_find_subscriber(sidp)) || !create)){
+    if (ret)
+      ret->last_used = subscriber_epoch;
+    RETURN(ret);
+  }
   do {
     unsigned char nibble = get_nibble(sidp, pos++);
     if (ptr->is_tree & (1<<nibble)){
@@ -123,8 +281,13 @@ struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned
     }else if(!ptr->subscribers[nibble]){
       // subscriber is not yet known
       if (create && (ret = (struct subscriber *) emalloc_zero(sizeof(struct subscriber)))) {
-	ptr->subscribers[nibble] = ret;
 	ret->sid = *(const sid_t *)sidp;
+	if (index_subscriber(ret) == -1) {
+	  free(ret);
+	  ret = NULL;
+	  goto done;
+	}
+	ptr->subscribers[nibble] = ret;
 	ret->abbreviate_len = pos;
 	DEBUGF(subscriber, "Storing %s, abbrev_len=%d", alloca_tohex_sid_t(ret->sid), ret->abbreviate_len);
       }
@@ -147,6 +310,7 @@ struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned
 	ret = NULL;
 	goto done;
       }
+      tree_node_count++;
       ptr->tree_nodes[nibble] = new;
       ptr->is_tree |= (1<<nibble);
       ptr = new;
@@ -158,9 +322,94 @@ struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned
     }
   } while(pos < len*2);
 done:
+  if (ret)
+    ret->last_used = subscriber_epoch;
   RETURN(ret);
 }
 
+void mark_subscriber_in_use(struct subscriber *subscriber)
+{
+  if (subscriber)
+    subscriber->evictable = 0;
+}
+
+static int cmp_last_used(const void *a, const void *b)
+{
+  uint32_t x = (*(struct subscriber *const *)a)->last_used;
+  uint32_t y = (*(struct subscriber *const *)b)->last_used;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+void subscriber_gc(struct sched_ent *alarm)
+{
+  unsigned i;
+  unsigned candidates = 0;
+  for (i = 0; i < subscriber_count; i++) {
+    struct subscriber *s = subscriber_list[i];
+    s->evictable = s->last_used < subscriber_epoch
+		&& s->reachable == REACHABLE_NONE
+		&& s != my_subscriber
+		&& !s->identity
+		&& !s->destination
+		&& !s->sync_state
+		&& !s->sync_keys_state;
+  }
+  for (i = 0; i < subscriber_count; i++) {
+    mark_subscriber_in_use(subscriber_list[i]->next_hop);
+    mark_subscriber_in_use(subscriber_list[i]->prior_hop);
+  }
+  CALL_TRIGGER(subscriber_mark);
+  
+  unsigned evict = 0;
+  struct subscriber **victims = NULL;
+  for (i = 0; i < subscriber_count; i++)
+    if (subscriber_list[i]->evictable)
+      candidates++;
+  if (subscriber_count > config.mdp.subscriber_limit && candidates
+    && (victims = emalloc(candidates * sizeof(struct subscriber *)))) {
+    unsigned n = 0;
+    for (i = 0; i < subscriber_count; i++)
+      if (subscriber_list[i]->evictable)
+	victims[n++] = subscriber_list[i];
+    qsort(victims, n, sizeof(struct subscriber *), cmp_last_used);
+    evict = subscriber_count - config.mdp.subscriber_limit;
+    if (evict > n)
+      evict = n;
+    for (i = 0; i < evict; i++) {
+      struct subscriber *s = victims[i];
+      DEBUGF(subscriber, "Forgetting %s", alloca_tohex_sid_t(s->sid));
+      unhash_subscriber(s);
+      untree_subscriber(s);
+      link_state_forget(s);
+      s->evictable = 2; // remove from the list below
+    }
+    // compact the list, preserving order
+    unsigned j = 0;
+    for (i = 0; i < subscriber_count; i++) {
+      struct subscriber *s = subscriber_list[i];
+      if (s->evictable == 2)
+	free_subscriber(s);
+      else
+	subscriber_list[j++] = s;
+    }
+    subscriber_count = j;
+    free(victims);
+  }
+  
+  DEBUGF(subscriber, "Forgot %u of %u unused subscribers, %u remain using %zu bytes",
+	 evict, candidates, subscriber_count,
+	 subscriber_count * sizeof(struct subscriber)
+	 + subscriber_hash_size * sizeof(struct subscriber *)
+	 + subscriber_list_size * sizeof(struct subscriber *)
+	 + tree_node_count * sizeof(struct tree_node));
+  
+  subscriber_epoch++;
+  if (subscriber_count > config.mdp.subscriber_limit){
+    time_ms_t now = gettime_ms();
+    RESCHEDULE(alarm, now + SUBSCRIBER_GC_INTERVAL, TIME_MS_NEVER_WILL, TIME_MS_NEVER_WILL);
+  }
+}
+
 /* 
  Walk the subscriber tree, calling the callback function for each subscriber.
  if start is a valid pointer, the first entry returned will be after this subscriber
@@ -210,11 +459,21 @@ static void prefix_matches(uint8_t *id, unsigned len,
 }
 
 /*
- walk the tree, starting at start inclusive, calling the supplied callback function
+ call the supplied callback function for every subscriber in SID order, starting at start inclusive.
+ Subscribers created by the callback after the current one will also be visited.
  */
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context)
 {
-  walk_tree(&root, 0, start, callback, context);
+  unsigned i = start ? subscriber_list_position(start->sid.binary) : 0;
+  while (i < subscriber_count) {
+    struct subscriber *subscriber = subscriber_list[i];
+    if (callback(subscriber, context))
+      return;
+    // a subscriber created by the callback may have moved this one along the list
+    if (subscriber_list[i] != subscriber)
+      i = subscriber_list_position(subscriber->sid.binary);
+    i++;
+  }
 }
 
 // generate a new random broadcast address
@@ -23,6 +23,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "constants.h"
 #include "os.h" // for time_ms_t
 #include "socket.h"
+#include "trigger.h"
 
 // not reachable
 #define REACHABLE_NONE 0
@@ -51,35 +52,45 @@ struct overlay_buffer;
 
 // This structure supports both our own routing protocol which can store calculation details in *node 
 // or IP4 addresses reachable via any other kind of normal layer3 routing protocol, eg olsr
+// Fields used while parsing and routing every packet are kept together at the start.
 struct subscriber{
   sid_t sid;
+  
+  // result of routing calculations;
+  int reachable;
+  
   // minimum abbreviation length, in 4bit nibbles.
-  int abbreviate_len;
+  uint8_t abbreviate_len;
   
   // should we send the full address once?
-  int send_full;
+  uint8_t send_full;
   
-  int max_packet_version;
+  int8_t max_packet_version;
   
-  // link state routing information
-  struct link_state *link_state;
+  // forgetting unused subscribers; see subscriber_gc()
+  uint8_t evictable;
+  uint32_t last_used;
   
-  // rhizome sync state
-  struct rhizome_sync *sync_state;
-  struct rhizome_sync_keys *sync_keys_state;
-  uint8_t sync_version;
-
-  // result of routing calculations;
-  int reachable;
-
   // if indirect, who is the next hop?
   struct subscriber *next_hop;
   int hop_count;
-  struct subscriber *prior_hop;
   
   // if direct, or unicast, where do we send packets?
   struct network_destination *destination;
   
+  // link state routing information
+  struct link_state *link_state;
+  
+  // private keys for local identities
+  struct keyring_identity *identity;
+  
+  struct subscriber *prior_hop;
+  
+  // rhizome sync state
+  struct rhizome_sync *sync_state;
+  struct rhizome_sync_keys *sync_keys_state;
+  uint8_t sync_version;
+  
   time_ms_t last_stun_request;
   time_ms_t last_probe_response;
   time_ms_t last_explained;
@@ -88,9 +99,6 @@ struct subscriber{
   unsigned char sas_public[SAS_SIZE];
   time_ms_t sas_last_request;
   unsigned char sas_valid;
-  
-  // private keys for local identities
-  struct keyring_identity *identity;
 };
 
 struct broadcast{
@@ -121,6 +129,13 @@ struct subscriber *_find_subscriber(struct __sourceloc, const unsigned char *sid
 #define find_subscriber(sid, len, create) _find_subscriber(__WHENCE__, sid, len, create)
 
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context);
+
+/* Unreachable subscribers that haven't been used recently may be forgotten. Any module that holds
+ * subscriber pointers must define a subscriber_mark trigger, calling mark_subscriber_in_use()
+ * for each of them.
+ */
+void mark_subscriber_in_use(struct subscriber *subscriber);
+DECLARE_TRIGGER(subscriber_mark, void);
 int set_reachable(struct subscriber *subscriber, struct network_destination *destination, struct subscriber *next_hop, int hop_count, struct subscriber *prior_hop);
 struct network_destination *load_subscriber_address(struct subscriber *subscriber);
 
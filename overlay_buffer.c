@@ -31,10 +31,93 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  In either case, functions that don't take an offset use and advance the position.
  */
 
+/*
+ Buffers are built and freed for every packet sent or received, so both the buffer structs and
+ their byte storage (in power-of-two size classes up to OB_POOL_MAX_BYTES, which covers any
+ interface MTU) are kept on small per-thread free lists instead of being returned to the heap.
+ */
+
+#define OB_POOL_HEADERS 32
+#define OB_POOL_MIN_BYTES 64
+#define OB_POOL_MAX_BYTES 2048
+#define OB_POOL_CLASSES 6 // 64, 128, 256, 512, 1024, 2048
+#define OB_POOL_BLOCKS 16
+
+static __thread struct overlay_buffer *ob_header_pool[OB_POOL_HEADERS];
+static __thread unsigned ob_header_pool_count = 0;
+static __thread unsigned char *ob_bytes_pool[OB_POOL_CLASSES][OB_POOL_BLOCKS];
+static __thread unsigned ob_bytes_pool_count[OB_POOL_CLASSES];
+static __thread struct ob_pool_stats {
+  unsigned heap_allocs;
+  unsigned pool_allocs;
+  size_t bytes_copied;
+} ob_pool_stats;
+
+static struct overlay_buffer *ob_alloc_header()
+{
+  struct overlay_buffer *b;
+  if (ob_header_pool_count) {
+    b = ob_header_pool[--ob_header_pool_count];
+    bzero(b, sizeof *b);
+    ++ob_pool_stats.pool_allocs;
+  } else {
+    ++ob_pool_stats.heap_allocs;
+    if ((b = emalloc_zero(sizeof(struct overlay_buffer))) == NULL)
+      return NULL;
+  }
+  b->refs = 1;
+  return b;
+}
+
+static void ob_release_header(struct overlay_buffer *b)
+{
+  if (ob_header_pool_count < OB_POOL_HEADERS)
+    ob_header_pool[ob_header_pool_count++] = b;
+  else
+    free(b);
+}
+
+// Return the size class for a block of the given size, or -1 if it is too big to pool.
+static int ob_size_class(size_t size)
+{
+  if (size > OB_POOL_MAX_BYTES)
+    return -1;
+  int c = 0;
+  size_t class_size = OB_POOL_MIN_BYTES;
+  while (class_size < size) {
+    class_size <<= 1;
+    ++c;
+  }
+  return c;
+}
+
+static unsigned char *ob_alloc_bytes(size_t size)
+{
+  int c = ob_size_class(size);
+  if (c != -1 && ob_bytes_pool_count[c]) {
+    ++ob_pool_stats.pool_allocs;
+    return ob_bytes_pool[c][--ob_bytes_pool_count[c]];
+  }
+  ++ob_pool_stats.heap_allocs;
+  return emalloc(size);
+}
+
+static void ob_release_bytes(unsigned char *bytes, size_t size)
+{
+#ifndef MALLOC_PARANOIA
+  int c = ob_size_class(size);
+  if (c != -1 && ((size_t)OB_POOL_MIN_BYTES << c) == size && ob_bytes_pool_count[c] < OB_POOL_BLOCKS) {
+    ob_bytes_pool[c][ob_bytes_pool_count[c]++] = bytes;
+    return;
+  }
+#endif
+  free(bytes);
+}
+
 struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
-  DEBUGF(overlaybuffer, "ob_new() return %p", ret);
+  struct overlay_buffer *ret = ob_alloc_header();
+  DEBUGF(overlaybuffer, "ob_new() return %p (heap allocs=%u, pool allocs=%u)", ret, ob_pool_stats.heap_allocs, ob_pool_stats.pool_allocs);
   if (ret == NULL)
     return NULL;
   ob_unlimitsize(ret);
@@ -45,7 +128,7 @@ struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *bytes, size_t size)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = ob_alloc_header();
   DEBUGF(overlaybuffer, "ob_static(bytes=%p, size=%zu) return %p", bytes, size, ret);
   if (ret == NULL)
     return NULL;
@@ -58,27 +141,30 @@ struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *by
 
 // create a new overlay buffer from an existing piece of another buffer.
 // Both buffers will point to the same memory region.
-// It is up to the caller to ensure this buffer is not used after the parent buffer is freed.
+// The slice holds a reference to the parent, so ob_free() of the parent defers releasing its bytes
+// until every slice has been freed. The parent must not be resized while slices exist.
 struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buffer *b, size_t offset, size_t length)
 {
   if (offset + length > b->allocSize) {
     WHY("Buffer isn't long enough to slice");
     return NULL;
   }
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = ob_alloc_header();
   DEBUGF(overlaybuffer, "ob_slice(b=%p, offset=%zu, length=%zu) return %p", b, offset, length, ret);
   if (ret == NULL)
       return NULL;
   ret->bytes = b->bytes + offset;
   ret->allocSize = length;
   ret->allocated = NULL;
+  ret->parent = b;
+  ++b->refs;
   ob_unlimitsize(ret);
   return ret;
 }
 
 struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffer *b)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = ob_alloc_header();
   DEBUGF(overlaybuffer, "ob_dup(b=%p) return %p", b, ret);
   if (ret == NULL)
     return NULL;
@@ -94,8 +180,10 @@ struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffe
     }
     if (byteCount > b->allocSize)
       byteCount = b->allocSize;
-    if (byteCount)
+    if (byteCount) {
       ob_append_bytes(ret, b->bytes, byteCount);
+      ob_pool_stats.bytes_copied += byteCount;
+    }
   }
   return ret;
 }
@@ -103,10 +191,29 @@ struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffe
 void _ob_free(struct __sourceloc __whence, struct overlay_buffer *b)
 {
   assert(b != NULL);
-  DEBUGF(overlaybuffer, "ob_free(b=%p)", b);
-  if (b->allocated)
-    free(b->allocated);
-  free(b);
+  while (b) {
+    assert(b->refs > 0);
+    DEBUGF(overlaybuffer, "ob_free(b=%p) refs=%u", b, b->refs);
+    if (--b->refs)
+      return;
+    struct overlay_buffer *parent = b->parent;
+    if (b->allocated)
+      ob_release_bytes(b->allocated, b->allocSize);
+    ob_release_header(b);
+    b = parent;
+  }
+}
+
+// Total number of payload bytes this thread has copied from one buffer to another by ob_dup().
+size_t ob_bytes_copied()
+{
+  return ob_pool_stats.bytes_copied;
+}
+
+void ob_alloc_counts(unsigned *heap_allocs, unsigned *pool_allocs)
+{
+  *heap_allocs = ob_pool_stats.heap_allocs;
+  *pool_allocs = ob_pool_stats.pool_allocs;
 }
 
 int _ob_checkpoint(struct __sourceloc __whence, struct overlay_buffer *b)
@@ -180,9 +287,21 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     DEBUGF(overlaybuffer, "ob_makespace(): asked for space to %zu, beyond static buffer size of %zu", b->position + bytes, b->allocSize);
     return 0;
   }
+  // Don't move bytes out from under live slices.
+  if (b->refs > 1) {
+    DEBUGF(overlaybuffer, "ob_makespace(): asked for space to %zu, beyond size of %zu while sliced", b->position + bytes, b->allocSize);
+    return 0;
+  }
   size_t newSize = b->position + bytes;
-  if (newSize<64) newSize=64;
-  if (newSize&63) newSize+=64-(newSize&63);
+  // A buffer limited to an MTU-sized packet gets all its space at once, instead of growing.
+  if (b->sizeLimit <= OB_POOL_MAX_BYTES && newSize < b->sizeLimit)
+    newSize = b->sizeLimit;
+  if (newSize <= OB_POOL_MAX_BYTES) {
+    size_t classSize = OB_POOL_MIN_BYTES;
+    while (classSize < newSize)
+      classSize <<= 1;
+    newSize = classSize;
+  }
   if (newSize>1024 && (newSize&1023))
     newSize+=1024-(newSize&1023);
   if (newSize>65536 && (newSize&65535))
@@ -213,7 +332,7 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     for(i=0;i<4096;i++) new[newSize+i]=0xbd;
   }
 #else
-  unsigned char *new = emalloc(newSize);
+  unsigned char *new = ob_alloc_bytes(newSize);
 #endif
   if (!new)
     return 0;
@@ -221,7 +340,7 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     bcopy(b->bytes,new,b->position);
   if (b->allocated) {
     assert(b->allocated == b->bytes);
-    free(b->allocated);
+    ob_release_bytes(b->allocated, b->allocSize);
   }
   b->bytes=new;
   b->allocated=new;
@@ -37,6 +37,12 @@ struct overlay_buffer {
   
   // is this an allocated buffer? can it be resized? Should it be freed?
   unsigned char * allocated;
+  
+  // buffer that a slice points into, released when the slice is freed
+  struct overlay_buffer *parent;
+  
+  // references held by the owner and any live slices
+  unsigned refs;
 };
 
 struct overlay_buffer *_ob_new(struct __sourceloc __whence);
@@ -123,6 +129,10 @@ int _ob_overrun(struct __sourceloc, struct overlay_buffer *b);
 unsigned char* ob_ptr(struct overlay_buffer *b);
 // get the raw pointer of the current position
 unsigned char* ob_current_ptr(struct overlay_buffer *b);
+// total bytes copied between buffers by ob_dup() in this thread
+size_t ob_bytes_copied();
+// number of buffer structs and byte blocks this thread has taken from the heap and from its pools
+void ob_alloc_counts(unsigned *heap_allocs, unsigned *pool_allocs);
 
 #define ob_overrun(b) _ob_overrun(__WHENCE__, b)
 
@@ -57,6 +57,15 @@ struct sched_ent sock_any;
 struct socket_address sock_any_addr;
 struct profile_total sock_any_stats;
 
+static void overlay_interface_mark_subscribers()
+{
+  int i;
+  for (i = 0; i < OVERLAY_MAX_INTERFACES; i++)
+    mark_subscriber_in_use(overlay_interfaces[i].other_device);
+}
+
+DEFINE_TRIGGER(subscriber_mark, overlay_interface_mark_subscribers);
+
 static void overlay_interface_poll(struct sched_ent *alarm);
 static int inet_up_count=0;
 static void rescan_soon(time_ms_t run_at);
@@ -642,9 +651,9 @@ overlay_interface_init(const char *name,
   
   interface->state=INTERFACE_STATE_UP;
   INFOF("Interface %s addr %s, is up",interface->name, alloca_socket_address(addr));
-  INFOF("Allowing a maximum of %d packets every %"PRId64"ms",
-        interface->destination->transfer_limit.burst_size,
-        interface->destination->transfer_limit.burst_length);
+  INFOF("Allowing a packet every %"PRIu32"us, in bursts of up to %d",
+        interface->destination->transfer_limit.rate_micro_seconds,
+        interface->destination->transfer_limit.burst_size);
   
   CALL_TRIGGER(iupdown, interface);
   return 0;
@@ -659,8 +668,59 @@ cleanup:
   return cleanup_ret;
 }
 
+#ifdef HAVE_RECVMMSG
+/* Read a batch of up to ifconfig.rx_batch UDP packets with a single recvmmsg(2) call.  The batch
+ * size caps how many packets one interface may process per poll wakeup, so a busy interface cannot
+ * starve the others or the rest of the scheduler.  Returns the number of packets processed, or -1
+ * if the interface was closed.
+ */
+#define MAX_RX_BATCH 32
+
+static int interface_read_dgram_batch(struct overlay_interface *interface)
+{
+  static unsigned char packets[MAX_RX_BATCH][8096];
+  struct socket_address addrs[MAX_RX_BATCH];
+  struct iovec iovs[MAX_RX_BATCH];
+  struct mmsghdr msgs[MAX_RX_BATCH];
+  unsigned count = interface->ifconfig.rx_batch;
+  if (count > MAX_RX_BATCH)
+    count = MAX_RX_BATCH;
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    iovs[i].iov_base = packets[i];
+    iovs[i].iov_len = sizeof packets[i];
+    bzero(&addrs[i], sizeof addrs[i]);
+    bzero(&msgs[i], sizeof msgs[i]);
+    msgs[i].msg_hdr.msg_name = &addrs[i].addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof addrs[i].raw;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int n = recvmmsg(interface->alarm.poll.fd, msgs, count, MSG_DONTWAIT, NULL);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    WHYF_perror("recvmmsg(%d,%u)", interface->alarm.poll.fd, count);
+    overlay_interface_close(interface);
+    return -1;
+  }
+  DEBUGF(verbose_io, "recvmmsg(%d,%u) -> %d", interface->alarm.poll.fd, count, n);
+  for (i = 0; i < (unsigned)n && interface->state == INTERFACE_STATE_UP; ++i) {
+    addrs[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    packetOkOverlay(interface, packets[i], msgs[i].msg_len, &addrs[i]);
+  }
+  return n;
+}
+#endif
+
 static void interface_read_dgram(struct overlay_interface *interface)
 {
+#ifdef HAVE_RECVMMSG
+  if (interface->ifconfig.rx_batch > 1) {
+    interface_read_dgram_batch(interface);
+    return;
+  }
+#endif
   int plen=0;
   unsigned char packet[8096];
   
@@ -61,6 +61,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_packet.h"
 #include "mdp_client.h"
 #include "crypto.h"
+#include "crypto_worker.h"
 #include "keyring.h"
 #include "socket.h"
 #include "server.h"
@@ -91,16 +92,35 @@ static struct sched_ent mdp_sock2_inet = {
 };
 
 struct mdp_binding{
-  struct mdp_binding *_next;
+  // other bindings for any port with the same hash
+  struct mdp_binding *_next_port;
+  // other bindings for any client address with the same hash
+  struct mdp_binding *_next_client;
+  // list of bindings whose client has died, waiting to be free'd
+  struct mdp_binding *_next_dead;
   struct subscriber *subscriber;
   mdp_port_t port;
   uint8_t version;
   uint8_t flags;
+  uint8_t dead;
   struct socket_address client;
   time_ms_t binding_time;
+  // packets for a client that asked for MDP_FLAG_BATCH, waiting for mdp_flush_batches()
+  struct mdp_binding *_next_batch;
+  uint8_t *batch;
+  size_t batch_len;
+  unsigned batch_count;
+  uint8_t batch_queued;
 };
 
-static struct mdp_binding *mdp_bindings=NULL;
+// Bindings are indexed by port, so that an exact subscriber match, and the fallback to a binding
+// for any subscriber, are both found on the same short chain. They are also indexed by client
+// address, so that a dead client's bindings can be found without scanning every binding.
+#define MDP_BINDING_BUCKETS 256
+static struct mdp_binding *port_bindings[MDP_BINDING_BUCKETS];
+static struct mdp_binding *client_bindings[MDP_BINDING_BUCKETS];
+static struct mdp_binding *dead_bindings=NULL;
+static struct mdp_binding *batched_bindings=NULL;
 static mdp_port_t next_port_binding=256;
 static struct subscriber internal[0];
 
@@ -110,42 +130,186 @@ static int overlay_saw_mdp_frame(
 
 static int mdp_send2(struct __sourceloc, const struct socket_address *client, const struct mdp_header *header, 
   const uint8_t *payload, size_t payload_len);
+static int mdp_sendmsg(struct __sourceloc, const struct socket_address *client, struct iovec *iov, int iovcnt);
 
-static uint8_t has_dead_clients=0;
+static struct mdp_binding **port_bucket(mdp_port_t port)
+{
+  return &port_bindings[(port ^ (port >> 8)) & (MDP_BINDING_BUCKETS -1)];
+}
+
+// Addresses that cmp_sockaddr() considers equal must hash to the same bucket.
+static struct mdp_binding **client_bucket(const struct socket_address *client)
+{
+  uint32_t hash = client->addrlen;
+  if (client->addrlen >= sizeof client->addr.sa_family){
+    hash = hash * 31 + client->addr.sa_family;
+    switch(client->addr.sa_family){
+      case AF_INET:
+	hash = hash * 31 + client->inet.sin_addr.s_addr;
+	hash = hash * 31 + client->inet.sin_port;
+	break;
+      case AF_UNIX:{
+	unsigned pathlen = client->addrlen - sizeof client->local.sun_family;
+	unsigned i=0;
+	if (pathlen > 1 && client->local.sun_path[0]=='\0'){
+	  // abstract socket, nul bytes are not terminators
+	  for (i=1;i<pathlen;i++)
+	    hash = hash * 31 + (uint8_t)client->local.sun_path[i];
+	}else{
+	  for (i=0;i<pathlen && client->local.sun_path[i];i++)
+	    hash = hash * 31 + (uint8_t)client->local.sun_path[i];
+	}
+      }break;
+    }
+  }
+  hash ^= hash >> 16;
+  return &client_bindings[(hash ^ (hash >> 8)) & (MDP_BINDING_BUCKETS -1)];
+}
+
+static void link_binding(struct mdp_binding *b)
+{
+  struct mdp_binding **bucket = port_bucket(b->port);
+  b->_next_port = *bucket;
+  *bucket = b;
+  bucket = client_bucket(&b->client);
+  b->_next_client = *bucket;
+  *bucket = b;
+}
+
+static void unlink_binding(struct mdp_binding *b)
+{
+  struct mdp_binding **ptr = port_bucket(b->port);
+  while(*ptr != b)
+    ptr = &(*ptr)->_next_port;
+  *ptr = b->_next_port;
+  ptr = client_bucket(&b->client);
+  while(*ptr != b)
+    ptr = &(*ptr)->_next_client;
+  *ptr = b->_next_client;
+  b->_next_port = b->_next_client = NULL;
+}
+
+// Bindings can't be free'd while we might be walking them to deliver a packet,
+// so they are only marked here and free'd later by free_dead_clients().
 static int mark_dead_client(const struct socket_address *client)
 {
-  struct mdp_binding *binding = mdp_bindings;
+  struct mdp_binding *binding = *client_bucket(client);
   while(binding){
-    if (cmp_sockaddr(&binding->client, client)==0){
-      binding->port = 0;
-      has_dead_clients = 1;
+    if (!binding->dead && cmp_sockaddr(&binding->client, client)==0){
+      binding->dead = 1;
+      binding->_next_dead = dead_bindings;
+      dead_bindings = binding;
     }
-    binding = binding->_next;
+    binding = binding->_next_client;
   }
   return 0;
 }
 
+static void free_binding(struct mdp_binding *b)
+{
+  unlink_binding(b);
+  if (b->batch_queued){
+    struct mdp_binding **ptr = &batched_bindings;
+    while(*ptr != b)
+      ptr = &(*ptr)->_next_batch;
+    *ptr = b->_next_batch;
+  }
+  if (b->batch)
+    free(b->batch);
+  free(b);
+}
+
 static int free_dead_clients(){
-  if (!has_dead_clients)
-    return 0;
   //TODO send dummy frame?
-  struct mdp_binding **binding = &mdp_bindings;
-  while(*binding){
-    struct mdp_binding *b = (*binding);
-    if (b->port==0){
-      (*binding) = b->_next;
-      free(b);
-    }else{
-      binding = &b->_next;
+  while(dead_bindings){
+    struct mdp_binding *b = dead_bindings;
+    dead_bindings = b->_next_dead;
+    free_binding(b);
+  }
+  return 0;
+}
+
+static int flush_batch(struct mdp_binding *b)
+{
+  if (!b->batch_len)
+    return 0;
+  struct iovec iov={
+    .iov_base = b->batch,
+    .iov_len = b->batch_len
+  };
+  DEBUGF(mdprequests, "Sending %u batched frames to %s", b->batch_count, alloca_socket_address(&b->client));
+  b->batch_len = 0;
+  b->batch_count = 0;
+  return mdp_sendmsg(__WHENCE__, &b->client, &iov, 1);
+}
+
+DEFINE_ALARM(mdp_flush_batches);
+void mdp_flush_batches(struct sched_ent *UNUSED(alarm))
+{
+  while(batched_bindings){
+    struct mdp_binding *b = batched_bindings;
+    batched_bindings = b->_next_batch;
+    b->batch_queued = 0;
+    if (!b->dead)
+      flush_batch(b);
+  }
+  free_dead_clients();
+}
+
+/* Queue a packet for a client that accepted batching.  Every packet queued while processing one
+ * event goes out together once the event is done, so a busy client needs far fewer datagrams.
+ */
+static int queue_batched(struct mdp_binding *b, const struct mdp_header *header, const uint8_t *payload, size_t len)
+{
+  if (!b->batch && (b->batch = emalloc(MDP_BATCH_MTU)) == NULL)
+    return -1;
+  if (mdp_batch_append(b->batch, MDP_BATCH_MTU, &b->batch_len, header, payload, len) == -1){
+    if (!b->batch_len)
+      return WHYF("MDP payload of %zu bytes is too large to batch", len);
+    if (flush_batch(b) == -1
+      || mdp_batch_append(b->batch, MDP_BATCH_MTU, &b->batch_len, header, payload, len) == -1)
+      return -1;
+  }
+  b->batch_count++;
+  if (!b->batch_queued){
+    b->batch_queued = 1;
+    b->_next_batch = batched_bindings;
+    batched_bindings = b;
+    struct sched_ent *alarm = &ALARM_STRUCT(mdp_flush_batches);
+    if (!is_scheduled(alarm)){
+      time_ms_t now = gettime_ms();
+      RESCHEDULE(alarm, now, now, now);
     }
   }
-  has_dead_clients=1;
   return 0;
 }
 
+static void mdp_binding_mark_subscribers()
+{
+  unsigned i;
+  for (i=0;i<MDP_BINDING_BUCKETS;i++){
+    struct mdp_binding *b;
+    for (b = port_bindings[i]; b; b = b->_next_port)
+      if (b->subscriber != internal)
+	mark_subscriber_in_use(b->subscriber);
+  }
+}
+
+DEFINE_TRIGGER(subscriber_mark, mdp_binding_mark_subscribers);
+
+// send anything already batched for this client, so an immediate reply can't overtake it
+static void flush_client_batches(const struct socket_address *client)
+{
+  struct mdp_binding *b;
+  for (b = *client_bucket(client); b; b = b->_next_client)
+    if (b->batch_len && !b->dead && cmp_sockaddr(&b->client, client)==0)
+      flush_batch(b);
+}
+
 static int mdp_reply2(struct __sourceloc __whence, const struct socket_address *client, const struct mdp_header *header,
   int flags, const uint8_t *payload, size_t payload_len)
 {
+  flush_client_batches(client);
   struct mdp_header response_header;
   bcopy(header, &response_header, sizeof(response_header));
   response_header.flags = flags;
@@ -352,10 +516,10 @@ static int overlay_mdp_process_bind_request(struct subscriber *subscriber, mdp_p
   }
  
   /* See if binding already exists */
-  struct mdp_binding *b = mdp_bindings;
+  struct mdp_binding *b = *port_bucket(port);
   while(b){
     /* Look for duplicate bindings */
-    if (b->port == port && b->subscriber == subscriber) {
+    if (!b->dead && b->port == port && b->subscriber == subscriber) {
       if (cmp_sockaddr(&b->client, client)==0) {
 	// this client already owns this port binding?
 	INFO("Identical binding exists");
@@ -369,7 +533,7 @@ static int overlay_mdp_process_bind_request(struct subscriber *subscriber, mdp_p
 	return WHY("Port already in use");
       }
     }
-    b=b->_next;
+    b=b->_next_port;
   }
 
   /* Okay, so no binding exists.  Make one, and return success.
@@ -381,9 +545,10 @@ static int overlay_mdp_process_bind_request(struct subscriber *subscriber, mdp_p
   */
   if (!b){
     b = emalloc_zero(sizeof(struct mdp_binding));
-    b->_next = mdp_bindings;
-    mdp_bindings = b;
-  }
+    if (!b)
+      return -1;
+  }else
+    unlink_binding(b);
   /* Okay, record binding and report success */
   b->port=port;
   b->subscriber=subscriber;
@@ -392,6 +557,7 @@ static int overlay_mdp_process_bind_request(struct subscriber *subscriber, mdp_p
   b->client.addrlen = client->addrlen;
   memcpy(&b->client.addr, &client->addr, client->addrlen);
   b->binding_time=gettime_ms();
+  link_binding(b);
   return 0;
 }
 
@@ -485,6 +651,83 @@ static struct overlay_buffer *overlay_mdp_decrypt(struct internal_mdp_header *he
   OUT();
 }
 
+// state carried through a crypto worker thread
+struct mdp_crypto_job{
+  struct crypto_job job;
+  struct overlay_buffer *input;
+  struct overlay_buffer *output;
+  // encrypting a frame for transmission
+  struct overlay_frame *frame;
+  struct __sourceloc whence;
+  // decrypting a received frame
+  struct internal_mdp_header header;
+};
+
+static void decrypt_payload_done(struct crypto_job *j)
+{
+  struct mdp_crypto_job *job = (struct mdp_crypto_job *)j;
+  if (j->result){
+    WHYF("crypto_box_open_easy_afternm() failed (from %s, to %s, len %zu)",
+	 alloca_tohex_sid_t(job->header.source->sid), alloca_tohex_sid_t(job->header.destination->sid), j->in_len);
+  }else{
+    overlay_mdp_decode_header(&job->header, job->output);
+    overlay_saw_mdp_frame(&job->header, job->output);
+  }
+  ob_free(job->input);
+  ob_free(job->output);
+  free(job);
+}
+
+// decrypt on a worker thread, then deliver the frame when it completes
+static int decrypt_payload_async(struct internal_mdp_header *header, struct overlay_buffer *payload)
+{
+  unsigned char *k=keyring_get_nm_bytes(header->destination->identity->box_sk,
+    header->destination->identity->box_pk,
+    &header->source->sid);
+  if (!k)
+    return WHY("I don't have the private key required to decrypt that");
+
+  unsigned char *nonce=ob_get_bytes_ptr(payload, crypto_box_NONCEBYTES);
+  if (!nonce)
+    return WHYF("Expected %d bytes of nonce", crypto_box_NONCEBYTES);
+
+  size_t cipher_len=ob_remaining(payload);
+  if (cipher_len < crypto_box_MACBYTES)
+    return WHYF("Expected at least %d bytes of cipher text", crypto_box_MACBYTES);
+
+  struct mdp_crypto_job *job = emalloc_zero(sizeof(struct mdp_crypto_job));
+  if (!job)
+    return -1;
+  // the received packet buffer won't outlive this call, so take a copy of the cipher text
+  job->input = ob_new();
+  job->output = ob_new();
+  if (!job->input || !job->output
+    || !ob_makespace(job->input, cipher_len)
+    || !ob_makespace(job->output, cipher_len - crypto_box_MACBYTES)){
+    if (job->input)
+      ob_free(job->input);
+    if (job->output)
+      ob_free(job->output);
+    free(job);
+    return -1;
+  }
+  ob_append_bytes(job->input, ob_get_bytes_ptr(payload, cipher_len), cipher_len);
+  ob_limitsize(job->output, cipher_len - crypto_box_MACBYTES);
+
+  job->header = *header;
+  job->job.source = header->source;
+  job->job.destination = header->destination;
+  job->job.open = 1;
+  memcpy(job->job.key, k, sizeof job->job.key);
+  memcpy(job->job.nonce, nonce, sizeof job->job.nonce);
+  job->job.in = ob_ptr(job->input);
+  job->job.in_len = cipher_len;
+  job->job.out = ob_ptr(job->output);
+  job->job.done = decrypt_payload_done;
+  crypto_job_submit(&job->job);
+  return 0;
+}
+
 int overlay_saw_mdp_containing_frame(struct overlay_frame *f)
 {
   IN();
@@ -513,6 +756,9 @@ int overlay_saw_mdp_containing_frame(struct overlay_frame *f)
   mdp.out.dst.sid = (f->destination) ? f->destination->sid : SID_BROADCAST;
   mdp.out.src.sid = f->source->sid;
 
+  if (header.crypt_flags == 0 && crypto_workers_enabled())
+    RETURN(decrypt_payload_async(&header, f->payload));
+
   /* copy crypto flags from frame so that we know if we need to decrypt or verify it */
   struct overlay_buffer *mdp_payload = overlay_mdp_decrypt(&header, f->payload);
   if (mdp_payload==NULL)
@@ -538,10 +784,10 @@ void mdp_init_response(const struct internal_mdp_header *in, struct internal_mdp
 static int send_packet_to_client(
   struct internal_mdp_header *header,
   struct overlay_buffer *payload,
-  int version,
-  struct socket_address *client){
+  struct mdp_binding *binding){
 
-  switch(version){
+  struct socket_address *client = &binding->client;
+  switch(binding->version){
     case 0:
       {
 	overlay_mdp_frame mdp;
@@ -585,6 +831,8 @@ static int send_packet_to_client(
 	size_t len = ob_remaining(payload);
 	const uint8_t *ptr = ob_get_bytes_ptr(payload, len);
 
+	if (binding->flags & MDP_FLAG_BATCH)
+	  return queue_batched(binding, &client_header, ptr, len);
 	return mdp_send2(__WHENCE__, client, &client_header, ptr, len);
       }
   }
@@ -608,31 +856,30 @@ static int overlay_saw_mdp_frame(
 	 alloca_tohex_sid_t_trunc(header->source->sid, 14),
 	 header->source_port, header->destination_port);
 
-  struct mdp_binding *b = mdp_bindings;
+  struct mdp_binding *bucket = *port_bucket(header->destination_port);
+  struct mdp_binding *b;
 
   // first look for an exact subscriber match
-  while(b){
-    if (b->port==header->destination_port && b->subscriber &&
+  for (b = bucket; b; b = b->_next_port){
+    if (!b->dead && b->port==header->destination_port && b->subscriber &&
       ((!header->destination) || b->subscriber == header->destination)
     ){
       /* match */
-      if (send_packet_to_client(header, payload, b->version, &b->client)==0
+      if (send_packet_to_client(header, payload, b)==0
 	&& header->destination
 	&& (b->flags & MDP_FLAG_REUSE)==0){
 	  goto end;
       }
     }
-    b=b->_next;
   }
 
   // then look for ANY bindings
-  while(b){
-    if (b->port==header->destination_port && !b->subscriber){
+  for (b = bucket; b; b = b->_next_port){
+    if (!b->dead && b->port==header->destination_port && !b->subscriber){
       /* match */
-      if (send_packet_to_client(header, payload, b->version, &b->client)==0 && (b->flags & MDP_FLAG_REUSE)==0)
+      if (send_packet_to_client(header, payload, b)==0 && (b->flags & MDP_FLAG_REUSE)==0)
 	goto end;
     }
-    b=b->_next;
   }
 
   // look for a compile time defined internal binding
@@ -689,13 +936,13 @@ static int overlay_mdp_check_binding(struct subscriber *subscriber, mdp_port_t p
     return 0;
 
   /* Check if this client has bound this sid/port */
-  struct mdp_binding *b = mdp_bindings;
+  struct mdp_binding *b = *port_bucket(port);
   while(b){
-    if (b->port == port
+    if (!b->dead && b->port == port
       && (!b->subscriber || b->subscriber == subscriber)
       && cmp_sockaddr(&b->client, client)==0)
       return 0;
-    b=b->_next;
+    b=b->_next_port;
   }
 
   WARNF("No matching binding: addr=%s port=%"PRImdp_port_t,
@@ -738,11 +985,13 @@ static int generate_nonce(uint8_t *nonce, size_t bytes)
   return 0;
 }
 
-static struct overlay_buffer * encrypt_payload(
+// allocate a buffer for the nonce and cipher text, and find the shared secret to encrypt with
+static struct overlay_buffer * prepare_ciphertext(
   struct subscriber *source, 
   struct subscriber *dest, 
-  const unsigned char *buffer,
-  size_t msg_len)
+  size_t msg_len,
+  unsigned char **noncep,
+  unsigned char **kp)
 {
   struct overlay_buffer *ret = ob_new();
   if (ret == NULL)
@@ -753,7 +1002,6 @@ static struct overlay_buffer * encrypt_payload(
     ob_free(ret);
     return NULL;
   }
-  unsigned char *cipher_text = nonce + crypto_box_NONCEBYTES;
 
   if (generate_nonce(nonce, crypto_box_NONCEBYTES)){
     ob_free(ret);
@@ -772,6 +1020,23 @@ static struct overlay_buffer * encrypt_payload(
     WHY("could not compute Curve25519(NxM)");
     return NULL;
   }
+  *noncep = nonce;
+  *kp = k;
+  return ret;
+}
+
+static struct overlay_buffer * encrypt_payload(
+  struct subscriber *source, 
+  struct subscriber *dest, 
+  const unsigned char *buffer,
+  size_t msg_len)
+{
+  unsigned char *nonce, *k;
+  struct overlay_buffer *ret = prepare_ciphertext(source, dest, msg_len, &nonce, &k);
+  if (!ret)
+    return NULL;
+  unsigned char *cipher_text = nonce + crypto_box_NONCEBYTES;
+
   /* Actually authcrypt the payload */
   if (crypto_box_easy_afternm(cipher_text, buffer, msg_len, nonce, k)) {
     ob_free(ret);
@@ -782,6 +1047,57 @@ static struct overlay_buffer * encrypt_payload(
   return ret;
 }
 
+static void encrypt_payload_done(struct crypto_job *j)
+{
+  struct mdp_crypto_job *job = (struct mdp_crypto_job *)j;
+  ob_free(job->input);
+  overlay_queue_release(job->frame->queue);
+  if (j->result){
+    WHY("crypto_box_easy_afternm() failed");
+    ob_free(job->output);
+    op_free(job->frame);
+  }else{
+    job->frame->payload = job->output;
+    if (_overlay_payload_enqueue(job->whence, job->frame))
+      op_free(job->frame);
+  }
+  free(job);
+}
+
+// encrypt on a worker thread, then queue the frame when it completes.
+// The frame's place in the queue is reserved now, so a congested queue is still reported to the caller.
+static int encrypt_payload_async(struct __sourceloc whence, struct overlay_frame *frame, struct overlay_buffer *plaintext)
+{
+  size_t msg_len = ob_position(plaintext);
+  unsigned char *nonce, *k;
+  if (overlay_queue_reserve(frame->queue))
+    return -1;
+  struct mdp_crypto_job *job = emalloc_zero(sizeof(struct mdp_crypto_job));
+  if (!job){
+    overlay_queue_release(frame->queue);
+    return -1;
+  }
+  job->output = prepare_ciphertext(frame->source, frame->destination, msg_len, &nonce, &k);
+  if (!job->output){
+    overlay_queue_release(frame->queue);
+    free(job);
+    return -1;
+  }
+  job->input = plaintext;
+  job->frame = frame;
+  job->whence = whence;
+  job->job.source = frame->source;
+  job->job.destination = frame->destination;
+  memcpy(job->job.key, k, sizeof job->job.key);
+  memcpy(job->job.nonce, nonce, sizeof job->job.nonce);
+  job->job.in = ob_ptr(plaintext);
+  job->job.in_len = msg_len;
+  job->job.out = nonce + crypto_box_NONCEBYTES;
+  job->job.done = encrypt_payload_done;
+  crypto_job_submit(&job->job);
+  return 0;
+}
+
 // encrypt or sign the plaintext, then queue the frame for transmission.
 // Note, the position of the payload MUST be at the start of the data, the limit MUST be used to specify the end
 int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *header, struct overlay_buffer *payload)
@@ -870,6 +1186,15 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
     }
   
     /* crypted and signed (using CryptoBox authcryption primitive) */
+    if (crypto_workers_enabled()){
+      // the frame will be queued once the worker has finished with it
+      if (encrypt_payload_async(whence, frame, plaintext)){
+	ob_free(plaintext);
+	op_free(frame);
+	return -1;
+      }
+      return 0;
+    }
     frame->payload = encrypt_payload(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext));
     if (!frame->payload){
       ob_free(plaintext);
@@ -1102,12 +1427,12 @@ static void send_route_changed(struct subscriber *subscriber, int UNUSED(prior_r
   header.local.port = MDP_ROUTE_TABLE;
   header.remote.port = MDP_ROUTE_TABLE;
 
-  struct mdp_binding *b = mdp_bindings;
+  struct mdp_binding *b = *port_bucket(MDP_ROUTE_TABLE);
   while(b){
-    if (b->port == MDP_ROUTE_TABLE && b->subscriber == internal){
+    if (!b->dead && b->port == MDP_ROUTE_TABLE && b->subscriber == internal){
       send_route(subscriber, &b->client, &header);
     }
-    b=b->_next;
+    b=b->_next_port;
   }
 }
 DEFINE_TRIGGER(link_change, send_route_changed);
@@ -1209,11 +1534,18 @@ static int mdp_process_identity_request(struct socket_address *client, struct md
 	  return WHY("Unknown request type");
 	}
 	unsigned unlock_count=0;
+	const char *pins[16];
+	unsigned pinc=0;
 	while(1){
 	  const char *pin = ob_get_str_ptr(payload);
+	  if (pin)
+	    pins[pinc++] = pin;
+	  if (pinc && (!pin || pinc == NELS(pins))){
+	    unlock_count += keyring_enter_pins(keyring, pinc, pins);
+	    pinc=0;
+	  }
 	  if (!pin)
 	    break;
-	  unlock_count += keyring_enter_pin(keyring, pin);
 	}
 	if (unlock_count && directory_service)
 	  directory_registration();
@@ -1388,11 +1720,11 @@ static mdp_port_t get_next_port(){
     next_port_binding++;
 
   // make sure there are *no* bindings for this port on any SID.
-  struct mdp_binding *b = mdp_bindings;
+  struct mdp_binding *b = *port_bucket(next_port_binding);
   while(b){
     if (b->port == next_port_binding)
       goto again;
-    b = b->_next;
+    b = b->_next_port;
   }
   return next_port_binding;
 }
@@ -1434,7 +1766,6 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
       }
   }
 
-  struct mdp_binding **pclient_binding=NULL;
   struct mdp_binding *client_binding=NULL;
   struct mdp_binding *conflicting_binding=NULL;
 
@@ -1443,22 +1774,20 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
     header->local.port=get_next_port();
   }else{
     // find existing matching or conflicting bindings
-    struct mdp_binding **binding = &mdp_bindings;
-    while(*binding){
-      struct mdp_binding *b = (*binding);
-      if (b->port == header->local.port
+    struct mdp_binding *b = *port_bucket(header->local.port);
+    while(b){
+      if (!b->dead && b->port == header->local.port
 	&& b->subscriber == internal_header.source){
 
 	if (cmp_sockaddr(&b->client, client)==0){
 	  client_binding = b;
-	  pclient_binding = binding;
 	  break;
 	}
 
 	// any conflicting binding will do;
 	conflicting_binding = b;
       }
-      binding = &b->_next;
+      b = b->_next_port;
     }
   }
   
@@ -1498,12 +1827,14 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
       client_binding->client.addrlen = client->addrlen;
       client_binding->binding_time=gettime_ms();
       client_binding->version=1;
-
-      client_binding->_next = mdp_bindings;
-      mdp_bindings = client_binding;
+      link_binding(client_binding);
     }
+    // frames already queued for this client must not be sent as a batch it no longer expects
+    if ((client_binding->flags ^ header->flags) & MDP_FLAG_BATCH)
+      flush_batch(client_binding);
+    client_binding->flags = (client_binding->flags & ~MDP_FLAG_BATCH) | (header->flags & MDP_FLAG_BATCH);
     // tell the client that they (still?) have this binding (with flags & MDP_FLAG_BIND still set)
-    mdp_reply2(__WHENCE__, client, header, MDP_FLAG_BIND, NULL, 0);
+    mdp_reply2(__WHENCE__, client, header, MDP_FLAG_BIND | (client_binding->flags & MDP_FLAG_BATCH), NULL, 0);
   }
   
   if (is_sid_t_any(header->remote.sid)){
@@ -1590,8 +1921,9 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
 	   client_binding->subscriber?alloca_tohex_sid_t(client_binding->subscriber->sid):"All",
 	   client_binding->port,
 	   alloca_socket_address(client));
-    *pclient_binding = client_binding->_next;
-    free(client_binding);
+    // if a reply to this client failed, the binding is already waiting to be free'd
+    if (!client_binding->dead)
+      free_binding(client_binding);
   }
 }
 
@@ -1608,12 +1940,16 @@ static int mdp_send2(struct __sourceloc __whence, const struct socket_address *c
       .iov_len = payload_len
     }
   };
-  
+  return mdp_sendmsg(__whence, client, iov, 2);
+}
+
+static int mdp_sendmsg(struct __sourceloc __whence, const struct socket_address *client, struct iovec *iov, int iovcnt)
+{
   struct msghdr hdr={
     .msg_name=(struct sockaddr*)&client->addr,
     .msg_namelen=client->addrlen,
     .msg_iov=iov,
-    .msg_iovlen=2,
+    .msg_iovlen=iovcnt,
   };
   
   int fd=-1;
@@ -1644,28 +1980,22 @@ static int mdp_send2(struct __sourceloc __whence, const struct socket_address *c
 static void mdp_poll2(struct sched_ent *alarm)
 {
   if (alarm->poll.revents & POLLIN) {
-    uint8_t payload[1400];
+    uint8_t buffer[MDP_BATCH_MTU];
     struct mdp_header header;
     struct socket_address client;
     bzero(&client, sizeof client);
     client.addrlen=sizeof(client.addr);
     
-    struct iovec iov[]={
-      {
-	.iov_base = (void *)&header,
-	.iov_len = sizeof header
-      },
-      {
-	.iov_base = (void *)payload,
-	.iov_len = sizeof payload
-      }
+    struct iovec iov={
+      .iov_base = (void *)buffer,
+      .iov_len = sizeof buffer
     };
     
     struct msghdr hdr={
       .msg_name=&client.addr,
       .msg_namelen=sizeof(client.store),
-      .msg_iov=iov,
-      .msg_iovlen=2,
+      .msg_iov=&iov,
+      .msg_iovlen=1,
     };
     
     ssize_t len = recvmsg(alarm->poll.fd, &hdr, 0);
@@ -1679,14 +2009,37 @@ static void mdp_poll2(struct sched_ent *alarm)
     }
     
     client.addrlen = hdr.msg_namelen;
-    size_t payload_len = (size_t)(len - sizeof header);
-    
-    struct overlay_buffer *buff = ob_static(payload, payload_len);
-    ob_limitsize(buff, payload_len);
+    bcopy(buffer, &header, sizeof header);
     
-    mdp_process_packet(&client, &header, buff);
+    // A bind request asking for batching is a bare header with MDP_FLAG_BATCH set, which is a
+    // single frame.  A batched datagram always has a length after its first header.
+    if (!(header.flags & MDP_FLAG_BATCH) || (size_t)len == sizeof header){
+      size_t payload_len = (size_t)(len - sizeof header);
+      if (payload_len > 1400)
+	payload_len = 1400;
+      struct overlay_buffer *buff = ob_static(&buffer[sizeof header], payload_len);
+      ob_limitsize(buff, payload_len);
+      mdp_process_packet(&client, &header, buff);
+      ob_free(buff);
+      return;
+    }
     
-    ob_free(buff);
+    // several frames from a client that asked for batching
+    size_t offset = 0;
+    const uint8_t *payload;
+    size_t payload_len;
+    unsigned count = 0;
+    int r;
+    while((r = mdp_batch_next(buffer, len, &offset, &header, &payload, &payload_len)) == 1){
+      struct overlay_buffer *buff = ob_static((uint8_t *)payload, payload_len);
+      ob_limitsize(buff, payload_len);
+      mdp_process_packet(&client, &header, buff);
+      ob_free(buff);
+      count++;
+    }
+    DEBUGF(mdprequests, "Received %u batched frames from %s", count, alloca_socket_address(&client));
+    if (r == -1)
+      WHYF("Malformed batch of MDP frames from %s", alloca_socket_address(&client));
   }
 }
 
@@ -57,6 +57,8 @@ struct overlay_frame {
   uint8_t ttl;
   // Which QOS queue?
   uint8_t queue;
+  // Which fair queueing flow within that queue?
+  uint8_t flow;
   // How many times should we retransmit?
   int8_t resend;
   
@@ -66,6 +68,10 @@ struct overlay_frame {
   
   // when should we send it?
   time_ms_t delay_until;
+  // cached earliest time any destination could take this frame, 0 if it must be re-examined
+  time_ms_t ready_at;
+  // order of arrival in the queue, so a frame parked until ready_at can be put back in its place
+  uint32_t queue_serial;
   // where should we send it?
   struct packet_destination destinations[MAX_PACKET_DESTINATIONS];
   int destination_count;
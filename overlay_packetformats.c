@@ -383,6 +383,8 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
   bzero(&f,sizeof f);
   
   time_ms_t now = gettime_ms();
+  // frames are parsed as slices of the received datagram; only forwarded frames are copied
+  size_t copied_before = ob_bytes_copied();
   struct overlay_buffer *b = ob_static(packet, len);
   ob_limitsize(b, len);
   
@@ -479,6 +481,7 @@ end:
   send_please_explain(&context, my_subscriber, context.sender);
   
   ob_free(b);
+  DEBUGF(overlayframes, "Copied %zu of %zu received bytes", ob_bytes_copied() - copied_before, len);
   
   RETURN(ret);
   OUT();
@@ -27,16 +27,57 @@
 #include "str.h"
 #include "strbuf.h"
 #include "route_link.h"
+#include "commandline.h"
+
+#define OVERLAY_QUEUE_LENGTH 100
+
+/* Frames within a queue are grouped into flows by source and next hop, which take turns to send
+ using deficit round robin. A queue never holds more than OVERLAY_QUEUE_LENGTH frames, so there is
+ always a free flow for a new source and next hop.
+ */
+#define OVERLAY_FLOWS 128
+#define OVERLAY_FLOW_BUCKETS 64
+#define OVERLAY_FLOW_NONE 0xFF
+
+/* A frame that no destination will take until some time in the future (eg, waiting for an ack)
+ is parked out of the queue's list in a heap ordered by that time, so building a packet only
+ walks the frames that might go into it.
+ */
+struct parked_frame {
+  time_ms_t until;
+  struct overlay_frame *frame;
+};
+
+struct overlay_flow {
+  /* only compared, never followed, as the next hop may be forgotten while frames are queued */
+  const struct subscriber *source;
+  const struct subscriber *next_hop;
+  uint8_t bucket;
+  uint8_t next; /* next flow in the same bucket, or on the free list */
+  int32_t deficit; /* bytes this flow may still send in the current round */
+  int32_t quantum; /* bytes added to deficit per round */
+  int backlog; /* # frames in queue */
+  size_t backlog_bytes;
+  uint8_t deferred; /* was a frame held back by the deficit in this round? */
+  uint8_t retry; /* was a frame held back in the previous round, so worth looking at again? */
+};
 
 typedef struct overlay_txqueue {
   struct overlay_frame *first;
   struct overlay_frame *last;
   int length; /* # frames in queue */
+  int reserved; /* # frames being encrypted by a crypto worker, that will be queued when done */
   int maxLength; /* max # frames in queue before we consider ourselves congested */
   int small_packet_grace_interval;
   /* Latency target in ms for this traffic class.
    Frames older than the latency target will get dropped. */
   int latencyTarget;
+  struct overlay_flow flows[OVERLAY_FLOWS];
+  uint8_t flow_buckets[OVERLAY_FLOW_BUCKETS];
+  uint8_t free_flow;
+  uint32_t serial; /* queue_serial of the next frame */
+  struct parked_frame parked[OVERLAY_QUEUE_LENGTH];
+  unsigned parked_count;
 } overlay_txqueue;
 
 overlay_txqueue overlay_tx[OQ_MAX];
@@ -64,9 +105,14 @@ int overlay_queue_init(){
   /* Set default congestion levels for queues */
   int i;
   for(i=0;i<OQ_MAX;i++) {
-    overlay_tx[i].maxLength=100;
+    overlay_tx[i].maxLength=OVERLAY_QUEUE_LENGTH;
     overlay_tx[i].latencyTarget=0; // no QOS time limit by default, depend on per destination timeouts
     overlay_tx[i].small_packet_grace_interval = 5;
+    memset(overlay_tx[i].flow_buckets, OVERLAY_FLOW_NONE, sizeof overlay_tx[i].flow_buckets);
+    unsigned j;
+    for (j = 0; j < OVERLAY_FLOWS; j++)
+      overlay_tx[i].flows[j].next = j + 1 < OVERLAY_FLOWS ? j + 1 : OVERLAY_FLOW_NONE;
+    overlay_tx[i].free_flow = 0;
   }
   /* expire voice/video call packets much sooner, as they just aren't any use if late */
   overlay_tx[OQ_ISOCHRONOUS_VOICE].maxLength=20;
@@ -78,9 +124,110 @@ int overlay_queue_init(){
   return 0;
 }
 
-/* remove and free a payload from the queue */
-static struct overlay_frame *
-overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
+static uint8_t overlay_flow_bucket(const struct subscriber *source, const struct subscriber *next_hop)
+{
+  // SIDs are public keys, so any of their bytes are evenly distributed
+  uint32_t hash = 0, h;
+  if (source)
+    memcpy(&hash, source->sid.binary, sizeof hash);
+  if (next_hop){
+    memcpy(&h, next_hop->sid.binary, sizeof h);
+    hash = hash * 31 + h;
+  }
+  return hash % OVERLAY_FLOW_BUCKETS;
+}
+
+// bytes given to a flow per round, mdp.queue.weight.<SID> of its source or next hop times the quantum
+static int32_t overlay_flow_quantum(const struct subscriber *source, const struct subscriber *next_hop)
+{
+  uint16_t weight = source == my_subscriber ? config.mdp.queue.local_weight : 1;
+  int i = -1;
+  if (source)
+    i = config_flow_weight_list__get(&config.mdp.queue.weight, &source->sid);
+  if (i == -1 && next_hop)
+    i = config_flow_weight_list__get(&config.mdp.queue.weight, &next_hop->sid);
+  if (i != -1)
+    weight = config.mdp.queue.weight.av[i].value;
+  int64_t quantum = (int64_t)config.mdp.queue.quantum * weight;
+  return quantum > INT32_MAX ? INT32_MAX : (int32_t)quantum;
+}
+
+static void overlay_flow_add(overlay_txqueue *queue, struct overlay_frame *frame)
+{
+  struct subscriber *next_hop = frame->destination;
+  if (next_hop && (next_hop->reachable&REACHABLE)==REACHABLE_INDIRECT && next_hop->next_hop)
+    next_hop = next_hop->next_hop;
+  uint8_t bucket = overlay_flow_bucket(frame->source, next_hop);
+  uint8_t i;
+  for (i = queue->flow_buckets[bucket]; i != OVERLAY_FLOW_NONE; i = queue->flows[i].next)
+    if (queue->flows[i].source == frame->source && queue->flows[i].next_hop == next_hop)
+      break;
+  if (i == OVERLAY_FLOW_NONE){
+    i = queue->free_flow;
+    assert(i != OVERLAY_FLOW_NONE);
+    struct overlay_flow *flow = &queue->flows[i];
+    queue->free_flow = flow->next;
+    flow->next = queue->flow_buckets[bucket];
+    queue->flow_buckets[bucket] = i;
+    flow->source = frame->source;
+    flow->next_hop = next_hop;
+    flow->bucket = bucket;
+    // a newly active flow starts with one round's share
+    flow->quantum = overlay_flow_quantum(frame->source, next_hop);
+    flow->deficit = flow->quantum;
+    flow->backlog = 0;
+    flow->backlog_bytes = 0;
+    flow->deferred = flow->retry = 0;
+  }
+  frame->flow = i;
+  queue->flows[i].backlog++;
+  queue->flows[i].backlog_bytes += ob_position(frame->payload);
+}
+
+static void overlay_flow_remove(overlay_txqueue *queue, struct overlay_frame *frame)
+{
+  struct overlay_flow *flow = &queue->flows[frame->flow];
+  assert(flow->backlog > 0);
+  flow->backlog_bytes -= ob_position(frame->payload);
+  if (--flow->backlog > 0)
+    return;
+  // the flow is idle, move it to the free list
+  uint8_t *p = &queue->flow_buckets[flow->bucket];
+  while (*p != frame->flow)
+    p = &queue->flows[*p].next;
+  *p = flow->next;
+  flow->next = queue->free_flow;
+  queue->free_flow = frame->flow;
+}
+
+// has this frame's flow used up its share of the current round?
+static int overlay_flow_allowed(overlay_txqueue *queue, struct overlay_frame *frame)
+{
+  return config.mdp.queue.quantum == 0
+      || queue->flows[frame->flow].deficit >= (int32_t)ob_position(frame->payload);
+}
+
+// start a new round, giving every flow with frames waiting another share
+static void overlay_flow_replenish(overlay_txqueue *queue)
+{
+  unsigned i;
+  for (i = 0; i < OVERLAY_FLOWS; i++){
+    struct overlay_flow *flow = &queue->flows[i];
+    if (flow->backlog == 0)
+      continue;
+    int64_t deficit = (int64_t)flow->deficit + flow->quantum;
+    // a flow that couldn't send anyway (eg, every frame is waiting for an ack) must not bank credit
+    if (!flow->deferred && deficit > flow->quantum)
+      deficit = flow->quantum;
+    flow->deficit = deficit > INT32_MAX ? INT32_MAX : (int32_t)deficit;
+    flow->retry = flow->deferred;
+    flow->deferred = 0;
+    DEBUGF(overlayframes, "Queue #%d flow %u backlog %d frames, %zu bytes, deficit %d",
+	   (int)(queue - overlay_tx), i, flow->backlog, flow->backlog_bytes, flow->deficit);
+  }
+}
+
+static void overlay_queue_unlink(overlay_txqueue *queue, struct overlay_frame *frame){
   struct overlay_frame *prev = frame->prev;
   struct overlay_frame *next = frame->next;
   if (prev)
@@ -92,8 +239,17 @@ overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
     next->prev = prev;
   else if(frame == queue->last)
     queue->last = prev;
+  frame->prev = frame->next = NULL;
+}
+
+/* remove and free a payload from the queue */
+static struct overlay_frame *
+overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
+  struct overlay_frame *next = frame->next;
+  overlay_queue_unlink(queue, frame);
   
   queue->length--;
+  overlay_flow_remove(queue, frame);
   
   while(frame->destination_count>0)
     release_destination_ref(frame->destinations[--frame->destination_count].destination);
@@ -103,6 +259,122 @@ overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
   return next;
 }
 
+static void parked_sift_up(struct parked_frame *heap, unsigned i)
+{
+  while (i > 0){
+    unsigned parent = (i - 1) / 2;
+    if (heap[parent].until <= heap[i].until)
+      break;
+    struct parked_frame tmp = heap[parent];
+    heap[parent] = heap[i];
+    heap[i] = tmp;
+    i = parent;
+  }
+}
+
+static void parked_sift_down(struct parked_frame *heap, unsigned count, unsigned i)
+{
+  while (1){
+    unsigned least = i;
+    unsigned child = i * 2 + 1;
+    if (child < count && heap[child].until < heap[least].until)
+      least = child;
+    if (child + 1 < count && heap[child + 1].until < heap[least].until)
+      least = child + 1;
+    if (least == i)
+      break;
+    struct parked_frame tmp = heap[least];
+    heap[least] = heap[i];
+    heap[i] = tmp;
+    i = least;
+  }
+}
+
+// take a frame out of the list until its ready time
+static void overlay_queue_park(overlay_txqueue *queue, struct overlay_frame *frame)
+{
+  assert(queue->parked_count < OVERLAY_QUEUE_LENGTH);
+  time_ms_t until = frame->ready_at;
+  // wake in time to drop frames that have missed the latency target
+  if (queue->latencyTarget != 0 && frame->enqueued_at + queue->latencyTarget + 1 < until)
+    until = frame->enqueued_at + queue->latencyTarget + 1;
+  overlay_queue_unlink(queue, frame);
+  unsigned i = queue->parked_count++;
+  queue->parked[i].until = until;
+  queue->parked[i].frame = frame;
+  parked_sift_up(queue->parked, i);
+  overlay_queue_schedule_next(queue->parked[0].until);
+}
+
+static int frame_serial_cmp(const void *a, const void *b)
+{
+  const struct overlay_frame *fa = *(const struct overlay_frame **)a;
+  const struct overlay_frame *fb = *(const struct overlay_frame **)b;
+  int32_t delta = fa->queue_serial - fb->queue_serial;
+  return delta < 0 ? -1 : delta > 0 ? 1 : 0;
+}
+
+// merge parked frames back into the list, in the order they were first queued
+static void overlay_queue_relink(overlay_txqueue *queue, struct overlay_frame **frames, unsigned count)
+{
+  qsort(frames, count, sizeof *frames, frame_serial_cmp);
+  struct overlay_frame *next = queue->first;
+  unsigned i;
+  for (i = 0; i < count; i++){
+    struct overlay_frame *frame = frames[i];
+    while (next && (int32_t)(next->queue_serial - frame->queue_serial) < 0)
+      next = next->next;
+    frame->next = next;
+    frame->prev = next ? next->prev : queue->last;
+    if (frame->prev)
+      frame->prev->next = frame;
+    else
+      queue->first = frame;
+    if (next)
+      next->prev = frame;
+    else
+      queue->last = frame;
+  }
+}
+
+// return every parked frame whose time has come to the list
+static void overlay_queue_unpark_due(overlay_txqueue *queue, time_ms_t now)
+{
+  struct overlay_frame *frames[OVERLAY_QUEUE_LENGTH];
+  unsigned count = 0;
+  while (queue->parked_count && queue->parked[0].until <= now){
+    frames[count++] = queue->parked[0].frame;
+    queue->parked[0] = queue->parked[--queue->parked_count];
+    parked_sift_down(queue->parked, queue->parked_count, 0);
+  }
+  if (count)
+    overlay_queue_relink(queue, frames, count);
+  if (queue->parked_count)
+    overlay_queue_schedule_next(queue->parked[0].until);
+}
+
+// return the parked frames that match to the list, or all of them if match is NULL
+static void overlay_queue_unpark(overlay_txqueue *queue, int (*match)(struct overlay_frame *, void *), void *context)
+{
+  struct overlay_frame *frames[OVERLAY_QUEUE_LENGTH];
+  unsigned count = 0, kept = 0, i;
+  for (i = 0; i < queue->parked_count; i++){
+    struct overlay_frame *frame = queue->parked[i].frame;
+    if (!match || match(frame, context)){
+      // make sure the frame is examined again
+      frame->ready_at = 0;
+      frames[count++] = frame;
+    }else
+      queue->parked[kept++] = queue->parked[i];
+  }
+  if (!count)
+    return;
+  queue->parked_count = kept;
+  for (i = kept / 2; i-- > 0; )
+    parked_sift_down(queue->parked, kept, i);
+  overlay_queue_relink(queue, frames, count);
+}
+
 #if 0 // unused
 static int
 overlay_queue_dump(overlay_txqueue *q)
@@ -141,7 +413,22 @@ overlay_queue_dump(overlay_txqueue *q)
 int overlay_queue_remaining(int queue){
   if (queue<0 || queue>=OQ_MAX)
     return -1;
-  return overlay_tx[queue].maxLength - overlay_tx[queue].length;
+  return overlay_tx[queue].maxLength - overlay_tx[queue].length - overlay_tx[queue].reserved;
+}
+
+// hold a place in the queue for a frame that will be enqueued later
+int overlay_queue_reserve(int queue){
+  assert(queue >= 0 && queue < OQ_MAX);
+  if (overlay_queue_remaining(queue) <= 0)
+    return WHYF("Queue #%d congested (size = %d)",queue,overlay_tx[queue].maxLength);
+  overlay_tx[queue].reserved++;
+  return 0;
+}
+
+void overlay_queue_release(int queue){
+  assert(queue >= 0 && queue < OQ_MAX);
+  assert(overlay_tx[queue].reserved > 0);
+  overlay_tx[queue].reserved--;
 }
 
 int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *p)
@@ -167,7 +454,7 @@ int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *
   if (ob_position(p->payload) >= MDP_OVERLAY_MTU)
     FATALF("Queued packet len %u is too big", ob_position(p->payload));
 
-  if (queue->length>=queue->maxLength) 
+  if (queue->length + queue->reserved >= queue->maxLength)
     return WHYF("Queue #%d congested (size = %d)",p->queue,queue->maxLength);
     
   // it should be safe to try sending all packets with an mdp sequence
@@ -216,9 +503,11 @@ int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *
   p->next=NULL;
   p->enqueued_at=gettime_ms();
   p->mdp_sequence = -1;
+  p->queue_serial = queue->serial++;
   queue->last=p;
   if (!queue->first) queue->first=p;
   queue->length++;
+  overlay_flow_add(queue, p);
   if (p->queue==OQ_ISOCHRONOUS_VOICE)
     rhizome_saw_voice_traffic();
   
@@ -284,6 +573,7 @@ void frame_remove_destination(struct overlay_frame *frame, int i){
 	);
   release_destination_ref(frame->destinations[i].destination);
   frame->destination_count --;
+  frame->ready_at = 0;
   if (i<frame->destination_count)
     frame->destinations[i]=frame->destinations[frame->destination_count];
 }
@@ -293,6 +583,7 @@ void frame_add_destination(struct overlay_frame *frame, struct subscriber *next_
     return;
   
   unsigned i = frame->destination_count++;
+  frame->ready_at = 0;
   frame->destinations[i].destination=add_destination_ref(dest);
   frame->destinations[i].next_hop = next_hop;
   frame->destinations[i].sent_sequence=-1;
@@ -308,19 +599,31 @@ overlay_calc_queue_time(struct overlay_frame *frame)
 {
   
   time_ms_t next_allowed_packet=0;
+  frame->ready_at = 0;
   // check all interfaces
   if (frame->destination_count>0){
     int i;
+    // earliest time that any destination will accept this frame again, ignoring transfer limits
+    time_ms_t ready_at=TIME_MS_NEVER_WILL;
     for(i=0;i<frame->destination_count;i++)
     {
-      if (radio_link_is_busy(frame->destinations[i].destination->interface))
+      if (radio_link_is_busy(frame->destinations[i].destination->interface)){
+	ready_at=0;
 	continue;
+      }
       time_ms_t next_packet = limit_next_allowed(&frame->destinations[i].destination->transfer_limit);
+      time_ms_t delay_until = 0;
       if (frame->destinations[i].transmit_time){
-	time_ms_t delay_until = frame->destinations[i].transmit_time + frame->destinations[i].destination->resend_delay;
+	delay_until = frame->destinations[i].transmit_time + frame->destinations[i].destination->resend_delay;
 	if (next_packet < delay_until)
 	  next_packet = delay_until;
+	// wake up in time to drop this destination when it expires
+	time_ms_t expires = frame->enqueued_at + frame->destinations[i].destination->ifconfig.transmit_timeout_ms;
+	if (expires < delay_until)
+	  delay_until = expires;
       }
+      if (delay_until < ready_at)
+	ready_at = delay_until;
       if (next_allowed_packet==0||next_packet < next_allowed_packet)
 	next_allowed_packet = next_packet;
     }
@@ -328,6 +631,7 @@ overlay_calc_queue_time(struct overlay_frame *frame)
     if (next_allowed_packet==0){
       return 0;
     }
+    frame->ready_at = ready_at < frame->delay_until ? frame->delay_until : ready_at;
   }else{
     if (!frame->destination){
       return 0;
@@ -348,12 +652,22 @@ overlay_calc_queue_time(struct overlay_frame *frame)
   return 0;
 }
 
+/* one pass over the queue, setting *deferred if any frame was held back to let other flows go first.
+ After the first round, only frames of flows that were held back in the previous round are examined.
+ */
 static void
-overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now, strbuf debug){
+overlay_stuff_round(struct outgoing_packet *packet, overlay_txqueue *queue, int round, time_ms_t now, strbuf debug, int *deferred){
   struct overlay_frame *frame = queue->first;
+  int sent;
   
   // TODO stop when the packet is nearly full?
   while(frame){
+    if (round && !queue->flows[frame->flow].retry){
+      frame = frame->next;
+      continue;
+    }
+    sent = 0;
+    
     if (queue->latencyTarget!=0 && frame->enqueued_at + queue->latencyTarget < now){
       DEBUGF(ack,"Dropping frame (%p) type %x (length %zu) for %s due to expiry timeout", 
 	     frame, frame->type, frame->payload->checkpointLength,
@@ -382,6 +696,14 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
     if (!frame->manual_destinations)
       link_add_destinations(frame);
     
+    // park payloads that every destination has recently been sent, without examining them again
+    if (frame->ready_at > now){
+      struct overlay_frame *next = frame->next;
+      overlay_queue_park(queue, frame);
+      frame = next;
+      continue;
+    }
+    
     if(frame->mdp_sequence != -1 && ((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
       // too late, we've sent too many packets for the next hop to correctly de-duplicate
       DEBUGF(overlayframes, "Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
@@ -391,6 +713,7 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
     }
     
     int destination_index=-1;
+    int flow_allowed = overlay_flow_allowed(queue, frame);
     {
       int i;
       for (i=frame->destination_count -1;i>=0;i--){
@@ -433,6 +756,11 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
 	  
 	  // is this packet going our way?
 	  if (dest==packet->destination){
+	    if (!flow_allowed){
+	      *deferred=1;
+	      queue->flows[frame->flow].deferred=1;
+	      break;
+	    }
 	    destination_index=i;
 	    break;
 	  }
@@ -444,6 +772,13 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
 	  // can we send a packet to this destination now?
 	  if (limit_is_allowed(&dest->transfer_limit))
 	    continue;
+	  
+	  // let other flows in this queue go first
+	  if (!flow_allowed){
+	    *deferred=1;
+	    queue->flows[frame->flow].deferred=1;
+	    break;
+	  }
       
 	  // send a packet to this destination
 	  if (frame->source_full)
@@ -496,6 +831,8 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
     }
     
     frame->transmit_count++;
+    sent = 1;
+    queue->flows[frame->flow].deficit -= ob_position(frame->payload);
     
     {
       struct packet_destination *dest = &frame->destinations[destination_index];
@@ -524,8 +861,36 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
     
   skip:
     // if we can't send the payload now, check when we should try next
-    overlay_calc_queue_time(frame);
-    frame = frame->next;
+    // (nothing has changed since the first round for a frame that still wasn't sent)
+    if (round == 0 || sent)
+      overlay_calc_queue_time(frame);
+    {
+      struct overlay_frame *next = frame->next;
+      if (frame->ready_at > now)
+	overlay_queue_park(queue, frame);
+      frame = next;
+    }
+  }
+}
+
+static void
+overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now, strbuf debug){
+  overlay_queue_unpark_due(queue, now);
+  if (!queue->first)
+    return;
+  unsigned i;
+  for (i = 0; i < OVERLAY_FLOWS; i++)
+    queue->flows[i].deferred = 0;
+  // a round gives every waiting flow at least one more frame, as long as the quantum is at least an MTU
+  int round;
+  for (round = 0; round < 4; round++){
+    int deferred = 0;
+    overlay_stuff_round(packet, queue, round, now, debug, &deferred);
+    if (!deferred)
+      break;
+    if (packet->buffer && ob_remaining(packet->buffer) == 0)
+      break;
+    overlay_flow_replenish(queue);
   }
 }
 
@@ -590,52 +955,147 @@ int overlay_send_tick_packet(struct network_destination *destination)
   return 0;
 }
 
+static void overlay_frame_mark_subscribers(struct overlay_frame *frame)
+{
+  int j;
+  mark_subscriber_in_use(frame->source);
+  mark_subscriber_in_use(frame->destination);
+  mark_subscriber_in_use(frame->next_hop);
+  for (j=0;j<frame->destination_count;j++)
+    mark_subscriber_in_use(frame->destinations[j].next_hop);
+}
+
+static void overlay_queue_mark_subscribers()
+{
+  int i;
+  unsigned j;
+  for (i=0;i<OQ_MAX;i++){
+    struct overlay_frame *frame;
+    for (frame = overlay_tx[i].first; frame; frame = frame->next)
+      overlay_frame_mark_subscribers(frame);
+    for (j=0;j<overlay_tx[i].parked_count;j++)
+      overlay_frame_mark_subscribers(overlay_tx[i].parked[j].frame);
+  }
+}
+
+DEFINE_TRIGGER(subscriber_mark, overlay_queue_mark_subscribers);
+
+// routes or interfaces have changed, so every parked frame must be examined again
+static void overlay_queue_unpark_all()
+{
+  int i;
+  for (i=0;i<OQ_MAX;i++)
+    overlay_queue_unpark(&overlay_tx[i], NULL, NULL);
+  overlay_queue_schedule_next(gettime_ms());
+}
+
+static void overlay_queue_link_change(struct subscriber *UNUSED(subscriber), int UNUSED(prior_reachable))
+{
+  overlay_queue_unpark_all();
+}
+
+DEFINE_TRIGGER(link_change, overlay_queue_link_change);
+
+static void overlay_queue_iupdown(struct overlay_interface *UNUSED(interface))
+{
+  overlay_queue_unpark_all();
+}
+
+DEFINE_TRIGGER(iupdown, overlay_queue_iupdown);
+
+struct queue_ack {
+  struct subscriber *neighbour;
+  struct network_destination *destination;
+  uint32_t ack_mask;
+  int ack_seq;
+  time_ms_t now;
+};
+
+// find the frame's destination that an ack refers to, return 1 if the frame was acked there,
+// -1 if it should be retransmitted now, or 0
+static int overlay_frame_ack_state(struct overlay_frame *frame, const struct queue_ack *ack, int *index)
+{
+  int j;
+  for (j=frame->destination_count -1;j>=0;j--)
+    if (frame->destinations[j].destination==ack->destination)
+      break;
+  *index = j;
+  if (j<0)
+    return 0;
+  int frame_seq = frame->destinations[j].sent_sequence;
+  if (frame_seq <0 || (frame->destinations[j].next_hop != ack->neighbour && frame->destination))
+    return 0;
+  int seq_delta = (ack->ack_seq - frame_seq)&0xFF;
+  if (seq_delta==0 || (seq_delta <= 32 && ack->ack_mask&((uint32_t)1<<(seq_delta-1))))
+    return 1;
+  if (seq_delta < 128 && frame->destination && frame->delay_until>ack->now)
+    return -1;
+  return 0;
+}
+
+static int frame_match_ack(struct overlay_frame *frame, void *context)
+{
+  int j;
+  return overlay_frame_ack_state(frame, context, &j) != 0;
+}
+
+static int frame_match_destination(struct overlay_frame *frame, void *context)
+{
+  int j;
+  for (j=frame->destination_count -1;j>=0;j--)
+    if (frame->destinations[j].destination==context)
+      return 1;
+  return 0;
+}
+
 // de-queue all packets that have been sent to this subscriber & have arrived.
 int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *destination, uint32_t ack_mask, int ack_seq)
 {
   int i, j;
   time_ms_t now = gettime_ms();
   int rtt=0;
+  struct queue_ack ack = {
+    .neighbour = neighbour,
+    .destination = destination,
+    .ack_mask = ack_mask,
+    .ack_seq = ack_seq,
+    .now = now,
+  };
   
   for (i=0;i<OQ_MAX;i++){
+    // parked frames only need to come back if this ack changes them
+    overlay_queue_unpark(&overlay_tx[i], frame_match_ack, &ack);
     struct overlay_frame *frame = overlay_tx[i].first;
 
     while(frame){
-      
-      for (j=frame->destination_count -1;j>=0;j--)
-	if (frame->destinations[j].destination==destination)
-	  break;
-	  
+      int state = overlay_frame_ack_state(frame, &ack, &j);
       if (j>=0){
+	// the resend delay for this destination may change below
+	frame->ready_at = 0;
 	int frame_seq = frame->destinations[j].sent_sequence;
-	if (frame_seq >=0 && (frame->destinations[j].next_hop == neighbour || !frame->destination)){
-	  int seq_delta = (ack_seq - frame_seq)&0xFF;
-	  char acked = (seq_delta==0 || (seq_delta <= 32 && ack_mask&((uint32_t)1<<(seq_delta-1))))?1:0;
-
-	  if (acked){
-	    int this_rtt = now - frame->destinations[j].transmit_time;
-	    // if we're on a fake network, the actual rtt can be unrealistic
-	    if (this_rtt < 10)
-	      this_rtt = 10;
-	    if (!rtt || this_rtt < rtt)
-	      rtt = this_rtt;
-	    
-	    DEBUGF(ack, "DROPPED DUE TO ACK: Packet %p to %s sent by seq %d, acked with seq %d", 
-		   frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
-		
-	    // drop packets that don't need to be retransmitted
-	    if (frame->destination || frame->destination_count<=1){
-	      frame = overlay_queue_remove(&overlay_tx[i], frame);
-	      continue;
-	    }
-	    frame_remove_destination(frame, j);
-	    
-	  }else if (seq_delta < 128 && frame->destination && frame->delay_until>now){
-	    // retransmit asap
-	    DEBUGF(ack, "RE-TX DUE TO NACK: Requeue packet %p to %s sent by seq %d due to ack of seq %d", frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
-	    frame->delay_until = now;
-	    overlay_calc_queue_time(frame);
+	if (state == 1){
+	  int this_rtt = now - frame->destinations[j].transmit_time;
+	  // if we're on a fake network, the actual rtt can be unrealistic
+	  if (this_rtt < 10)
+	    this_rtt = 10;
+	  if (!rtt || this_rtt < rtt)
+	    rtt = this_rtt;
+	  
+	  DEBUGF(ack, "DROPPED DUE TO ACK: Packet %p to %s sent by seq %d, acked with seq %d", 
+		 frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
+	  
+	  // drop packets that don't need to be retransmitted
+	  if (frame->destination || frame->destination_count<=1){
+	    frame = overlay_queue_remove(&overlay_tx[i], frame);
+	    continue;
 	  }
+	  frame_remove_destination(frame, j);
+	  
+	}else if (state == -1){
+	  // retransmit asap
+	  DEBUGF(ack, "RE-TX DUE TO NACK: Requeue packet %p to %s sent by seq %d due to ack of seq %d", frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
+	  frame->delay_until = now;
+	  overlay_calc_queue_time(frame);
 	}
       }
       
@@ -650,6 +1110,9 @@ int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *
       if (delay < destination->resend_delay){
 	destination->resend_delay = delay;
 	DEBUGF(linkstate, "Adjusting resend delay to %d", destination->resend_delay);
+	// frames parked for the old resend delay may be due sooner
+	for (i=0;i<OQ_MAX;i++)
+	  overlay_queue_unpark(&overlay_tx[i], frame_match_destination, destination);
       }
     }
     if (!destination->max_rtt || rtt > destination->max_rtt)
@@ -657,3 +1120,109 @@ int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *
   }
   return 0;
 }
+
+DEFINE_CMD(app_queue_test, 0,
+  "Run overlay queue packet building speed test",
+  "test","queue","[--count=<count>]");
+static int app_queue_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *opt_count;
+  if (cli_arg(parsed, "--count", &opt_count, cli_uint, "10000") == -1)
+    return -1;
+  unsigned count = atoi(opt_count);
+  if (count == 0)
+    count = 1;
+
+  overlay_queue_init();
+  // a fake interface and neighbour, with packets built but never sent
+  overlay_interface *interface = &overlay_interfaces[0];
+  buf_strncpy_nul(interface->name, "test");
+  interface->state = INTERFACE_STATE_UP;
+  struct network_destination *destination = new_destination(interface);
+  if (destination == NULL)
+    return -1;
+  destination->unicast = 1;
+  destination->sequence_number = 0;
+  destination->ifconfig.send = 1;
+  destination->ifconfig.mtu = 1200;
+  destination->ifconfig.transmit_timeout_ms = 1000;
+  destination->ifconfig.encapsulation = ENCAP_OVERLAY;
+  sid_t sid;
+  memset(sid.binary, 0x11, sizeof sid.binary);
+  my_subscriber = find_subscriber(sid.binary, SID_SIZE, 1);
+  memset(sid.binary, 0x22, sizeof sid.binary);
+  struct subscriber *neighbour = find_subscriber(sid.binary, SID_SIZE, 1);
+  if (my_subscriber == NULL || neighbour == NULL)
+    return WHY("Could not create subscribers");
+  neighbour->max_packet_version = 1;
+
+  overlay_txqueue *queue = &overlay_tx[OQ_ORDINARY];
+  unsigned char payload[200];
+  memset(payload, 0x55, sizeof payload);
+  unsigned frames = 0;
+  unsigned long queued = 0;
+  time_us_t build_us = 0;
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    // offer about a packet's worth of frames each time, and ack each packet 16 packets later,
+    // so most of the queue is waiting for an ack like on a link with a long round trip
+    unsigned j;
+    for (j = 0; j < 5 && queue->length < queue->maxLength; j++) {
+      struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+      if (frame == NULL)
+	return -1;
+      frame->type = OF_TYPE_DATA;
+      frame->queue = OQ_ORDINARY;
+      frame->ttl = 1;
+      frame->resend = 1;
+      frame->source = my_subscriber;
+      frame->destination = neighbour;
+      if ((frame->payload = ob_new()) == NULL) {
+	op_free(frame);
+	return -1;
+      }
+      ob_append_bytes(frame->payload, payload, sizeof payload);
+      frame_add_destination(frame, neighbour, destination);
+      if (overlay_payload_enqueue(frame) == -1) {
+	op_free(frame);
+	return -1;
+      }
+    }
+    struct outgoing_packet packet;
+    bzero(&packet, sizeof packet);
+    packet.seq = -1;
+    time_ms_t now = gettime_ms();
+    int32_t first_sequence = mdp_sequence;
+    queued += queue->length;
+    time_us_t start = gettime_us();
+    int q;
+    for (q = 0; q < OQ_MAX; q++)
+      overlay_stuff_packet(&packet, &overlay_tx[q], now, NULL);
+    build_us += gettime_us() - start;
+    // every frame takes a new mdp sequence number the first time it is sent
+    frames += (mdp_sequence - first_sequence) & 0xFFFF;
+    if (packet.buffer == NULL)
+      return WHY("No packet was built");
+    ob_free(packet.buffer);
+    release_destination_ref(packet.destination);
+    if (i >= 16)
+      overlay_queue_ack(neighbour, destination, 0, destination->sequence_number - 16);
+  }
+  unschedule(&next_packet);
+  cli_printf(context, "%u packets of %.1f frames from a queue of %.1f\n",
+	     count, frames * 1.0 / count, queued * 1.0 / count);
+  cli_printf(context, "mean packet build time = %.2fus\n", build_us * 1.0 / count);
+
+  int q;
+  for (q = 0; q < OQ_MAX; q++) {
+    overlay_queue_unpark(&overlay_tx[q], NULL, NULL);
+    struct overlay_frame *frame = overlay_tx[q].first;
+    while (frame)
+      frame = overlay_queue_remove(&overlay_tx[q], frame);
+  }
+  release_destination_ref(destination);
+  my_subscriber = NULL;
+  interface->state = INTERFACE_STATE_DOWN;
+  return 0;
+}
@@ -52,6 +52,7 @@ extern time_ms_t rhizome_voice_timeout;
 #define RHIZOME_BAR_TTL_OFFSET 31
 
 #define MAX_MANIFEST_VARS 256
+#define MANIFEST_VAR_INDEX_SIZE (MAX_MANIFEST_VARS * 2) // must be a power of two
 #define MAX_MANIFEST_BYTES 8192
 #define MAX_MANIFEST_FIELD_LABEL_LEN 80
 
@@ -95,6 +96,12 @@ typedef struct rhizome_manifest
   const char *vars[MAX_MANIFEST_VARS];
   const char *values[MAX_MANIFEST_VARS];
 
+  /* Open-addressed hash index over vars[], so that a field can be found by
+   * label without scanning.  Each slot holds a vars[] index plus one, or zero
+   * if the slot is empty.  Kept at least half empty by MAX_MANIFEST_VARS.
+   */
+  unsigned short var_index[MANIFEST_VAR_INDEX_SIZE];
+
   /* Parties who have signed this manifest (binary format, malloc(3)).
    * Recognised signature types:
    *    0x17 = crypto_sign_edwards25519sha512batch()
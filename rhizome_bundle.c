@@ -19,6 +19,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <ctype.h>
 #include <assert.h>
 #include <sys/uio.h>
 #include "serval.h"
@@ -29,13 +31,35 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "keyring.h"
 #include "dataformats.h"
 
-static const char *rhizome_manifest_get(const rhizome_manifest *m, const char *var)
+/* Return the slot in the manifest's field index that holds the given label, or the empty slot
+ * where it would be inserted.  Labels are case sensitive, as for strcmp(3).
+ */
+static unsigned short *rhizome_manifest_var_slot(const rhizome_manifest *m, const char *var)
+{
+  const unsigned mask = NELS(m->var_index) - 1;
+  unsigned h = 2166136261u; // FNV-1a
+  const char *p;
+  for (p = var; *p; ++p)
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  for (;; ++h) {
+    unsigned short *slot = (unsigned short *) &m->var_index[h & mask];
+    if (*slot == 0 || strcmp(m->vars[*slot - 1], var) == 0)
+      return slot;
+  }
+}
+
+static void rhizome_manifest_reindex(rhizome_manifest *m)
 {
+  bzero(m->var_index, sizeof m->var_index);
   unsigned i;
   for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0)
-      return m->values[i];
-  return NULL;
+    *rhizome_manifest_var_slot(m, m->vars[i]) = i + 1;
+}
+
+static const char *rhizome_manifest_get(const rhizome_manifest *m, const char *var)
+{
+  const unsigned short *slot = rhizome_manifest_var_slot(m, var);
+  return *slot ? m->values[*slot - 1] : NULL;
 }
 
 #if 0
@@ -58,21 +82,21 @@ static uint64_t rhizome_manifest_get_ui64(rhizome_manifest *m, const char *var)
 static int _rhizome_manifest_del(struct __sourceloc __whence, rhizome_manifest *m, const char *var)
 {
   DEBUGF(rhizome_manifest, "DEL manifest %p %s", m, var);
-  int ret = 0;
-  unsigned i;
-  for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0) {
-      free((char *) m->vars[i]);
-      free((char *) m->values[i]);
-      --m->var_count;
-      ret = 1;
-      break;
-    }
+  const unsigned short *slot = rhizome_manifest_var_slot(m, var);
+  if (*slot == 0)
+    return 0;
+  unsigned i = *slot - 1;
+  free((char *) m->vars[i]);
+  free((char *) m->values[i]);
+  --m->var_count;
   for (; i < m->var_count; ++i) {
     m->vars[i] = m->vars[i + 1];
     m->values[i] = m->values[i + 1];
   }
-  return ret;
+  m->vars[m->var_count] = m->values[m->var_count] = NULL;
+  // Removal shifts the following fields down, so their index entries are all stale.
+  rhizome_manifest_reindex(m);
+  return 1;
 }
 
 #define rhizome_manifest_set(m,var,value) _rhizome_manifest_set(__WHENCE__, (m), (var), (value))
@@ -82,29 +106,30 @@ static int _rhizome_manifest_del(struct __sourceloc __whence, rhizome_manifest *
 static const char *_rhizome_manifest_set(struct __sourceloc __whence, rhizome_manifest *m, const char *var, const char *value)
 {
   DEBUGF(rhizome_manifest, "SET manifest %p %s = %s", m, var, alloca_str_toprint(value));
-  unsigned i;
-  for(i=0;i<m->var_count;i++)
-    if (strcmp(m->vars[i],var) == 0) {
-      const char *ret = str_edup(value);
-      if (ret == NULL)
-	return NULL;
-      free((char *)m->values[i]);
-      m->values[i] = ret;
-      return ret;
-    }
+  unsigned short *slot = rhizome_manifest_var_slot(m, var);
+  if (*slot) {
+    unsigned i = *slot - 1;
+    const char *ret = str_edup(value);
+    if (ret == NULL)
+      return NULL;
+    free((char *)m->values[i]);
+    m->values[i] = ret;
+    return ret;
+  }
   if (m->var_count >= NELS(m->vars)) {
     WHY("no more manifest vars");
     return NULL;
   }
-  if ((m->vars[m->var_count] = str_edup(var)) == NULL)
+  unsigned i = m->var_count;
+  if ((m->vars[i] = str_edup(var)) == NULL)
     return NULL;
-  const char *ret = m->values[m->var_count] = str_edup(value);
+  const char *ret = m->values[i] = str_edup(value);
   if (ret == NULL) {
     free((char *)m->vars[i]);
     m->vars[i] = NULL;
     return NULL;
   }
-  m->var_count++;
+  *slot = ++m->var_count;
   return ret;
 }
 
@@ -471,6 +496,7 @@ static void rhizome_manifest_clear(rhizome_manifest *m)
     free((char *) m->values[m->var_count]);
     m->vars[m->var_count] = m->values[m->var_count] = NULL;
   }
+  bzero(m->var_index, sizeof m->var_index);
   while (m->sig_count) {
     --m->sig_count;
     free(m->signatories[m->sig_count]);
@@ -963,13 +989,37 @@ static struct rhizome_manifest_field_descriptor {
 #undef FIELD
     };
 
+/* Perfect hash over the known field labels, ignoring case.  The multipliers were chosen so that no
+ * two labels in rhizome_manifest_fields[] collide; adding a field that does collide will trip the
+ * assertion in get_rhizome_manifest_field_descriptor(), and the multipliers must be re-chosen.
+ */
+#define MANIFEST_FIELD_HASH_SIZE 32
+
+static unsigned rhizome_manifest_field_hash(const char *label, size_t len)
+{
+  assert(len != 0);
+  return (tolower((unsigned char)label[0]) * 4 + tolower((unsigned char)label[len - 1]) + len * 3) & (MANIFEST_FIELD_HASH_SIZE - 1);
+}
+
 static struct rhizome_manifest_field_descriptor *get_rhizome_manifest_field_descriptor(const char *label)
 {
-  unsigned i;
-  for (i = 0; i < NELS(rhizome_manifest_fields); ++i)
-    if (strcasecmp(label, rhizome_manifest_fields[i].label) == 0)
-      return &rhizome_manifest_fields[i];
-  return NULL;
+  static struct rhizome_manifest_field_descriptor *table[MANIFEST_FIELD_HASH_SIZE];
+  static int table_built = 0;
+  if (!table_built) {
+    unsigned i;
+    for (i = 0; i < NELS(rhizome_manifest_fields); ++i) {
+      struct rhizome_manifest_field_descriptor *desc = &rhizome_manifest_fields[i];
+      unsigned h = rhizome_manifest_field_hash(desc->label, strlen(desc->label));
+      assert(table[h] == NULL);
+      table[h] = desc;
+    }
+    table_built = 1;
+  }
+  size_t len = strlen(label);
+  if (len == 0)
+    return NULL;
+  struct rhizome_manifest_field_descriptor *desc = table[rhizome_manifest_field_hash(label, len)];
+  return desc && strcasecmp(label, desc->label) == 0 ? desc : NULL;
 }
 
 /* Overwrite a Rhizome manifest with fields from another.  Used in the "add bundle" application API
@@ -1101,11 +1151,7 @@ int rhizome_manifest_remove_field(rhizome_manifest *m, const char *field_label,
     return 0;
   }
   const char *label = alloca_strndup(field_label, field_label_len);
-  struct rhizome_manifest_field_descriptor *desc = NULL;
-  unsigned i;
-  for (i = 0; desc == NULL && i < NELS(rhizome_manifest_fields); ++i)
-    if (strcasecmp(label, rhizome_manifest_fields[i].label) == 0)
-      desc = &rhizome_manifest_fields[i];
+  struct rhizome_manifest_field_descriptor *desc = get_rhizome_manifest_field_descriptor(label);
   if (!desc)
     return rhizome_manifest_del(m, label);
   if (!desc->test(m))
@@ -1226,27 +1272,70 @@ int rhizome_hash_file(rhizome_manifest *m, const char *path, rhizome_filehash_t
   return 0;
 }
 
-rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence)
+/* Freed manifests are kept on a small free list and reset in place when next allocated, to avoid
+ * a calloc(3) of the whole (mostly buffer) struct for every sync message, fetch and list row.
+ * Only one size class is needed, since every manifest has the same fixed-size buffers.
+ */
+#define RHIZOME_MANIFEST_POOL_SIZE 16
+
+static rhizome_manifest *manifest_pool[RHIZOME_MANIFEST_POOL_SIZE];
+static unsigned manifest_pool_count = 0;
+
+static struct rhizome_manifest_pool_stats {
+  unsigned allocated; // obtained from the heap
+  unsigned reused; // taken from the free list
+  unsigned in_use;
+} manifest_pool_stats;
+
+/* Return a pooled manifest to the state of a freshly zeroed one.  rhizome_manifest_clear() already
+ * emptied the var, index and signatory slots when it was freed, and manifestdata[] is only ever
+ * read up to manifest_all_bytes, so those large arrays are not zeroed again.
+ */
+static void rhizome_manifest_reset(rhizome_manifest *m)
 {
-  rhizome_manifest *m=emalloc_zero(sizeof(rhizome_manifest));
-  if (m){
-    DEBUGF(rhizome_manifest, "NEW manifest %p", m);
+  assert(m->var_count == 0);
+  assert(m->sig_count == 0);
+  bzero(m, offsetof(rhizome_manifest, var_count));
+  bzero(m->signatureTypes, sizeof m->signatureTypes);
+  bzero(&m->malformed, offsetof(rhizome_manifest, manifestdata) - offsetof(rhizome_manifest, malformed));
+  bzero(&m->manifesthash, sizeof *m - offsetof(rhizome_manifest, manifesthash));
+}
 
-    // Set global defaults for a manifest (which are not zero)
-    rhizome_manifest_clear(m);
+rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence)
+{
+  rhizome_manifest *m;
+  if (manifest_pool_count) {
+    m = manifest_pool[--manifest_pool_count];
+    rhizome_manifest_reset(m);
+    ++manifest_pool_stats.reused;
+  } else {
+    if ((m = emalloc_zero(sizeof(rhizome_manifest))) == NULL)
+      return NULL;
+    ++manifest_pool_stats.allocated;
   }
+  ++manifest_pool_stats.in_use;
+  DEBUGF(rhizome_manifest, "NEW manifest %p (in use=%u, pooled=%u, allocated=%u, reused=%u)",
+	 m, manifest_pool_stats.in_use, manifest_pool_count, manifest_pool_stats.allocated, manifest_pool_stats.reused);
+
+  // Set global defaults for a manifest (which are not zero)
+  rhizome_manifest_clear(m);
   return m;
 }
 
 void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
 {
   if (!m) return;
-  DEBUGF(rhizome_manifest, "FREE manifest %p", m);
+  assert(manifest_pool_stats.in_use != 0);
+  --manifest_pool_stats.in_use;
+  DEBUGF(rhizome_manifest, "FREE manifest %p (in use=%u)", m, manifest_pool_stats.in_use);
   
   /* Free variable and signature blocks. */
   rhizome_manifest_clear(m);
 
-  return;
+  if (manifest_pool_count < NELS(manifest_pool))
+    manifest_pool[manifest_pool_count++] = m;
+  else
+    free(m);
 }
 
 /* Converts the variable list into manifest text body and computes the hash.  Does not sign.
@@ -841,3 +841,96 @@ static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context
   return 0;
 }
 
+
+/* A typical bundle's manifest, used by the manifest speed test when no manifest file is given.
+ */
+static const char manifest_test_text[] =
+  "service=file\n"
+  "version=1445252868000\n"
+  "id=9C6B1A7A4E3D5B2F8E0D1C2B3A4F5E6D7C8B9A0F1E2D3C4B5A6978869504132A\n"
+  "date=1445252868000\n"
+  "filesize=4096\n"
+  "filehash=0F1E2D3C4B5A69788796A5B4C3D2E1F00F1E2D3C4B5A69788796A5B4C3D2E1F00F1E2D3C4B5A69788796A5B4C3D2E1F00F1E2D3C4B5A69788796A5B4C3D2E1F0\n"
+  "name=benchmark.txt\n"
+  "crypt=0\n"
+  "sender=1A2B3C4D5E6F708192A3B4C5D6E7F8091A2B3C4D5E6F708192A3B4C5D6E7F809\n"
+  "recipient=F9E8D7C6B5A4938271605F4E3D2C1B0AF9E8D7C6B5A4938271605F4E3D2C1B0A\n"
+  "colour=blue\n"
+  "comment=synthetic manifest for the speed test\n";
+
+DEFINE_CMD(app_rhizome_manifest_test, 0,
+  "Run Rhizome manifest parse and serialise speed test",
+  "test","manifest","[--count=<count>]","[<manifestpath>]");
+static int app_rhizome_manifest_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *opt_count, *manifestpath;
+  if (   cli_arg(parsed, "--count", &opt_count, cli_uint, "100000") == -1
+      || cli_arg(parsed, "manifestpath", &manifestpath, NULL, "") == -1)
+    return -1;
+  unsigned count = atoi(opt_count);
+  if (count == 0)
+    count = 1;
+  unsigned char text[MAX_MANIFEST_BYTES];
+  size_t len;
+  if (manifestpath[0]) {
+    ssize_t n = read_whole_file(manifestpath, text, sizeof text);
+    if (n == -1)
+      return -1;
+    len = (size_t) n;
+  } else {
+    len = sizeof manifest_test_text - 1;
+    bcopy(manifest_test_text, text, len);
+  }
+
+  char label[MAX_MANIFEST_BYTES];
+  char value[MAX_MANIFEST_BYTES];
+  char packed[MAX_MANIFEST_BYTES];
+  time_us_t parse_us = 0, replace_us = 0, pack_us = 0;
+  unsigned fields = 0;
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (m == NULL)
+      return WHY("Manifest struct could not be allocated");
+    bcopy(text, m->manifestdata, len);
+    m->manifest_all_bytes = len;
+    time_us_t start = gettime_us();
+    if (rhizome_manifest_parse(m) != 0) {
+      rhizome_manifest_free(m);
+      return WHY("Manifest does not parse");
+    }
+    time_us_t parsed = gettime_us();
+    // Replace every field with its own value, which looks up, removes and sets each label in turn.
+    // A replaced field moves to the end of vars[], so the next one is always at the start.
+    unsigned j;
+    for (j = 0; j != m->var_count; ++j) {
+      buf_strncpy_nul(label, m->vars[0]);
+      buf_strncpy_nul(value, m->values[0]);
+      if (!rhizome_manifest_remove_field(m, label, strlen(label))
+	|| rhizome_manifest_parse_field(m, label, strlen(label), value, strlen(value)) != RHIZOME_MANIFEST_OK) {
+	rhizome_manifest_free(m);
+	return WHYF("Could not replace manifest field %s", alloca_str_toprint(label));
+      }
+    }
+    time_us_t replaced = gettime_us();
+    strbuf sb = strbuf_local_buf(packed);
+    for (j = 0; j != m->var_count; ++j) {
+      strbuf_puts(sb, m->vars[j]);
+      strbuf_putc(sb, '=');
+      strbuf_puts(sb, m->values[j]);
+      strbuf_putc(sb, '\n');
+    }
+    time_us_t end = gettime_us();
+    parse_us += parsed - start;
+    replace_us += replaced - parsed;
+    pack_us += end - replaced;
+    fields += m->var_count;
+    rhizome_manifest_free(m);
+  }
+  cli_printf(context, "%u manifests of %u fields (%zu bytes)\n", count, fields / count, len);
+  cli_printf(context, "mean parse time = %.2fus\n", parse_us * 1.0 / count);
+  cli_printf(context, "mean field replace time = %.3fus\n", replace_us * 1.0 / fields);
+  cli_printf(context, "mean serialise time = %.2fus\n", pack_us * 1.0 / count);
+  return 0;
+}
@@ -421,42 +421,50 @@ int rhizome_verify_bundle_privatekey(const unsigned char *sk, const unsigned cha
 
 typedef struct manifest_signature_block_cache {
   unsigned char manifest_hash[crypto_hash_sha512_BYTES];
-  unsigned char signature_bytes[256];
-  size_t signature_length;
+  unsigned char signature_bytes[96];
+  size_t signature_length; // zero if the entry is unused
+  uint32_t last_used;
   int signature_valid;
 } manifest_signature_block_cache;
 
-#define SIG_CACHE_SIZE 1024
-manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+/* Signature results are cached in a set-associative table, evicting the least recently used entry
+ * in a set.  The old direct-mapped table thrashed whenever two manifests in the same burst hashed to
+ * the same slot, so both had to be verified again on every repeat advertisement.
+ */
+#define SIG_CACHE_SETS 512 // must be a power of two
+#define SIG_CACHE_WAYS 4
+static manifest_signature_block_cache sig_cache[SIG_CACHE_SETS][SIG_CACHE_WAYS];
+static uint32_t sig_cache_clock = 0;
 
 static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, size_t sig_len)
 {
   IN();
-  unsigned slot=0;
+  assert(sig_len != 0);
+  assert(sig_len <= sizeof sig_cache[0][0].signature_bytes);
+  // The manifest hash is a SHA-512 digest, so its leading bytes are already well distributed.
+  unsigned set = (hash[0] | (hash[1] << 8) | (sig[0] << 16)) & (SIG_CACHE_SETS - 1);
+  manifest_signature_block_cache *entry = NULL;
   unsigned i;
-
-  for(i=0;i<crypto_hash_sha512_BYTES;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=hash[i];
-  }
-  for(i=0;i<sig_len;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=sig[i];
-  }
-  slot%=SIG_CACHE_SIZE;
-
-  if (sig_cache[slot].signature_length!=sig_len || 
-      memcmp(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES) ||
-      memcmp(sig, sig_cache[slot].signature_bytes, sig_len)){
-    bcopy(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES);
-    bcopy(sig, sig_cache[slot].signature_bytes, sig_len);
-    sig_cache[slot].signature_length=sig_len;
-
-    sig_cache[slot].signature_valid=
-      crypto_sign_verify_detached(sig, hash, crypto_hash_sha512_BYTES, &sig[crypto_sign_BYTES])
-      ? -1 : 0;
+  for (i = 0; i < SIG_CACHE_WAYS; ++i) {
+    manifest_signature_block_cache *e = &sig_cache[set][i];
+    if (   e->signature_length == sig_len
+	&& memcmp(hash, e->manifest_hash, crypto_hash_sha512_BYTES) == 0
+	&& memcmp(sig, e->signature_bytes, sig_len) == 0
+    ) {
+      e->last_used = ++sig_cache_clock;
+      RETURN(e->signature_valid);
+    }
+    if (entry == NULL || e->signature_length == 0 || (entry->signature_length && e->last_used < entry->last_used))
+      entry = e;
   }
-  RETURN(sig_cache[slot].signature_valid);
+  bcopy(hash, entry->manifest_hash, crypto_hash_sha512_BYTES);
+  bcopy(sig, entry->signature_bytes, sig_len);
+  entry->signature_length = sig_len;
+  entry->last_used = ++sig_cache_clock;
+  entry->signature_valid =
+    crypto_sign_verify_detached(sig, hash, crypto_hash_sha512_BYTES, &sig[crypto_sign_BYTES])
+    ? -1 : 0;
+  RETURN(entry->signature_valid);
   OUT();
 }
 
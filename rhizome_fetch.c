@@ -219,6 +219,39 @@ static struct profile_total rsnqf_stats = { .name="rhizome_start_next_queued_fet
 static struct sched_ent sched_activate = { .function = rhizome_start_next_queued_fetches, .stats = &rsnqf_stats };
 static struct profile_total fetch_stats = { .name="rhizome_fetch_poll" };
 
+/* Manifests suggested for import are not verified one at a time as each advertisement is parsed,
+ * but collected here and verified in batches from an alarm.  A burst of advertisements (eg, when a
+ * network partition heals) then does not stall packet reception, and the many copies of the same
+ * manifest that arrive from different neighbours are only verified once.  If the queue is full, the
+ * manifest is verified immediately, as before.
+ */
+#define RHIZOME_VERIFY_QUEUE_SIZE 64
+#define RHIZOME_VERIFY_BATCH_MS 20
+
+static int rhizome_queue_verified_manifest_import(rhizome_manifest *m, const struct socket_address *addr, const struct subscriber *peer);
+static void rhizome_verify_queued_manifests(struct sched_ent *alarm);
+static struct profile_total verify_stats = { .name="rhizome_verify_queued_manifests" };
+static struct sched_ent sched_verify = { .function = rhizome_verify_queued_manifests, .stats = &verify_stats };
+
+static struct rhizome_fetch_candidate verify_queue[RHIZOME_VERIFY_QUEUE_SIZE];
+static unsigned verify_queue_count = 0;
+
+static void rhizome_fetch_mark_subscribers()
+{
+  unsigned i, j;
+  for (i = 0; i < NQUEUES; ++i) {
+    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+    mark_subscriber_in_use((struct subscriber *)q->active.peer);
+    for (j = 0; j < q->candidate_queue_size; ++j)
+      if (q->candidate_queue[j].manifest)
+	mark_subscriber_in_use((struct subscriber *)q->candidate_queue[j].peer);
+  }
+  for (i = 0; i < verify_queue_count; ++i)
+    mark_subscriber_in_use((struct subscriber *)verify_queue[i].peer);
+}
+
+DEFINE_TRIGGER(subscriber_mark, rhizome_fetch_mark_subscribers);
+
 /* Find a queue suitable for a fetch of the given number of bytes.  If there is no suitable queue,
  * return NULL.
  *
@@ -391,7 +424,7 @@ int rhizome_any_fetch_queued()
   for (i = 0; i < NQUEUES; ++i)
     if (rhizome_fetch_queues[i].candidate_queue[0].manifest)
       return 1;
-  return 0;
+  return verify_queue_count != 0;
 }
 
 typedef struct ignored_manifest {
@@ -848,6 +881,63 @@ int rhizome_fetch_has_queue_space(unsigned char log2_size){
   return 0;
 }
 
+/* Add a manifest to the verification queue, taking ownership of it.  Returns 0 if queued (or
+ * discarded as a duplicate), -1 if the queue is full and the caller must verify it now.
+ */
+static int rhizome_verify_queue_add(rhizome_manifest *m, const struct socket_address *addr, const struct subscriber *peer)
+{
+  unsigned i;
+  for (i = 0; i < verify_queue_count; ++i) {
+    struct rhizome_fetch_candidate *c = &verify_queue[i];
+    if (cmp_rhizome_bid_t(&m->cryptoSignPublic, &c->manifest->cryptoSignPublic) == 0) {
+      if (c->manifest->version >= m->version) {
+	DEBUGF(rhizome_rx, "Already verifying bid=%s version=%"PRIu64, alloca_tohex_rhizome_bid_t(m->cryptoSignPublic), c->manifest->version);
+	rhizome_manifest_free(m);
+      } else {
+	rhizome_manifest_free(c->manifest);
+	c->manifest = m;
+	c->addr = *addr;
+	c->peer = peer;
+      }
+      return 0;
+    }
+  }
+  if (verify_queue_count >= NELS(verify_queue))
+    return -1;
+  struct rhizome_fetch_candidate *c = &verify_queue[verify_queue_count++];
+  c->manifest = m;
+  c->addr = *addr;
+  c->peer = peer;
+  if (!is_scheduled(&sched_verify)) {
+    sched_verify.alarm = gettime_ms();
+    sched_verify.deadline = sched_verify.alarm + RHIZOME_VERIFY_BATCH_MS;
+    schedule(&sched_verify);
+  }
+  return 0;
+}
+
+static void rhizome_verify_queued_manifests(struct sched_ent *alarm)
+{
+  assert(alarm == &sched_verify);
+  time_ms_t start = gettime_ms();
+  time_ms_t now = start;
+  unsigned done = 0;
+  while (done < verify_queue_count && now - start < RHIZOME_VERIFY_BATCH_MS) {
+    struct rhizome_fetch_candidate *c = &verify_queue[done++];
+    rhizome_queue_verified_manifest_import(c->manifest, &c->addr, c->peer);
+    c->manifest = NULL;
+    now = gettime_ms();
+  }
+  DEBUGF(rhizome_rx, "Verified %u of %u queued manifests in %"PRId64"ms", done, verify_queue_count, now - start);
+  verify_queue_count -= done;
+  memmove(&verify_queue[0], &verify_queue[done], verify_queue_count * sizeof verify_queue[0]);
+  if (verify_queue_count) {
+    sched_verify.alarm = now;
+    sched_verify.deadline = now + RHIZOME_VERIFY_BATCH_MS;
+    schedule(&sched_verify);
+  }
+}
+
 /* Queue a fetch for the payload of the given manifest.  If 'addr' is not NULL, then it is used as
  * the port and IP address of an HTTP server from which the fetch is performed.  Otherwise the fetch
  * is performed over MDP.
@@ -885,6 +975,20 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
 
   assert(m->filesize != RHIZOME_SIZE_UNSET);
   
+  // if we haven't verified it yet, leave it to be verified in the next batch
+  if (!m->selfSigned && rhizome_verify_queue_add(m, addr, peer) == 0)
+    RETURN(0);
+  RETURN(rhizome_queue_verified_manifest_import(m, addr, peer));
+  OUT();
+}
+
+/* The remainder of rhizome_suggest_queue_manifest_import(), once the manifest has been (or is
+ * about to be) verified.
+ */
+static int rhizome_queue_verified_manifest_import(rhizome_manifest *m, const struct socket_address *addr, const struct subscriber *peer)
+{
+  IN();
+
   // if we haven't verified it yet, verify now
   if (!m->selfSigned && !rhizome_manifest_verify(m)) {
     WHY("Error verifying manifest when considering queuing for import");
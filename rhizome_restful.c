@@ -188,18 +188,29 @@ static int restful_rhizome_bundlelist_json(httpd_request *r, const char *remaind
 }
 
 static HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER restful_rhizome_bundlelist_json_content_chunk;
+static HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER restful_rhizome_newsince_events_content_chunk;
 
-static int restful_rhizome_bundlelist_json_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
+/* The statement of the list cursor is opened lazily by rhizome_list_next(), so a "newsince" list
+ * whose rows all come from the ring of recently added bundles never touches the database.
+ */
+static int bundlelist_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result, HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER *chunker)
 {
   httpd_request *r = (httpd_request *) hr;
-  int ret = rhizome_list_open(&r->u.rhlist.cursor);
-  if (ret == -1)
-    return -1;
-  ret = generate_http_content_from_strbuf_chunks(hr, (char *)buf, bufsz, result, restful_rhizome_bundlelist_json_content_chunk);
+  int ret = generate_http_content_from_strbuf_chunks(hr, (char *)buf, bufsz, result, chunker);
   rhizome_list_release(&r->u.rhlist.cursor);
   return ret;
 }
 
+static int restful_rhizome_bundlelist_json_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
+{
+  return bundlelist_content(hr, buf, bufsz, result, restful_rhizome_bundlelist_json_content_chunk);
+}
+
+static int restful_rhizome_newsince_events_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
+{
+  return bundlelist_content(hr, buf, bufsz, result, restful_rhizome_newsince_events_content_chunk);
+}
+
 static int restful_rhizome_newsince(httpd_request *r, const char *remainder)
 {
   r->http.response.header.content_type = CONTENT_TYPE_JSON;
@@ -210,7 +221,20 @@ static int restful_rhizome_newsince(httpd_request *r, const char *remainder)
     return ret;
   uint64_t rowid;
   const char *end = NULL;
-  if (!strn_to_list_token(remainder, &rowid, &end) || strcmp(end, "/bundlelist.json") != 0)
+  if (!strn_to_list_token(remainder, &rowid, &end))
+    return 404;
+  const char *content_type;
+  HTTP_CONTENT_GENERATOR *generator;
+  time_ms_t wait;
+  if (strcmp(end, "/bundlelist.json") == 0) {
+    content_type = CONTENT_TYPE_JSON;
+    generator = restful_rhizome_bundlelist_json_content;
+    wait = config.api.restful.newsince_timeout * 1000;
+  } else if (strcmp(end, "/bundlelist.events") == 0) {
+    content_type = CONTENT_TYPE_EVENT_STREAM;
+    generator = restful_rhizome_newsince_events_content;
+    wait = config.api.restful.stream_keepalive * 1000;
+  } else
     return 404;
   if (r->http.verb != HTTP_VERB_GET)
     return 405;
@@ -218,9 +242,9 @@ static int restful_rhizome_newsince(httpd_request *r, const char *remainder)
   r->u.rhlist.rowcount = 0;
   bzero(&r->u.rhlist.cursor, sizeof r->u.rhlist.cursor);
   r->u.rhlist.cursor.rowid_since = rowid;
-  r->u.rhlist.end_time = gettime_ms() + config.api.restful.newsince_timeout * 1000;
+  r->u.rhlist.end_time = gettime_ms() + wait;
   r->trigger_rhizome_bundle_added = on_rhizome_bundle_added;
-  http_request_response_generated(&r->http, 200, CONTENT_TYPE_JSON, restful_rhizome_bundlelist_json_content);
+  http_request_response_generated(&r->http, 200, content_type, generator);
   return 1;
 }
 
@@ -229,118 +253,311 @@ static void on_rhizome_bundle_added(httpd_request *r, rhizome_manifest *UNUSED(m
   http_request_resume_response(&r->http);
 }
 
+/* Append the columns of a bundle list row that follow the ".token" column, ie, starting with the
+ * comma that separates them from the token and ending with the closing bracket.
+ */
+static void strbuf_json_bundle_row_tail(strbuf b, const rhizome_manifest *m, enum rhizome_bundle_authorship authorship, const sid_t *author)
+{
+  strbuf_putc(b, ',');
+  strbuf_sprintf(b, "%"PRIu64, m->rowid);
+  strbuf_putc(b, ',');
+  strbuf_json_string(b, m->service);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary);
+  strbuf_putc(b, ',');
+  strbuf_sprintf(b, "%"PRIu64, m->version);
+  strbuf_putc(b, ',');
+  if (m->has_date)
+    strbuf_sprintf(b, "%"PRItime_ms_t, m->date);
+  else
+    strbuf_json_null(b);
+  strbuf_putc(b, ',');
+  strbuf_sprintf(b, "%"PRItime_ms_t",", m->inserttime);
+  // The 'fromhere' flag indicates if the author is a known (unlocked) identity in the local
+  // keyring.  The values are 0 (no), 1 (yes), 2 (yes and cryptographically verified).  In the
+  // implementation below, the 0 value (no) is redundant, because it only occurs when the
+  // 'author' column is null, but in future the author SID might be reported for non-local
+  // authors, so clients should only use 'fromhere != 0', never 'author != null', to detect
+  // local authorship.
+  int fromhere = 0;
+  switch (authorship) {
+    case AUTHOR_AUTHENTIC:
+      fromhere = 2;
+      strbuf_json_hex(b, author->binary, sizeof author->binary);
+      break;
+    case AUTHOR_LOCAL:
+      fromhere = 1;
+      strbuf_json_hex(b, author->binary, sizeof author->binary);
+      break;
+    default:
+      strbuf_json_null(b);
+      break;
+  }
+  strbuf_putc(b, ',');
+  strbuf_sprintf(b, "%d", fromhere);
+  strbuf_putc(b, ',');
+  strbuf_sprintf(b, "%"PRIu64, m->filesize);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, m->filesize ? m->filehash.binary : NULL, sizeof m->filehash.binary);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, m->has_sender ? m->sender.binary : NULL, sizeof m->sender.binary);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, m->has_recipient ? m->recipient.binary : NULL, sizeof m->recipient.binary);
+  strbuf_putc(b, ',');
+  strbuf_json_string(b, m->name);
+  strbuf_puts(b, "]");
+}
+
+/* Ring buffer of the most recently added bundles, each already rendered as the tail of a bundle
+ * list row, so that paused "newsince" requests can be woken with their new rows without
+ * re-querying the database for every request.  The ring holds every bundle added with a rowid in
+ * the range (rowid_base, rowid_last], in rowid order with no gaps, so the entry for any rowid in
+ * that range is found by subtraction.  A bundle that is replaced by a later version (and therefore
+ * no longer has a row in the MANIFESTS table) keeps its place in the ring but has no row text.
+ *
+ * Bundles added by other processes (eg, CLI commands) fire the bundle_add trigger without a rowid,
+ * which empties the ring.  The next bundle with a rowid starts it again.  Requests whose position
+ * is older than the start of the ring, or that find the ring empty, use the database query.
+ */
+#define NEWSINCE_RING_SIZE 128
+
+struct newsince_entry {
+  uint64_t rowid;
+  rhizome_bid_t bid;
+  char *row; // NULL if replaced by a later version
+};
+
+static struct newsince_ring {
+  struct newsince_entry entries[NEWSINCE_RING_SIZE];
+  unsigned first;
+  unsigned count;
+  uint64_t rowid_base;
+  uint64_t rowid_last;
+} newsince_ring;
+
+static void newsince_ring_clear(void)
+{
+  for (; newsince_ring.count; --newsince_ring.count) {
+    struct newsince_entry *e = &newsince_ring.entries[newsince_ring.first];
+    if (e->row)
+      free(e->row);
+    e->row = NULL;
+    newsince_ring.first = (newsince_ring.first + 1) % NEWSINCE_RING_SIZE;
+  }
+  newsince_ring.first = 0;
+  newsince_ring.rowid_base = 0;
+  newsince_ring.rowid_last = 0;
+}
+
+/* Returns true if the ring holds every bundle added after the given rowid.
+ */
+static int newsince_ring_covers(uint64_t rowid)
+{
+  return newsince_ring.rowid_last != 0 && rowid >= newsince_ring.rowid_base;
+}
+
+/* Returns the oldest entry in the ring that has a row and was added after the given rowid, or NULL
+ * if there is none.  Only call this if newsince_ring_covers(rowid) is true.
+ */
+static const struct newsince_entry *newsince_ring_next(uint64_t rowid)
+{
+  assert(newsince_ring_covers(rowid));
+  uint64_t i;
+  for (i = rowid - newsince_ring.rowid_base; i < newsince_ring.count; ++i) {
+    const struct newsince_entry *e = &newsince_ring.entries[(newsince_ring.first + i) % NEWSINCE_RING_SIZE];
+    assert(e->rowid == newsince_ring.rowid_base + i + 1);
+    if (e->row)
+      return e;
+  }
+  return NULL;
+}
+
+/* The bundle list works out authorship from the MANIFESTS 'author' column (which is only set if the
+ * author was authentic when stored) using rhizome_lookup_author().  Do the same thing here, but
+ * without altering the authorship of the caller's manifest.
+ */
+static enum rhizome_bundle_authorship newsince_lookup_author(const rhizome_manifest *m, const sid_t **authorp)
+{
+  keyring_iterator it;
+  if (m->authorship == AUTHOR_AUTHENTIC) {
+    keyring_iterator_start(keyring, &it);
+    if (keyring_find_sid(&it, &m->author)) {
+      *authorp = &m->author;
+      return AUTHOR_LOCAL;
+    }
+  }
+  if (m->has_sender) {
+    keyring_iterator_start(keyring, &it);
+    if (keyring_find_sid(&it, &m->sender)) {
+      *authorp = &m->sender;
+      return AUTHOR_LOCAL;
+    }
+  }
+  *authorp = NULL;
+  return ANONYMOUS;
+}
+
+static void newsince_ring_bundle_added(rhizome_manifest *m)
+{
+  // Bundles added by the CLI are announced without a rowid, so the ring can no longer tell which
+  // bundles it holds.  Empty it, so waiting requests find the new bundle with a database query.
+  if (m->rowid == 0) {
+    newsince_ring_clear();
+    return;
+  }
+  if (m->rowid <= newsince_ring.rowid_last)
+    return;
+  if (newsince_ring.rowid_last == 0 || m->rowid != newsince_ring.rowid_last + 1) {
+    newsince_ring_clear();
+    newsince_ring.rowid_base = m->rowid - 1;
+  }
+  unsigned i;
+  for (i = 0; i != newsince_ring.count; ++i) {
+    struct newsince_entry *e = &newsince_ring.entries[(newsince_ring.first + i) % NEWSINCE_RING_SIZE];
+    if (e->row && cmp_rhizome_bid_t(&e->bid, &m->cryptoSignPublic) == 0) {
+      free(e->row);
+      e->row = NULL;
+    }
+  }
+  if (newsince_ring.count == NEWSINCE_RING_SIZE) {
+    struct newsince_entry *e = &newsince_ring.entries[newsince_ring.first];
+    if (e->row)
+      free(e->row);
+    e->row = NULL;
+    newsince_ring.rowid_base = e->rowid;
+    newsince_ring.first = (newsince_ring.first + 1) % NEWSINCE_RING_SIZE;
+    --newsince_ring.count;
+  }
+  const sid_t *author;
+  enum rhizome_bundle_authorship authorship = newsince_lookup_author(m, &author);
+  strbuf b;
+  STRBUF_ALLOCA_FIT(b, 256, strbuf_json_bundle_row_tail(b, m, authorship, author));
+  char *row = str_edup(strbuf_str(b));
+  if (row == NULL) {
+    newsince_ring_clear();
+    return;
+  }
+  struct newsince_entry *e = &newsince_ring.entries[(newsince_ring.first + newsince_ring.count) % NEWSINCE_RING_SIZE];
+  e->rowid = m->rowid;
+  e->bid = m->cryptoSignPublic;
+  e->row = row;
+  ++newsince_ring.count;
+  newsince_ring.rowid_last = m->rowid;
+}
+
+DEFINE_TRIGGER(bundle_add, newsince_ring_bundle_added);
+
+static const char *bundlelist_headers[] = {
+  ".token",
+  "_id",
+  "service",
+  "id",
+  "version",
+  "date",
+  ".inserttime",
+  ".author",
+  ".fromhere",
+  "filesize",
+  "filehash",
+  "sender",
+  "recipient",
+  "name"
+};
+
+static void strbuf_json_bundlelist_header(strbuf b)
+{
+  strbuf_putc(b, '[');
+  unsigned i;
+  for (i = 0; i != NELS(bundlelist_headers); ++i) {
+    if (i)
+      strbuf_putc(b, ',');
+    strbuf_json_string(b, bundlelist_headers[i]);
+  }
+  strbuf_putc(b, ']');
+}
+
+/* Append the next row of a bundle list to the strbuf as a JSON array, preceded by 'prefix' and
+ * followed by 'suffix'.  A "newsince" list takes its rows from the ring of recently added bundles
+ * whenever the ring holds all the bundles after the list's position, otherwise it queries the
+ * database.  If the strbuf overruns then the row is not consumed, so the next call will append the
+ * same row again.
+ *
+ * The position of a "newsince" list is kept in its cursor's 'rowid_since', which is advanced past
+ * every row that is appended, so that the list can switch between the ring and the database at
+ * any time without skipping or repeating rows.
+ *
+ * Returns 1 if a row was appended, 0 if there are no more rows, or -1 on error.
+ */
+static int bundlelist_append_row(httpd_request *r, strbuf b, const char *prefix, const char *suffix)
+{
+  if (r->u.rhlist.cursor.rowid_since && newsince_ring_covers(r->u.rhlist.cursor.rowid_since)) {
+    const struct newsince_entry *e = newsince_ring_next(r->u.rhlist.cursor.rowid_since);
+    if (e == NULL)
+      return 0;
+    assert(e->rowid > r->u.rhlist.rowid_highest);
+    strbuf_puts(b, prefix);
+    strbuf_putc(b, '[');
+    strbuf_json_string(b, alloca_list_token(e->rowid));
+    strbuf_puts(b, e->row);
+    strbuf_puts(b, suffix);
+    if (!strbuf_overrun(b)) {
+      r->u.rhlist.cursor.rowid_since = e->rowid;
+      r->u.rhlist.rowid_highest = e->rowid;
+      ++r->u.rhlist.rowcount;
+    }
+    return 1;
+  }
+  int ret = rhizome_list_next(&r->u.rhlist.cursor);
+  if (ret != 1)
+    return ret;
+  rhizome_manifest *m = r->u.rhlist.cursor.manifest;
+  assert(m->filesize != RHIZOME_SIZE_UNSET);
+  rhizome_lookup_author(m);
+  strbuf_puts(b, prefix);
+  strbuf_putc(b, '[');
+  int has_token = m->rowid > r->u.rhlist.rowid_highest;
+  if (has_token)
+    strbuf_json_string(b, alloca_list_token(m->rowid));
+  else
+    strbuf_json_null(b);
+  strbuf_json_bundle_row_tail(b, m, m->authorship, &m->author);
+  strbuf_puts(b, suffix);
+  if (!strbuf_overrun(b)) {
+    if (has_token)
+      r->u.rhlist.rowid_highest = m->rowid;
+    rhizome_list_commit(&r->u.rhlist.cursor);
+    if (r->u.rhlist.cursor.rowid_since)
+      r->u.rhlist.cursor.rowid_since = m->rowid;
+    ++r->u.rhlist.rowcount;
+  }
+  return 1;
+}
+
 static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr, strbuf b)
 {
   httpd_request *r = (httpd_request *) hr;
-  const char *headers[] = {
-    ".token",
-    "_id",
-    "service",
-    "id",
-    "version",
-    "date",
-    ".inserttime",
-    ".author",
-    ".fromhere",
-    "filesize",
-    "filehash",
-    "sender",
-    "recipient",
-    "name"
-  };
   switch (r->u.rhlist.phase) {
     case LIST_HEADER:
-      strbuf_puts(b, "{\n\"header\":[");
-      unsigned i;
-      for (i = 0; i != NELS(headers); ++i) {
-	if (i)
-	  strbuf_putc(b, ',');
-	strbuf_json_string(b, headers[i]);
-      }
-      strbuf_puts(b, "],\n\"rows\":[");
+      strbuf_puts(b, "{\n\"header\":");
+      strbuf_json_bundlelist_header(b);
+      strbuf_puts(b, ",\n\"rows\":[");
       if (!strbuf_overrun(b))
 	r->u.rhlist.phase = LIST_ROWS;
       return 1;
     case LIST_FIRST:
     case LIST_ROWS:
       {
-	int ret = rhizome_list_next(&r->u.rhlist.cursor);
-	if (ret == -1)
-	  return -1;
-	if (ret == 0) {
-	  time_ms_t now;
-	  if (r->u.rhlist.cursor.rowid_since == 0 || (now = gettime_ms()) >= r->u.rhlist.end_time) {
-	    r->u.rhlist.phase = LIST_END;
-	    return 1;
-	  }
-	  http_request_pause_response(&r->http, r->u.rhlist.end_time);
-	  return 0;
-	}
-	rhizome_manifest *m = r->u.rhlist.cursor.manifest;
-	assert(m->filesize != RHIZOME_SIZE_UNSET);
-	rhizome_lookup_author(m);
-	if (r->u.rhlist.rowcount != 0)
-	  strbuf_putc(b, ',');
-	strbuf_puts(b, "\n[");
-	if (m->rowid > r->u.rhlist.rowid_highest) {
-	  strbuf_json_string(b, alloca_list_token(m->rowid));
-	  r->u.rhlist.rowid_highest = m->rowid;
-	} else
-	  strbuf_json_null(b);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, m->rowid);
-	strbuf_putc(b, ',');
-	strbuf_json_string(b, m->service);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, m->version);
-	strbuf_putc(b, ',');
-	if (m->has_date)
-	  strbuf_sprintf(b, "%"PRItime_ms_t, m->date);
-	else
-	  strbuf_json_null(b);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRItime_ms_t",", m->inserttime);
-	// The 'fromhere' flag indicates if the author is a known (unlocked) identity in the local
-	// keyring.  The values are 0 (no), 1 (yes), 2 (yes and cryptographically verified).  In the
-	// implementation below, the 0 value (no) is redundant, because it only occurs when the
-	// 'author' column is null, but in future the author SID might be reported for non-local
-	// authors, so clients should only use 'fromhere != 0', never 'author != null', to detect
-	// local authorship.
-	int fromhere = 0;
-	switch (m->authorship) {
-	  case AUTHOR_AUTHENTIC:
-	    fromhere = 2;
-	    strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
-	    break;
-	  case AUTHOR_LOCAL:
-	    fromhere = 1;
-	    strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
-	    break;
-	  default:
-	    strbuf_json_null(b);
-	    break;
-	}
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%d", fromhere);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, m->filesize);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->filesize ? m->filehash.binary : NULL, sizeof m->filehash.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->has_sender ? m->sender.binary : NULL, sizeof m->sender.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->has_recipient ? m->recipient.binary : NULL, sizeof m->recipient.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_string(b, m->name);
-	strbuf_puts(b, "]");
-	if (!strbuf_overrun(b)) {
-	  rhizome_list_commit(&r->u.rhlist.cursor);
-	  ++r->u.rhlist.rowcount;
+	int ret = bundlelist_append_row(r, b, r->u.rhlist.rowcount ? ",\n" : "\n", "");
+	if (ret != 0)
+	  return ret;
+	time_ms_t now;
+	if (r->u.rhlist.cursor.rowid_since == 0 || (now = gettime_ms()) >= r->u.rhlist.end_time) {
+	  r->u.rhlist.phase = LIST_END;
+	  return 1;
 	}
+	http_request_pause_response(&r->http, r->u.rhlist.end_time);
+	return 0;
       }
-      return 1;
     case LIST_END:
       strbuf_puts(b, "\n]\n}\n");
       if (!strbuf_overrun(b))
@@ -352,6 +569,50 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
   abort();
 }
 
+/* A "newsince" event stream never ends.  It is sent as Server-Sent Events: a "header" event whose
+ * data is the list of column names, followed by one event per bundle whose data is the bundle's
+ * row, in the same format as the rows of a JSON bundle list.  Whenever the stream has been idle
+ * for the keep-alive interval it sends a comment line, so that clients and proxies can tell that
+ * the connection is still alive.
+ *
+ * A slow client does not cause rows to accumulate in memory: rows are only generated when the
+ * response buffer has drained, and a client that falls so far behind that its position leaves the
+ * ring just continues from the database.
+ */
+static int restful_rhizome_newsince_events_content_chunk(struct http_request *hr, strbuf b)
+{
+  httpd_request *r = (httpd_request *) hr;
+  switch (r->u.rhlist.phase) {
+    case LIST_HEADER:
+      strbuf_puts(b, "event: header\ndata: ");
+      strbuf_json_bundlelist_header(b);
+      strbuf_puts(b, "\n\n");
+      if (!strbuf_overrun(b))
+	r->u.rhlist.phase = LIST_ROWS;
+      return 1;
+    case LIST_FIRST:
+    case LIST_ROWS:
+      {
+	int ret = bundlelist_append_row(r, b, "data: ", "\n\n");
+	if (ret != 0)
+	  return ret;
+	time_ms_t now = gettime_ms();
+	if (now >= r->u.rhlist.end_time) {
+	  strbuf_puts(b, ":\n\n");
+	  if (strbuf_overrun(b))
+	    return 1;
+	  r->u.rhlist.end_time = now + config.api.restful.stream_keepalive * 1000;
+	}
+	http_request_pause_response(&r->http, r->u.rhlist.end_time);
+	return 0;
+      }
+    case LIST_END:
+    case LIST_DONE:
+      return 0;
+  }
+  abort();
+}
+
 static HTTP_REQUEST_PARSER restful_rhizome_insert_end;
 static int insert_mime_part_start(struct http_request *);
 static int insert_mime_part_end(struct http_request *);
@@ -875,6 +875,12 @@ static void sync_neighbour_changed(struct subscriber *neighbour, uint8_t found,
 }
 DEFINE_TRIGGER(nbr_change, sync_neighbour_changed);
 
+static void sync_mark_subscribers()
+{
+  msp_mark_subscribers(sync_connections);
+}
+DEFINE_TRIGGER(subscriber_mark, sync_mark_subscribers);
+
 static void sync_bundle_add(rhizome_manifest *m)
 {
   if (!sync_tree){
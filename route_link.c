@@ -29,6 +29,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "server.h"
 #include "mdp_client.h"
 #include "route_link.h"
+#include "commandline.h"
 
 /*
 Link state routing;
@@ -50,9 +51,18 @@ Link state routing;
 #define FLAG_UNICAST (1<<3)
 #define FLAG_HAS_ACK (1<<4)
 #define FLAG_HAS_DROP_RATE (1<<5)
+// the version byte holds the sequence number of the sender's latest link state advertisement,
+// on a record about the sender itself at the start of each advertisement, or on an ack
+#define FLAG_SEQUENCE (1<<6)
+// an ack record asking the neighbour to advertise every link again
+#define FLAG_REFRESH (1<<7)
 
 #define ACK_WINDOW (16)
 
+// how many extra times do we advertise a changed link, in case a broadcast is lost?
+#define LINK_STATE_REPEAT (2)
+#define LINK_STATE_REPEAT_MS (500)
+
 struct link{
   struct link *_left;
   struct link *_right;
@@ -62,6 +72,10 @@ struct link{
   struct network_destination *destination;
   struct subscriber *receiver;
 
+  // list of links, from every neighbour, with the same transmitter
+  struct link *_next_sibling;
+  struct link **_prev_sibling;
+
   // What's the last ack we've heard so we don't process nacks twice.
   int last_ack_seq;
 
@@ -140,6 +154,11 @@ struct neighbour{
   int last_update_seq;
   time_ms_t rtt;
 
+  // sequence number of the last link state advertisement heard from this neighbour, or -1
+  int link_seq;
+  // have we missed an advertisement, and need to ask for a refresh?
+  char refresh_wanted;
+
   // un-balanced tree of known link states
   struct link *root;
 
@@ -156,14 +175,25 @@ struct link_state{
   struct subscriber *next_hop;
   struct subscriber *transmitter;
   int hop_count;
-  int route_version;
   // if a neighbour is free'd this link will point to invalid memory.
   // don't use this pointer directly, call find_best_link instead
   struct link *link;
   char calculating;
+  // does the best link need to be recalculated?
+  char dirty;
+  // last invalidate_routes() pass that visited this subscriber
+  unsigned invalidate_pass;
+
+  // links that any neighbour has heard from this subscriber.
+  // every route that could depend on our route to this subscriber is reachable from here.
+  struct link *children;
 
   // when do we need to send a new link state message.
   time_ms_t next_update;
+  // how many more times should a change be repeated before falling back to the slow refresh interval?
+  uint8_t repeat;
+  // which full refresh has this link been included in?
+  uint8_t refresh_seq;
 };
 
 DEFINE_ALARM(link_send);
@@ -172,7 +202,16 @@ static int neighbour_find_best_link(struct neighbour *n);
 
 struct neighbour *neighbours=NULL;
 unsigned neighbour_count=0;
-int route_version=0;
+
+// bumped whenever a neighbour needs to hear about every link we know, not just the changes
+static uint8_t refresh_seq=0;
+// sequence number of our next link state advertisement
+static uint8_t link_send_seq=0;
+
+// link state advertisement statistics
+static time_ms_t link_stats_start=0;
+static unsigned link_stats_records=0;
+static size_t link_stats_bytes=0;
 
 struct network_destination * new_destination(struct overlay_interface *interface){
   assert(interface);
@@ -247,11 +286,91 @@ static struct link_state *get_link_state(struct subscriber *subscriber)
 {
   if (!subscriber->link_state){
     subscriber->link_state = emalloc_zero(sizeof(struct link_state));
-    subscriber->link_state->route_version = route_version -1;
+    subscriber->link_state->dirty = 1;
   }
   return subscriber->link_state;
 }
 
+static unsigned invalidate_pass = 0;
+// subscribers waiting to have their children visited, kept between passes
+static struct subscriber **invalidate_stack = NULL;
+static size_t invalidate_stack_size = 0;
+
+static int mark_route_dirty(struct subscriber *subscriber, void *UNUSED(context))
+{
+  if (subscriber->link_state)
+    subscriber->link_state->dirty = 1;
+  return 0;
+}
+
+// Mark every route that might pass through this subscriber for recalculation, in a single pass that
+// visits each subscriber once. Routes that don't depend on this subscriber keep their cached best link.
+static void invalidate_routes_via(struct subscriber *subscriber)
+{
+  // link states start with pass 0, never use it
+  if (++invalidate_pass == 0)
+    invalidate_pass = 1;
+  struct link_state *state = get_link_state(subscriber);
+  state->invalidate_pass = invalidate_pass;
+  size_t depth = 0;
+  while(1){
+    // a child may be clean even if this subscriber was already dirty, so always keep going
+    struct link *child;
+    for (child = state->children; child; child = child->_next_sibling){
+      struct link_state *child_state = get_link_state(child->receiver);
+      if (child_state->invalidate_pass == invalidate_pass)
+	continue;
+      child_state->invalidate_pass = invalidate_pass;
+      child_state->dirty = 1;
+      if (depth == invalidate_stack_size){
+	size_t size = invalidate_stack_size ? invalidate_stack_size * 2 : 64;
+	struct subscriber **stack = erealloc(invalidate_stack, size * sizeof *stack);
+	if (!stack){
+	  // we can't tell which routes are left, so recalculate all of them
+	  enum_subscribers(NULL, mark_route_dirty, NULL);
+	  return;
+	}
+	invalidate_stack = stack;
+	invalidate_stack_size = size;
+      }
+      invalidate_stack[depth++] = child->receiver;
+    }
+    if (depth == 0)
+      break;
+    state = get_link_state(invalidate_stack[--depth]);
+  }
+}
+
+// Mark the route to this subscriber, and every route that might pass through it, for recalculation.
+static void invalidate_routes(struct subscriber *subscriber)
+{
+  get_link_state(subscriber)->dirty = 1;
+  invalidate_routes_via(subscriber);
+}
+
+static void set_link_transmitter(struct link *link, struct subscriber *transmitter)
+{
+  if (link->transmitter == transmitter)
+    return;
+  if (link->_prev_sibling){
+    *link->_prev_sibling = link->_next_sibling;
+    if (link->_next_sibling)
+      link->_next_sibling->_prev_sibling = link->_prev_sibling;
+    link->_next_sibling = NULL;
+    link->_prev_sibling = NULL;
+  }
+  link->transmitter = transmitter;
+  link->parent = NULL;
+  if (transmitter){
+    struct link_state *state = get_link_state(transmitter);
+    link->_next_sibling = state->children;
+    if (state->children)
+      state->children->_prev_sibling = &link->_next_sibling;
+    link->_prev_sibling = &state->children;
+    state->children = link;
+  }
+}
+
 static struct neighbour *get_neighbour(struct subscriber *subscriber, char create)
 {
   struct neighbour *n = neighbours;
@@ -265,12 +384,15 @@ static struct neighbour *get_neighbour(struct subscriber *subscriber, char creat
     n->subscriber = subscriber;
     n->_next = neighbours;
     n->last_update_seq = -1;
+    n->link_seq = -1;
     n->mdp_ack_sequence = -1;
     // TODO measure min/max rtt
     n->rtt = 120;
     n->next_neighbour_update = gettime_ms() + 10;
     neighbours = n;
     neighbour_count++;
+    // a new neighbour knows nothing about our links
+    refresh_seq++;
     
     if (neighbour_count==1){
       time_ms_t now = gettime_ms();
@@ -290,6 +412,7 @@ static void free_links(struct link *link)
   link->_left=NULL;
   free_links(link->_right);
   link->_right=NULL;
+  set_link_transmitter(link, NULL);
   if (link->destination)
     release_destination_ref(link->destination);
   free(link);
@@ -380,7 +503,7 @@ static struct link * find_best_link(struct subscriber *subscriber)
     RETURN(NULL);
     
   struct link_state *state = get_link_state(subscriber);
-  if (state->route_version == route_version)
+  if (!state->dirty)
     RETURN(state->link);
 
   if (state->calculating)
@@ -435,7 +558,7 @@ next:
   state->next_hop = next_hop;
   state->transmitter = transmitter;
   state->hop_count = best_hop_count;
-  state->route_version = route_version;
+  state->dirty = 0;
   state->calculating = 0;
   state->link = best_link;
   
@@ -452,8 +575,12 @@ next:
     DEBUGF2(overlayrouting, linkstate, "REACHABLE via self %s", alloca_tohex_sid_t(subscriber->sid));
   }
   
-  if (changed)
+  if (changed){
     state->next_update = now+5;
+    state->repeat = LINK_STATE_REPEAT;
+    // anything routed through this subscriber may need to change too
+    invalidate_routes_via(subscriber);
+  }
 
   RETURN(best_link);
 }
@@ -496,6 +623,24 @@ static int append_link_state(struct overlay_buffer *payload, char flags,
   return 0;
 }
 
+// Only changes need to be sent promptly, and repeated a couple of times in case they were lost.
+// Unchanged links are repeated slowly, or sooner when a new neighbour needs a full refresh.
+static int link_state_due(struct link_state *state, time_ms_t now)
+{
+  return state->next_update - 20 <= now || state->refresh_seq != refresh_seq;
+}
+
+static void link_state_sent(struct link_state *state, time_ms_t now)
+{
+  link_stats_records++;
+  state->refresh_seq = refresh_seq;
+  if (state->repeat){
+    state->repeat--;
+    state->next_update = now + LINK_STATE_REPEAT_MS;
+  }else
+    state->next_update = now + config.mdp.link_state_refresh_ms;
+}
+
 static int append_link(struct subscriber *subscriber, void *context)
 {
   if (subscriber == my_subscriber)
@@ -511,14 +656,13 @@ static int append_link(struct subscriber *subscriber, void *context)
   time_ms_t now = gettime_ms();
 
   if (subscriber->reachable==REACHABLE_SELF){
-    if (state->next_update - 20 <= now){
+    if (link_state_due(state, now)){
       // Other entries in our keyring are always one hop away from us.
-      if (append_link_state(payload, 0, my_subscriber, subscriber, -1, 1, -1, 0, 0)){
+      if (append_link_state(payload, 0, my_subscriber, subscriber, -1, 1, -1, 0, -1)){
         ALARM_STRUCT(link_send).alarm = now+5;
         return 1;
       }
-      // include information about this link every 5s
-      state->next_update = now + 5000;
+      link_state_sent(state, now);
     }
   } else {
     
@@ -530,14 +674,15 @@ static int append_link(struct subscriber *subscriber, void *context)
       // never mention links we shouldn't advertise
       state->next_update = TIME_MS_NEVER_WILL;
     }else{
-      if (state->next_update - 20 <= now){
+      if (link_state_due(state, now)){
+	// receivers assume a drop rate of zero when it is omitted
+	int drop_rate = best_link?best_link->drop_rate:32;
 	if (append_link_state(payload, 0, state->transmitter, subscriber, -1, 
-	    best_link?best_link->link_version:-1, -1, 0, best_link?best_link->drop_rate:32)){
+	    best_link?best_link->link_version:-1, -1, 0, drop_rate?drop_rate:-1)){
 	  ALARM_STRUCT(link_send).alarm = now+5;
 	  return 1;
 	}
-	// include information about this link every 5s
-	state->next_update = now + 5000;
+	link_state_sent(state, now);
       }
     }
   }
@@ -568,6 +713,8 @@ static void free_neighbour(struct neighbour **neighbour_ptr){
     free(l);
   }
   
+  // any route that was using this neighbour is about to point to a free'd link
+  invalidate_routes(n->subscriber);
   free_links(n->root);
   n->root=NULL;
   *neighbour_ptr = n->_next;
@@ -612,12 +759,12 @@ static void clean_neighbours(time_ms_t now)
       }
     }
     
-    // when all links to a neighbour that we were directly routing to expire, force a routing calculation update
+    // when all links to a neighbour that we were directly routing to expire, 
+    // force a routing calculation update of everything routed through them
     struct link_state *state = get_link_state(subscriber);
     if (state->next_hop == subscriber && 
-	(n->link_in_timeout < now || !n->links || !alive) && 
-	state->route_version == route_version)
-      route_version++;
+	(n->link_in_timeout < now || !n->links || !alive))
+      invalidate_routes(subscriber);
       
     if (!n->links || !alive){
       free_neighbour(n_ptr);
@@ -864,11 +1011,17 @@ static int send_neighbour_link(struct neighbour *n)
       flags|=FLAG_UNICAST;
     else
       flags|=FLAG_BROADCAST;
+    if (n->refresh_wanted){
+      flags|=FLAG_REFRESH;
+      n->refresh_wanted=0;
+    }
+    // so they notice if they missed our last advertisement, even if we have nothing more to say
+    flags|=FLAG_SEQUENCE;
 
     DEBUGF(ack, "LINK STATE; Sending ack to %s for seq %d", alloca_tohex_sid_t(n->subscriber->sid), n->best_link->ack_sequence);
     
-    append_link_state(frame->payload, flags, n->subscriber, my_subscriber, n->best_link->neighbour_interface, 1,
-	              n->best_link->ack_sequence, n->best_link->ack_mask, -1);
+    append_link_state(frame->payload, flags, n->subscriber, my_subscriber, n->best_link->neighbour_interface,
+		      (uint8_t)(link_send_seq - 1), n->best_link->ack_sequence, n->best_link->ack_mask, -1);
     if (overlay_payload_enqueue(frame) == -1)
       op_free(frame);
 
@@ -951,17 +1104,33 @@ void link_send(struct sched_ent *alarm)
     
     ob_limitsize(payload, 400);
     
-    ob_checkpoint(payload);
+    // number each advertisement, so neighbours can tell when they have missed a change.
+    // Older neighbours ignore this record, as it is about a link to the sender
+    append_link_state(payload, FLAG_SEQUENCE, NULL, my_subscriber, -1, link_send_seq, -1, 0, -1);
     size_t pos = ob_position(payload);
     enum_subscribers(NULL, append_link, payload);
     ob_rewind(payload);
     
     if (ob_position(payload) != pos){
+      link_send_seq++;
+      link_stats_bytes += ob_position(payload);
       ob_flip(payload);
       overlay_send_frame(&header, payload);
     }
     ob_free(payload);
   }
+  if (IF_DEBUG(linkstate)){
+    time_ms_t now = gettime_ms();
+    if (link_stats_start==0)
+      link_stats_start = now;
+    else if (now - link_stats_start >= 60000){
+      DEBUGF(linkstate, "LINK STATE; advertised %u links in %zu bytes over %"PRId64"ms",
+	      link_stats_records, link_stats_bytes, now - link_stats_start);
+      link_stats_start = now;
+      link_stats_records = 0;
+      link_stats_bytes = 0;
+    }
+  }
   time_ms_t allowed=gettime_ms()+5;
   if (alarm->alarm < allowed)
     alarm->alarm = allowed;
@@ -1315,6 +1484,26 @@ int link_received_packet(struct decode_context *context, int sender_seq, uint8_t
 
 // parse incoming link details
 DEFINE_BINDING(MDP_PORT_LINKSTATE, link_receive);
+// Changes are only advertised a few times, so if we missed an advertisement, ask for every link again.
+// seq is the neighbour's latest advertisement, which we have just heard if heard is set.
+static void link_sequence_received(struct neighbour *neighbour, int seq, int heard, time_ms_t now)
+{
+  if (neighbour->link_seq != -1){
+    int delta = (seq - neighbour->link_seq)&0xFF;
+    // a duplicate, or a little late. Anything else out of order means they restarted
+    if (delta == 0 || delta >= 0xF0)
+      return;
+    if (delta > heard){
+      DEBUGF(linkstate, "LINK STATE; missed %d advertisements from %s, asking for a refresh",
+	     delta - heard, alloca_tohex_sid_t(neighbour->subscriber->sid));
+      neighbour->refresh_wanted = 1;
+      neighbour->next_neighbour_update = now + 5;
+      update_alarm(__WHENCE__, neighbour->next_neighbour_update);
+    }
+  }
+  neighbour->link_seq = seq;
+}
+
 static int link_receive(struct internal_mdp_header *header, struct overlay_buffer *payload)
 {
   IN();
@@ -1400,6 +1589,16 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
 	      ack_mask,
 	      drop_rate);
 
+    if (flags & FLAG_SEQUENCE){
+      if (!transmitter){
+	if (receiver == header->source)
+	  link_sequence_received(neighbour, version, 1, now);
+	continue;
+      }
+      if (receiver == header->source && transmitter == my_subscriber)
+	link_sequence_received(neighbour, version, 0, now);
+    }
+
     if (transmitter && transmitter!=my_subscriber && transmitter->reachable==REACHABLE_SELF){
       // Our neighbour is talking about a path *from* a secondary SID of ours? Impossible.
       // Maybe we decoded an abbreviation incorrectly and this indicates a SID collision.
@@ -1489,6 +1688,13 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
       if (neighbour->link_in_timeout < now || version<0){
 	changed = 1;
 	version++;
+	// they may have forgotten everything we told them
+	refresh_seq++;
+      }else if (flags & FLAG_REFRESH){
+	// they missed one of our advertisements
+	DEBUGF(linkstate, "LINK STATE; neighbour %s asked for a refresh", alloca_tohex_sid_t(header->source->sid));
+	refresh_seq++;
+	update_alarm(__WHENCE__, now + 5);
       }
       neighbour->link_in_timeout = now + interface->destination->ifconfig.reachable_timeout_ms;
 
@@ -1526,17 +1732,17 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
 
     if (link->transmitter != transmitter || link->link_version != version){
       changed = 1;
-      link->transmitter = transmitter;
+      set_link_transmitter(link, transmitter);
       link->link_version = version & 0xFF;
       link->drop_rate = drop_rate;
       // TODO other link attributes...
+      invalidate_routes(receiver);
     }
   }
 
   send_please_explain(&context, my_subscriber, header->source);
 
   if (changed){
-    route_version++;
     neighbour->path_version ++;
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
@@ -1562,6 +1768,48 @@ static void link_interface_change(struct overlay_interface *UNUSED(interface))
 
 DEFINE_TRIGGER(iupdown, link_interface_change);
 
+static void mark_links(struct link *link)
+{
+  if (!link)
+    return;
+  mark_links(link->_left);
+  mark_links(link->_right);
+  mark_subscriber_in_use(link->transmitter);
+  mark_subscriber_in_use(link->receiver);
+}
+
+static int mark_link_state(struct subscriber *subscriber, void *UNUSED(context))
+{
+  if (subscriber->link_state){
+    mark_subscriber_in_use(subscriber->link_state->next_hop);
+    mark_subscriber_in_use(subscriber->link_state->transmitter);
+  }
+  return 0;
+}
+
+static void link_mark_subscribers()
+{
+  struct neighbour *n;
+  for (n = neighbours; n; n = n->_next){
+    mark_subscriber_in_use(n->subscriber);
+    mark_links(n->root);
+  }
+  enum_subscribers(NULL, mark_link_state, NULL);
+}
+
+DEFINE_TRIGGER(subscriber_mark, link_mark_subscribers);
+
+// discard the routing state of a subscriber that is about to be forgotten
+void link_state_forget(struct subscriber *subscriber)
+{
+  if (subscriber->link_state){
+    // links still transmitted by this subscriber would keep it marked as in use
+    assert(!subscriber->link_state->children);
+    free(subscriber->link_state);
+    subscriber->link_state = NULL;
+  }
+}
+
 /* if an ancient node on the network uses their old protocol to tell us that they can hear us;
   - send the same format back at them
   - treat the link as up.
@@ -1591,7 +1839,7 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   if (link->transmitter != my_subscriber)
     changed = 1;
 
-  link->transmitter = my_subscriber;
+  set_link_transmitter(link, my_subscriber);
   link->link_version = 1;
   link->destination = interface->destination;
 
@@ -1606,7 +1854,7 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   neighbour->link_in_timeout = now + link->destination->ifconfig.reachable_timeout_ms;
 
   if (changed){
-    route_version++;
+    invalidate_routes(frame->source);
     neighbour->path_version ++;
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
@@ -1616,3 +1864,80 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   return 0;
 }
 
+
+DEFINE_CMD(app_route_test, 0,
+  "Run route invalidation speed test",
+  "test","routes","[--count=<count>]");
+static int app_route_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *opt_count;
+  if (cli_arg(parsed, "--count", &opt_count, cli_uint, "2000") == -1)
+    return -1;
+  unsigned count = atoi(opt_count);
+  if (count < 2)
+    count = 2;
+
+  /* Every subscriber is heard via the first, and via the one before it, so when the route to the
+     first changes every route needs to be recalculated. The chain is far deeper than the C stack
+     could follow one call per hop.
+   */
+  struct subscriber **subscribers = emalloc(count * sizeof *subscribers);
+  struct link *links = emalloc_zero(2 * count * sizeof *links);
+  if (!subscribers || !links){
+    free(subscribers);
+    free(links);
+    return -1;
+  }
+  sid_t sid;
+  memset(sid.binary, 0x33, sizeof sid.binary);
+  unsigned i, nlinks = 0;
+  for (i = 0; i < count; i++){
+    memcpy(sid.binary, &i, sizeof i);
+    subscribers[i] = find_subscriber(sid.binary, SID_SIZE, 1);
+    if (!subscribers[i]){
+      free(subscribers);
+      free(links);
+      return WHY("Could not create subscribers");
+    }
+    if (i == 0)
+      continue;
+    links[nlinks].receiver = subscribers[i];
+    set_link_transmitter(&links[nlinks++], subscribers[0]);
+    if (i == 1)
+      continue;
+    links[nlinks].receiver = subscribers[i];
+    set_link_transmitter(&links[nlinks++], subscribers[i-1]);
+  }
+
+  unsigned repeats = 10;
+  struct link *child;
+  time_us_t start = gettime_us();
+  for (i = 0; i < repeats; i++){
+    for (child = get_link_state(subscribers[0])->children; child; child = child->_next_sibling)
+      invalidate_routes(child->receiver);
+  }
+  time_us_t per_child = gettime_us();
+  for (i = 0; i < repeats; i++)
+    invalidate_routes_via(subscribers[0]);
+  time_us_t end = gettime_us();
+
+  unsigned dirty = 0;
+  for (i = 1; i < count; i++)
+    if (get_link_state(subscribers[i])->dirty)
+      dirty++;
+  cli_printf(context, "%u routes through one subscriber, %u links, %u invalidated\n",
+	     count - 1, nlinks, dirty);
+  cli_printf(context, "mean time to invalidate via each child = %.2fus\n", (per_child - start) * 1.0 / repeats);
+  cli_printf(context, "mean time to invalidate in one pass = %.2fus\n", (end - per_child) * 1.0 / repeats);
+
+  for (i = 0; i < nlinks; i++)
+    set_link_transmitter(&links[i], NULL);
+  for (i = 0; i < count; i++){
+    free(subscribers[i]->link_state);
+    subscribers[i]->link_state = NULL;
+  }
+  free(links);
+  free(subscribers);
+  return 0;
+}
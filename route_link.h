@@ -42,6 +42,7 @@ int link_received_packet(struct decode_context *context, int sender_seq, uint8_t
 int link_unicast_ack(struct subscriber *subscriber, struct overlay_interface *interface, struct socket_address *addr);
 void link_explained(struct subscriber *subscriber);
 int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now);
+void link_state_forget(struct subscriber *subscriber);
 
 DECLARE_TRIGGER(nbr_change, struct subscriber *neighbour, uint8_t found, unsigned count);
 DECLARE_TRIGGER(link_change, struct subscriber *subscriber, int prior_reachable);
@@ -201,6 +201,8 @@ int overlayServerMode(void);
 int _overlay_payload_enqueue(struct __sourceloc whence, struct overlay_frame *p);
 #define overlay_payload_enqueue(P) _overlay_payload_enqueue(__WHENCE__,P)
 int overlay_queue_remaining(int queue);
+int overlay_queue_reserve(int queue);
+void overlay_queue_release(int queue);
 int overlay_queue_schedule_next(time_ms_t next_allowed_packet);
 int overlay_send_tick_packet(struct network_destination *destination);
 int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *destination, uint32_t ack_mask, int ack_seq);
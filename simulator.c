@@ -509,9 +509,9 @@ static int console_up(const struct cli_parsed *parsed, struct cli_context *UNUSE
     DEBUGF(verbose, "Will drop %d%% of packets", n->drop_packets);
     DEBUGF(verbose, "Will %s broadcast packets", n->drop_broadcast?"drop":"allow");
     DEBUGF(verbose, "Will %s unicast packets", n->drop_unicast?"drop":"allow");
-    DEBUGF(verbose, "Allowing a maximum of %d packets every %"PRId64"ms",
-	  n->limit.burst_size,
-	  n->limit.burst_length);
+    DEBUGF(verbose, "Allowing a packet every %"PRIu32"us, in bursts of up to %d",
+	  n->limit.rate_micro_seconds,
+	  n->limit.burst_size);
   }
   return 0;
 }
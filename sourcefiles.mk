@@ -50,6 +50,7 @@ SERVAL_DAEMON_SOURCES = \
 	keyring_cli.c \
 	network_cli.c \
 	crypto.c \
+	crypto_worker.c \
 	directory_client.c \
 	dna_helper.c \
 	golay.c \
@@ -110,6 +111,7 @@ TEST_SOURCES = \
 	commandline.c \
 	main.c \
 	test_cli.c \
+	overlay_buffer.c \
 	log_context.c \
 	log_stderr.c \
 	context1.c
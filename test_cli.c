@@ -24,6 +24,8 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "cli.h"
 #include "serval_types.h"
@@ -32,6 +34,7 @@
 #include "conf.h"
 #include "commandline.h"
 #include "mem.h"
+#include "overlay_buffer.h"
 
 void cli_cleanup(){}
 void cf_on_config_change(){}
@@ -123,6 +126,53 @@ static int app_crypt_test(const struct cli_parsed *parsed, struct cli_context *c
 	   (end-start)*1.0/i);
   }
 
+  cli_printf(context, "Benchmarking repeated signature verification:\n");
+  {
+    /* Signed frames are verified over the SHA-512 of the message. Once a frame has been verified,
+       another copy of it only costs the hash and a comparison with the remembered hash, signature
+       and key. */
+    unsigned char sign_pk[crypto_sign_PUBLICKEYBYTES];
+    unsigned char sign_sk[crypto_sign_SECRETKEYBYTES];
+    if (crypto_sign_keypair(sign_pk,sign_sk))
+      return WHY("crypto_sign_keypair() failed.\n");
+
+    unsigned char message[1024];
+    unsigned char hash[crypto_hash_sha512_BYTES];
+    unsigned char sig[crypto_sign_BYTES];
+    randombytes_buf(message, sizeof message);
+    crypto_hash_sha512(hash, message, sizeof message);
+    if (crypto_sign_detached(sig, NULL, hash, sizeof hash, sign_sk))
+      return WHY("crypto_sign_detached() failed.\n");
+
+    unsigned char seen_pk[crypto_sign_PUBLICKEYBYTES];
+    unsigned char seen_hash[crypto_hash_sha512_BYTES];
+    unsigned char seen_sig[crypto_sign_BYTES];
+    memcpy(seen_pk, sign_pk, sizeof seen_pk);
+    memcpy(seen_hash, hash, sizeof seen_hash);
+    memcpy(seen_sig, sig, sizeof seen_sig);
+
+    int repeats=1000;
+    time_us_t start = gettime_us();
+    for(i=0;i<repeats;i++) {
+      crypto_hash_sha512(hash, message, sizeof message);
+      if (crypto_sign_verify_detached(sig, hash, sizeof hash, sign_pk))
+	return WHYF("crypto_sign_verify_detached() failed (i=%d).\n",i);
+    }
+    time_us_t verified = gettime_us();
+    for(i=0;i<repeats;i++) {
+      crypto_hash_sha512(hash, message, sizeof message);
+      if (memcmp(seen_hash, hash, sizeof hash)
+	|| memcmp(seen_sig, sig, sizeof sig)
+	|| memcmp(seen_pk, sign_pk, sizeof sign_pk))
+	return WHYF("Repeated message does not match (i=%d).\n",i);
+    }
+    time_us_t end = gettime_us();
+    cli_printf(context, "%zu byte message - mean first copy verification time = %.2fus\n",
+	   sizeof message, (verified-start)*1.0/repeats);
+    cli_printf(context, "%zu byte message - mean repeated copy verification time = %.2fus\n",
+	   sizeof message, (end-verified)*1.0/repeats);
+  }
+
   /* We can't do public signing with a crypto_box key, but we should be able to
      do shared-secret generation using crypto_sign keys. */
   {
@@ -250,6 +300,171 @@ static int app_mem_test(const struct cli_parsed *UNUSED(parsed), struct cli_cont
   return 0;
 }
 
+DEFINE_CMD(app_dgram_test, 0,
+   "Run loopback UDP receive speed test",
+   "test","dgram","[--count=<count>]");
+static int app_dgram_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *opt_count;
+  if (cli_arg(parsed, "--count", &opt_count, cli_uint, "100000") == -1)
+    return -1;
+  unsigned count = atoi(opt_count);
+  if (count == 0)
+    count = 1;
+
+  int ret = -1;
+  int rx = socket(AF_INET, SOCK_DGRAM, 0);
+  int tx = socket(AF_INET, SOCK_DGRAM, 0);
+  if (rx == -1 || tx == -1) {
+    WHY_perror("socket");
+    goto end;
+  }
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof addr;
+  bzero(&addr, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(rx, (struct sockaddr *)&addr, sizeof addr) == -1 || getsockname(rx, (struct sockaddr *)&addr, &addrlen) == -1) {
+    WHY_perror("bind");
+    goto end;
+  }
+
+  // Packets are sent in rounds of one batch, so the socket buffer never overflows, and only the
+  // time taken to read them is counted.
+  unsigned char packet[256];
+  bzero(packet, sizeof packet);
+#ifdef HAVE_RECVMMSG
+  const unsigned max_batch = 32;
+  unsigned char packets[32][sizeof packet];
+  struct iovec iovs[32];
+  struct mmsghdr msgs[32];
+#else
+  const unsigned max_batch = 1;
+#endif
+  unsigned batch;
+  cli_printf(context, "Benchmarking loopback UDP receive of %zu byte packets:\n", sizeof packet);
+  for (batch = 1; batch <= max_batch; batch *= 2) {
+    unsigned received = 0;
+    time_us_t elapsed = 0;
+    while (received < count) {
+      unsigned i;
+      for (i = 0; i < batch; ++i) {
+	if (sendto(tx, packet, sizeof packet, 0, (struct sockaddr *)&addr, sizeof addr) == -1) {
+	  WHY_perror("sendto");
+	  goto end;
+	}
+      }
+      time_us_t start = gettime_us();
+#ifdef HAVE_RECVMMSG
+      if (batch > 1) {
+	for (i = 0; i < batch; ++i) {
+	  iovs[i].iov_base = packets[i];
+	  iovs[i].iov_len = sizeof packets[i];
+	  bzero(&msgs[i], sizeof msgs[i]);
+	  msgs[i].msg_hdr.msg_iov = &iovs[i];
+	  msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (i = 0; i < batch; ) {
+	  int n = recvmmsg(rx, &msgs[i], batch - i, 0, NULL);
+	  if (n == -1) {
+	    WHY_perror("recvmmsg");
+	    goto end;
+	  }
+	  i += n;
+	}
+      } else
+#endif
+      for (i = 0; i < batch; ++i) {
+	if (recv(rx, packet, sizeof packet, 0) == -1) {
+	  WHY_perror("recv");
+	  goto end;
+	}
+      }
+      elapsed += gettime_us() - start;
+      received += batch;
+    }
+    if (elapsed == 0)
+      elapsed = 1;
+    cli_printf(context, "batch of %u - %u packets took %"PRId64"ms - %.0f packets per second\n",
+	   batch, received, (int64_t)(elapsed / 1000), received * 1000000.0 / elapsed);
+  }
+  ret = 0;
+end:
+  if (rx != -1)
+    close(rx);
+  if (tx != -1)
+    close(tx);
+  return ret;
+}
+
+DEFINE_CMD(app_buffer_test, 0,
+   "Run overlay buffer allocation test",
+   "test","buffers","[--count=<count>]");
+static int app_buffer_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *opt_count;
+  if (cli_arg(parsed, "--count", &opt_count, cli_uint, "100000") == -1)
+    return -1;
+  unsigned count = atoi(opt_count);
+  if (count == 0)
+    count = 1;
+
+  // Each packet is built like an outgoing overlay packet, from a few separately built payloads,
+  // then parsed like an incoming one, with a slice for each payload.
+  const unsigned frames = 4;
+  unsigned char payload[200];
+  bzero(payload, sizeof payload);
+  unsigned heap_start, pool_start, heap_end, pool_end;
+  ob_alloc_counts(&heap_start, &pool_start);
+  time_us_t start = gettime_us();
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    struct overlay_buffer *b = ob_new();
+    if (b == NULL)
+      return -1;
+    ob_limitsize(b, 1200);
+    ob_append_byte(b, 0);
+    ob_append_bytes(b, payload, 32);
+    unsigned j;
+    for (j = 0; j < frames; ++j) {
+      struct overlay_buffer *p = ob_new();
+      if (p == NULL)
+	return -1;
+      ob_append_bytes(p, payload, sizeof payload);
+      ob_append_ui16(b, ob_position(p));
+      ob_append_bytes(b, ob_ptr(p), ob_position(p));
+      ob_free(p);
+    }
+    if (ob_overrun(b))
+      return WHY("Packet overrun");
+    struct overlay_buffer *rx = ob_static(ob_ptr(b), ob_position(b));
+    if (rx == NULL)
+      return -1;
+    ob_limitsize(rx, ob_position(b));
+    ob_skip(rx, 33);
+    for (j = 0; j < frames; ++j) {
+      size_t len = ob_get_ui16(rx);
+      struct overlay_buffer *f = ob_slice(rx, ob_position(rx), len);
+      if (f == NULL)
+	return -1;
+      ob_limitsize(f, len);
+      ob_skip(rx, len);
+      ob_free(f);
+    }
+    ob_free(rx);
+    ob_free(b);
+  }
+  time_us_t end = gettime_us();
+  ob_alloc_counts(&heap_end, &pool_end);
+  cli_printf(context, "%u packets of %u frames took %"PRId64"ms - mean time = %.2fus\n",
+	 count, frames, (int64_t)((end - start) / 1000), (end - start) * 1.0 / count);
+  cli_printf(context, "heap allocations per packet = %.3f\n", (heap_end - heap_start) * 1.0 / count);
+  cli_printf(context, "pool allocations per packet = %.3f\n", (pool_end - pool_start) * 1.0 / count);
+  return 0;
+}
+
 DEFINE_CMD(app_config_test, 0,
    "Load a test config file and log various fields",
    "config","test","<file>");
@@ -191,6 +191,18 @@ struct vomp_call_state vomp_call_states[VOMP_MAX_CALLS];
 struct profile_total vomp_stats;
 
 static void vomp_process_tick(struct sched_ent *alarm);
+
+static void vomp_mark_subscribers()
+{
+  unsigned i;
+  for (i = 0; i < vomp_call_count; i++){
+    mark_subscriber_in_use(vomp_call_states[i].local.subscriber);
+    mark_subscriber_in_use(vomp_call_states[i].remote.subscriber);
+  }
+}
+
+DEFINE_TRIGGER(subscriber_mark, vomp_mark_subscribers);
+
 strbuf strbuf_append_vomp_supported_codecs(strbuf sb, const unsigned char supported_codecs[256]);
 
 